@@ -0,0 +1,873 @@
+/**
+ * @file loadgen.c
+ * @brief This file contains the load generator which drives pairs of hosts and
+ * targets through the server and reports its performance.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "global.h"
+#include "latency.h"
+#include "protocol.h"
+
+/* Largest number of entries in the mix of data sizes */
+#define MAX_SIZE_CLASSES 16
+
+/* Bodies carry the time they were sent in their first bytes */
+#define STAMP_SIZE sizeof(uint64_t)
+
+/**
+ * @brief Size of data bodies and how often it is chosen
+ */
+struct size_class {
+    size_t size;
+    uint32_t weight;
+};
+
+/**
+ * @brief Parameters of the run shared by all pairs
+ */
+struct config {
+    struct sockaddr_in address;
+    size_t num_pairs;
+    uint64_t num_messages;
+    /* Data messages per second of each host, 0 sends as fast as possible */
+    double data_rate;
+    /* Events per second of each host, 0 sends no events */
+    double event_rate;
+    /* Transmission policy asked by hosts, sessions get no options if unset */
+    bool_t is_transmission_set;
+    enum transmission_mode transmission;
+    struct size_class sizes[MAX_SIZE_CLASSES];
+    size_t num_sizes;
+    uint32_t total_weight;
+    size_t max_size;
+};
+
+/**
+ * @brief Host and target connected through one session
+ */
+struct pair {
+    pthread_t host_thread;
+    pthread_t target_thread;
+    int32_t host_fd;
+    int32_t target_fd;
+    uint16_t session_id;
+    uint64_t random;
+    bool_t is_connected;
+    /* Written by the host thread */
+    uint64_t sent_data;
+    uint64_t sent_events;
+    uint64_t sent_bytes;
+    bool_t is_send_failed;
+    /* Written by the target thread */
+    uint64_t received_data;
+    uint64_t received_events;
+    uint64_t received_bytes;
+    bool_t is_receive_failed;
+};
+
+/**
+ * @brief CPU time and memory of a process
+ */
+struct process_usage {
+    double user_time;
+    double system_time;
+    /* Resident and peak resident sizes in KiB */
+    uint64_t rss;
+    uint64_t peak_rss;
+};
+
+static struct config config;
+
+/* Hosts wait here until every pair is connected */
+static pthread_barrier_t start_barrier;
+
+/**
+ * @brief Send the whole request
+ * @return true on success
+ */
+static bool_t send_all(int32_t fd, struct iovec *iov, int32_t iovcnt)
+{
+    while (iovcnt > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = (size_t)iovcnt};
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        /* Skip the written part */
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + sent;
+            iov->iov_len -= (size_t)sent;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Receive exactly size bytes
+ * @return true on success, false for errors and closed connections
+ */
+static bool_t receive_all(int32_t fd, void *buffer, size_t size)
+{
+    uint8_t *position = buffer;
+
+    while (size > 0) {
+        ssize_t received = recv(fd, position, size, 0);
+
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (received <= 0) {
+            return false;
+        }
+
+        position += received;
+        size -= (size_t)received;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Send a request with the given body
+ */
+static bool_t send_request(int32_t fd, enum request_type type, enum role role,
+                           uint16_t session_id, void *body, size_t body_size)
+{
+    struct request_header header;
+    memset(&header, 0, sizeof(header));
+    header.type = type;
+    header.role = role;
+    header.session_id = session_id;
+    header.body_size = body_size;
+
+    struct iovec iov[2] = {{.iov_base = &header, .iov_len = sizeof(header)},
+                           {.iov_base = body, .iov_len = body_size}};
+
+    return send_all(fd, iov, body_size > 0 ? 2 : 1);
+}
+
+/**
+ * @brief Receive a response header and skip its body
+ */
+static bool_t receive_reply(int32_t fd, struct response_header *header)
+{
+    if (!receive_all(fd, header, sizeof(*header))) {
+        return false;
+    }
+
+    uint8_t body[256];
+
+    for (size_t left = header->body_size; left > 0;) {
+        size_t size = left < sizeof(body) ? left : sizeof(body);
+
+        if (!receive_all(fd, body, size)) {
+            return false;
+        }
+        left -= size;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Open a connection to the server
+ * @return Socket or -1 for errors
+ */
+static int32_t connect_to_server(void)
+{
+    int32_t fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&config.address,
+                sizeof(config.address)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    /* Small requests must not wait for acknowledgements of previous ones */
+    int32_t enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    return fd;
+}
+
+/**
+ * @brief Connect the host and the target of a pair through a new session
+ * @return true on success
+ */
+static bool_t connect_pair(struct pair *pair)
+{
+    struct response_header reply;
+    struct session_options options = {.max_targets = 1,
+                                      .transmission = config.transmission};
+
+    pair->host_fd = connect_to_server();
+
+    if (pair->host_fd == -1 ||
+        !send_request(pair->host_fd, REQUEST_MAKE_SESSION, ROLE_HOST, 0,
+                      &options,
+                      config.is_transmission_set ? sizeof(options) : 0) ||
+        !receive_reply(pair->host_fd, &reply) ||
+        reply.type != RESPONSE_MAKE_SESSION_SUCCESS) {
+        return false;
+    }
+
+    pair->session_id = reply.session_id;
+    pair->target_fd = connect_to_server();
+
+    if (pair->target_fd == -1 ||
+        !send_request(pair->target_fd, REQUEST_JOIN_SESSION, ROLE_TARGET,
+                      pair->session_id, NULL, 0) ||
+        !receive_reply(pair->target_fd, &reply) ||
+        reply.type != RESPONSE_JOIN_SESSION_SUCCESS) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Receive messages of the host until it closes the session and
+ * record their latencies
+ */
+static void *target_routine(void *arg)
+{
+    struct pair *pair = arg;
+    uint8_t *body = malloc(config.max_size);
+
+    while (body != NULL) {
+        struct response_header header;
+
+        if (!receive_all(pair->target_fd, &header, sizeof(header))) {
+            break;
+        }
+
+        if (header.type == RESPONSE_SESSION_CLOSED_BY_HOST) {
+            free(body);
+            return NULL;
+        }
+
+        if ((header.type != RESPONSE_DATA &&
+             header.type != RESPONSE_RAISE_EVENT) ||
+            header.body_size < STAMP_SIZE ||
+            header.body_size > config.max_size ||
+            !receive_all(pair->target_fd, body, header.body_size)) {
+            break;
+        }
+
+        struct latency_mark mark = {.path = LATENCY_PATH_HOST_DATA};
+        memcpy(&mark.start, body, STAMP_SIZE);
+
+        if (header.type == RESPONSE_RAISE_EVENT) {
+            mark.path = LATENCY_PATH_HOST_EVENT;
+            pair->received_events++;
+        } else {
+            pair->received_data++;
+        }
+
+        pair->received_bytes += sizeof(header) + header.body_size;
+        latency_record(&mark);
+    }
+
+    pair->is_receive_failed = true;
+    free(body);
+
+    return NULL;
+}
+
+/**
+ * @brief Choose the size of the next data body from the mix
+ */
+static size_t next_size(struct pair *pair)
+{
+    /* xorshift64 */
+    pair->random ^= pair->random << 13;
+    pair->random ^= pair->random >> 7;
+    pair->random ^= pair->random << 17;
+
+    uint32_t point = (uint32_t)(pair->random % config.total_weight);
+
+    for (size_t i = 0;; i++) {
+        if (point < config.sizes[i].weight) {
+            return config.sizes[i].size;
+        }
+        point -= config.sizes[i].weight;
+    }
+}
+
+/**
+ * @brief Sleep until the monotonic time
+ */
+static void sleep_until(uint64_t time)
+{
+    struct timespec deadline = {.tv_sec = (time_t)(time / 1000000000u),
+                                .tv_nsec = (long)(time % 1000000000u)};
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+           EINTR) {
+    }
+}
+
+/**
+ * @brief Send the messages of the host. Paced messages are stamped with the
+ * time they were due, so a stalled server does not hide its own delay.
+ */
+static void send_messages(struct pair *pair, uint8_t *body)
+{
+    uint64_t data_interval =
+        config.data_rate > 0 ? (uint64_t)(1e9 / config.data_rate) : 0;
+    uint64_t event_interval =
+        config.event_rate > 0 ? (uint64_t)(1e9 / config.event_rate) : 0;
+    uint64_t now = latency_now();
+    uint64_t next_data = now;
+    uint64_t next_event =
+        event_interval > 0 ? now + event_interval : UINT64_MAX;
+
+    while (pair->sent_data < config.num_messages) {
+        now = latency_now();
+
+        if (data_interval == 0) {
+            next_data = now;
+        }
+
+        bool_t is_event = next_event <= next_data;
+        uint64_t due = is_event ? next_event : next_data;
+
+        if (due > now) {
+            sleep_until(due);
+            now = latency_now();
+        }
+
+        uint64_t stamp = data_interval == 0 && !is_event ? now : due;
+        size_t size = is_event ? STAMP_SIZE : next_size(pair);
+        memcpy(body, &stamp, STAMP_SIZE);
+
+        if (!send_request(pair->host_fd,
+                          is_event ? REQUEST_RAISE_EVENT : REQUEST_DATA,
+                          ROLE_HOST, pair->session_id, body, size)) {
+            pair->is_send_failed = true;
+            return;
+        }
+
+        pair->sent_bytes += sizeof(struct request_header) + size;
+
+        if (is_event) {
+            pair->sent_events++;
+            next_event += event_interval;
+        } else {
+            pair->sent_data++;
+            next_data += data_interval;
+        }
+    }
+}
+
+/**
+ * @brief Connect the pair, wait for the others and run the host
+ */
+static void *host_routine(void *arg)
+{
+    struct pair *pair = arg;
+
+    pair->is_connected = connect_pair(pair);
+
+    if (pair->is_connected &&
+        pthread_create(&pair->target_thread, NULL, target_routine, pair) !=
+            0) {
+        pair->is_connected = false;
+    }
+
+    pthread_barrier_wait(&start_barrier);
+
+    if (!pair->is_connected) {
+        return NULL;
+    }
+
+    uint8_t *body = calloc(1, config.max_size);
+
+    if (body != NULL) {
+        send_messages(pair, body);
+        free(body);
+    } else {
+        pair->is_send_failed = true;
+    }
+
+    /* The target stops after the notification about the closed session */
+    if (pair->is_send_failed ||
+        !send_request(pair->host_fd, REQUEST_CLOSE_SESSION, ROLE_HOST,
+                      pair->session_id, NULL, 0)) {
+        shutdown(pair->target_fd, SHUT_RDWR);
+    }
+
+    pthread_join(pair->target_thread, NULL);
+
+    return NULL;
+}
+
+/**
+ * @brief Wait until the server accepts connections
+ * @return true if the server is up
+ */
+static bool_t wait_for_server(void)
+{
+    for (int32_t attempt = 0; attempt < 100; attempt++) {
+        int32_t fd = connect_to_server();
+
+        if (fd != -1) {
+            close(fd);
+            return true;
+        }
+
+        if (errno != ECONNREFUSED) {
+            break;
+        }
+
+        sleep_until(latency_now() + 50000000u);
+    }
+
+    fprintf(stderr, "Unable to connect to %s:%u: %s\n",
+            inet_ntoa(config.address.sin_addr),
+            ntohs(config.address.sin_port), strerror(errno));
+
+    return false;
+}
+
+/**
+ * @brief Read CPU time and memory of a process from procfs
+ * @return true on success
+ */
+static bool_t read_process_usage(pid_t pid, struct process_usage *usage)
+{
+    char_t path[64];
+    char_t line[512];
+    unsigned long user_ticks;
+    unsigned long system_ticks;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    /* The name of the program may contain spaces, fields follow it */
+    char_t *fields = fgets(line, sizeof(line), file) != NULL
+                         ? strrchr(line, ')')
+                         : NULL;
+    fclose(file);
+
+    if (fields == NULL ||
+        sscanf(fields, ") %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &user_ticks, &system_ticks) != 2) {
+        return false;
+    }
+
+    double ticks_per_second = (double)sysconf(_SC_CLK_TCK);
+    usage->user_time = (double)user_ticks / ticks_per_second;
+    usage->system_time = (double)system_ticks / ticks_per_second;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    file = fopen(path, "r");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        sscanf(line, "VmRSS: %" SCNu64, &usage->rss);
+        sscanf(line, "VmHWM: %" SCNu64, &usage->peak_rss);
+    }
+    fclose(file);
+
+    return true;
+}
+
+/**
+ * @brief Get CPU time of the load generator itself
+ */
+static void read_own_usage(struct process_usage *usage)
+{
+    struct rusage rusage;
+    getrusage(RUSAGE_SELF, &rusage);
+
+    usage->user_time =
+        (double)rusage.ru_utime.tv_sec + rusage.ru_utime.tv_usec / 1e6;
+    usage->system_time =
+        (double)rusage.ru_stime.tv_sec + rusage.ru_stime.tv_usec / 1e6;
+    usage->rss = 0;
+    usage->peak_rss = (uint64_t)rusage.ru_maxrss;
+}
+
+/**
+ * @brief Print percentiles of a measured path
+ */
+static void print_latency(const char_t *name, enum latency_path path)
+{
+    struct latency_histogram histogram;
+    latency_merge(path, &histogram);
+
+    if (histogram.total == 0) {
+        return;
+    }
+
+    printf("%-16s p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+           name, latency_percentile(&histogram, 50) / 1e3,
+           latency_percentile(&histogram, 99) / 1e3,
+           latency_percentile(&histogram, 99.9) / 1e3, histogram.max / 1e3);
+}
+
+/**
+ * @brief Print CPU time spent during the run and memory of a process
+ */
+static void print_usage_delta(const char_t *name,
+                              const struct process_usage *before,
+                              const struct process_usage *after,
+                              double elapsed)
+{
+    double user_time = after->user_time - before->user_time;
+    double system_time = after->system_time - before->system_time;
+
+    printf("%-16s CPU %.2f s user, %.2f s system (%.0f%% of one CPU)", name,
+           user_time, system_time,
+           elapsed > 0 ? (user_time + system_time) / elapsed * 100 : 0);
+
+    if (after->rss > 0) {
+        printf(", RSS %" PRIu64 " KiB", after->rss);
+    }
+    printf(", peak RSS %" PRIu64 " KiB\n", after->peak_rss);
+}
+
+/**
+ * @brief Parse the mix of data sizes, SIZE[:WEIGHT] separated by commas
+ * @return true on success
+ */
+static bool_t parse_sizes(char_t *list)
+{
+    config.num_sizes = 0;
+    config.total_weight = 0;
+    config.max_size = STAMP_SIZE;
+
+    for (char_t *save, *item = strtok_r(list, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        char_t *end;
+        unsigned long long size = strtoull(item, &end, 10);
+        unsigned long weight = 1;
+
+        if (*end == ':') {
+            weight = strtoul(end + 1, &end, 10);
+        }
+
+        if (*end != '\0' || end == item || weight == 0 ||
+            config.num_sizes == MAX_SIZE_CLASSES) {
+            return false;
+        }
+
+        /* Every body holds at least the stamp */
+        size_t body_size = size < STAMP_SIZE ? STAMP_SIZE : (size_t)size;
+
+        config.sizes[config.num_sizes++] =
+            (struct size_class){.size = body_size, .weight = (uint32_t)weight};
+        config.total_weight += (uint32_t)weight;
+
+        if (body_size > config.max_size) {
+            config.max_size = body_size;
+        }
+    }
+
+    return config.num_sizes > 0;
+}
+
+/**
+ * @brief Print usage of the load generator
+ */
+static void usage(void)
+{
+    printf(
+        "Usage:\n"
+        "  %s [-a IP_ADDRESS] [-p PORT_NUM] [-n COUNT] [-m COUNT] [-s SIZES]\n"
+        "  [-r RATE] [-e RATE] [-T POLICY] [-x PID] | [-h]\n"
+        "\n"
+        "Options:\n"
+        "  -a, --address=IP_ADDRESS   connect to the server at IP_ADDRESS,\n"
+        "                             default: 127.0.0.1\n"
+        "  -p, --port=PORT_NUM        connect to PORT_NUM, default: 65000\n"
+        "  -n, --pairs=COUNT          run COUNT host/target pairs, default: 16\n"
+        "  -m, --messages=COUNT       each host sends COUNT data requests,\n"
+        "                             default: 10000\n"
+        "  -s, --sizes=SIZES          mix of data body sizes, SIZE[:WEIGHT] separated\n"
+        "                             by commas, default: 64:6,1024:3,65536:1\n"
+        "  -r, --data-rate=RATE       each host sends RATE data requests per second,\n"
+        "                             default: as fast as possible\n"
+        "  -e, --event-rate=RATE      each host raises RATE events per second,\n"
+        "                             default: 0\n"
+        "  -T, --transmission=POLICY  ask for the transmission POLICY of sessions:\n"
+        "                             auto, latency or throughput, default: none\n"
+        "  -x, --server-pid=PID       report CPU time and memory of the server PID\n"
+        "  -h, --help                 give this help list\n"
+        "\n"
+        "Latencies are measured from sending to receiving a message, paced\n"
+        "messages are measured from the time they were due.\n",
+        PROGRAM_NAME);
+}
+
+int32_t main(int32_t argc, char_t *argv[])
+{
+    const char_t *addr = "127.0.0.1";
+    int32_t port = 65000;
+    pid_t server_pid = 0;
+    char_t default_sizes[] = "64:6,1024:3,65536:1";
+
+    config.num_pairs = 16;
+    config.num_messages = 10000;
+    parse_sizes(default_sizes);
+
+    static struct option long_options[] = {
+        {"address", required_argument, NULL, 'a'},
+        {"port", required_argument, NULL, 'p'},
+        {"pairs", required_argument, NULL, 'n'},
+        {"messages", required_argument, NULL, 'm'},
+        {"sizes", required_argument, NULL, 's'},
+        {"data-rate", required_argument, NULL, 'r'},
+        {"event-rate", required_argument, NULL, 'e'},
+        {"transmission", required_argument, NULL, 'T'},
+        {"server-pid", required_argument, NULL, 'x'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, false, NULL, '\0'}};
+
+    while (true) {
+        int c = getopt_long(argc, argv, "a:p:n:m:s:r:e:T:x:h", long_options,
+                            NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'a':
+            addr = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            config.num_pairs = (size_t)atol(optarg);
+            if (config.num_pairs == 0) {
+                printf("Invalid number of pairs: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            config.num_messages = (uint64_t)atoll(optarg);
+            break;
+        case 's':
+            if (!parse_sizes(optarg)) {
+                printf("Invalid mix of sizes: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            config.data_rate = atof(optarg);
+            break;
+        case 'e':
+            config.event_rate = atof(optarg);
+            break;
+        case 'T':
+            if (strcmp(optarg, "auto") == 0) {
+                config.transmission = TRANSMISSION_AUTO;
+            } else if (strcmp(optarg, "latency") == 0) {
+                config.transmission = TRANSMISSION_LATENCY;
+            } else if (strcmp(optarg, "throughput") == 0) {
+                config.transmission = TRANSMISSION_THROUGHPUT;
+            } else {
+                printf("Invalid transmission policy: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            config.is_transmission_set = true;
+            break;
+        case 'x':
+            server_pid = (pid_t)atoi(optarg);
+            break;
+        case 'h':
+        default: /* '?' */
+            usage();
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    config.address.sin_family = AF_INET;
+    config.address.sin_port = htons((uint16_t)port);
+
+    if (inet_pton(AF_INET, addr, &config.address.sin_addr) != 1) {
+        printf("Invalid address: %s\n", addr);
+        return EXIT_FAILURE;
+    }
+
+    if (!wait_for_server()) {
+        return EXIT_FAILURE;
+    }
+
+    struct pair *pairs = calloc(config.num_pairs, sizeof(struct pair));
+
+    if (pairs == NULL) {
+        fprintf(stderr, "Unable to allocate %zu pairs\n", config.num_pairs);
+        return EXIT_FAILURE;
+    }
+
+    struct process_usage server_before = {0};
+    struct process_usage server_after = {0};
+    struct process_usage own_before;
+    struct process_usage own_after;
+
+    if (server_pid > 0 && !read_process_usage(server_pid, &server_before)) {
+        fprintf(stderr, "Unable to read usage of process %d\n",
+                (int)server_pid);
+        server_pid = 0;
+    }
+    read_own_usage(&own_before);
+
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)config.num_pairs + 1);
+
+    uint64_t setup_start = latency_now();
+    size_t num_started = 0;
+
+    for (size_t i = 0; i < config.num_pairs; i++) {
+        pairs[i].host_fd = -1;
+        pairs[i].target_fd = -1;
+        pairs[i].random = 0x9e3779b97f4a7c15u * (i + 1);
+
+        if (pthread_create(&pairs[i].host_thread, NULL, host_routine,
+                           &pairs[i]) != 0) {
+            fprintf(stderr, "Unable to start pair %zu\n", i);
+            exit(EXIT_FAILURE);
+        }
+        num_started++;
+    }
+
+    pthread_barrier_wait(&start_barrier);
+
+    uint64_t traffic_start = latency_now();
+
+    for (size_t i = 0; i < num_started; i++) {
+        pthread_join(pairs[i].host_thread, NULL);
+    }
+
+    uint64_t traffic_end = latency_now();
+
+    if (server_pid > 0) {
+        read_process_usage(server_pid, &server_after);
+    }
+    read_own_usage(&own_after);
+
+    size_t num_connected = 0;
+    size_t num_failed = 0;
+    uint64_t sent_messages = 0;
+    uint64_t received_data = 0;
+    uint64_t received_events = 0;
+    uint64_t received_bytes = 0;
+
+    for (size_t i = 0; i < config.num_pairs; i++) {
+        struct pair *pair = &pairs[i];
+
+        num_connected += pair->is_connected;
+        num_failed += pair->is_send_failed || pair->is_receive_failed;
+        sent_messages += pair->sent_data + pair->sent_events;
+        received_data += pair->received_data;
+        received_events += pair->received_events;
+        received_bytes += pair->received_bytes;
+
+        if (pair->host_fd != -1) {
+            close(pair->host_fd);
+        }
+        if (pair->target_fd != -1) {
+            close(pair->target_fd);
+        }
+    }
+
+    double setup_time = (double)(traffic_start - setup_start) / 1e9;
+    double elapsed = (double)(traffic_end - traffic_start) / 1e9;
+    uint64_t received_messages = received_data + received_events;
+
+    printf("Pairs:           %zu connected, %zu not connected, %zu failed\n",
+           num_connected, config.num_pairs - num_connected, num_failed);
+    printf("Setup:           %zu connections in %.3f s, %.1f connections/s\n",
+           2 * num_connected, setup_time,
+           setup_time > 0 ? 2 * num_connected / setup_time : 0);
+    printf("Messages:        %" PRIu64 " data, %" PRIu64 " events, %" PRIu64
+           " lost in %.3f s\n",
+           received_data, received_events, sent_messages - received_messages,
+           elapsed);
+
+    if (elapsed > 0) {
+        printf("Throughput:      %.1f messages/s, %.1f MiB/s\n",
+               received_messages / elapsed,
+               received_bytes / elapsed / (1024 * 1024));
+    }
+
+    print_latency("Data latency:", LATENCY_PATH_HOST_DATA);
+    print_latency("Event latency:", LATENCY_PATH_HOST_EVENT);
+
+    if (server_pid > 0) {
+        print_usage_delta("Server:", &server_before, &server_after, elapsed);
+    }
+    print_usage_delta("Load generator:", &own_before, &own_after, elapsed);
+
+    pthread_barrier_destroy(&start_barrier);
+    free(pairs);
+
+    return num_connected == config.num_pairs && num_failed == 0
+               ? EXIT_SUCCESS
+               : EXIT_FAILURE;
+}
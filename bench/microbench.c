@@ -0,0 +1,416 @@
+/**
+ * @file microbench.c
+ * @brief This file contains microbenchmarks of the session table and the
+ * session id allocator.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "global.h"
+#include "session.h"
+#include "session_id.h"
+
+/* The table starts small, so filling it includes its growth */
+#define INITIAL_SESSIONS 1024
+
+/* Largest number of threads of contention benchmarks */
+#define MAX_THREADS 64
+
+/**
+ * @brief Shares of the identifier space filled with sessions
+ */
+static const double fill_factors[] = {0.1, 0.25, 0.5, 0.75, 0.9};
+
+/**
+ * @brief Sessions currently in the table, in no particular order
+ */
+static uint16_t ids[SESSION_ID_MAX_COUNT];
+static size_t num_of_ids;
+
+/**
+ * @brief Identifiers which are never in the table during lookups of missing
+ * sessions
+ */
+static uint16_t missing_ids[SESSION_ID_MAX_COUNT];
+static size_t num_of_missing_ids;
+
+/**
+ * @brief Work of one thread of a contention benchmark
+ */
+struct worker {
+    pthread_t thread;
+    void (*run)(struct worker *worker);
+    uint64_t random;
+    uint64_t operations;
+};
+
+static pthread_barrier_t start_barrier;
+
+/**
+ * @brief Get the monotonic time in ns
+ */
+static uint64_t now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+/**
+ * @brief Get the next value of a xorshift64 generator
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    return *state;
+}
+
+/**
+ * @brief Print one result line
+ * @param name Benchmark
+ * @param fill Share of identifiers in use
+ * @param threads Number of threads
+ * @param operations Number of operations of all threads
+ * @param elapsed Wall time in ns
+ */
+static void report(const char_t *name, double fill, size_t threads,
+                   uint64_t operations, uint64_t elapsed)
+{
+    double ns_per_op = operations > 0 ? (double)elapsed / operations : 0;
+
+    printf("%s\t%.2f\t%zu\t%" PRIu64 "\t%.1f\t%.3f\n", name, fill, threads,
+           operations, ns_per_op,
+           elapsed > 0 ? operations * 1e3 / elapsed : 0);
+}
+
+/**
+ * @brief Allocate an identifier and add its session
+ * @return true on success
+ */
+static bool_t add_session(void)
+{
+    uint16_t id;
+
+    if (session_id_alloc(&id) == -1 || session_add(id) == NULL) {
+        return false;
+    }
+
+    ids[num_of_ids++] = id;
+
+    return true;
+}
+
+/**
+ * @brief Remove the session of ids[index] and release its identifier
+ */
+static void remove_session(size_t index)
+{
+    uint16_t id = ids[index];
+    struct session_info *session = session_acquire(id);
+
+    pthread_mutex_unlock(&session->lock);
+    session_remove(session);
+    session_id_release(id);
+
+    ids[index] = ids[--num_of_ids];
+}
+
+/**
+ * @brief Collect identifiers which are not in the table
+ */
+static void collect_missing_ids(void)
+{
+    static bool_t is_used[SESSION_ID_MAX_COUNT];
+
+    memset(is_used, 0, sizeof(is_used));
+
+    for (size_t i = 0; i < num_of_ids; i++) {
+        is_used[ids[i]] = true;
+    }
+
+    num_of_missing_ids = 0;
+
+    for (size_t id = 0; id < SESSION_ID_MAX_COUNT; id++) {
+        if (!is_used[id]) {
+            missing_ids[num_of_missing_ids++] = (uint16_t)id;
+        }
+    }
+}
+
+/**
+ * @brief Look up random sessions of the table
+ */
+static void run_lookup_hit(struct worker *worker)
+{
+    for (uint64_t i = 0; i < worker->operations; i++) {
+        uint16_t id = ids[next_random(&worker->random) % num_of_ids];
+        struct session_info *session = session_acquire(id);
+
+        if (session == NULL) {
+            fprintf(stderr, "Session %u is lost\n", id);
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_unlock(&session->lock);
+    }
+}
+
+/**
+ * @brief Look up random identifiers which have no session
+ */
+static void run_lookup_miss(struct worker *worker)
+{
+    for (uint64_t i = 0; i < worker->operations; i++) {
+        uint16_t id =
+            missing_ids[next_random(&worker->random) % num_of_missing_ids];
+
+        if (session_acquire(id) != NULL) {
+            fprintf(stderr, "Session %u is unexpected\n", id);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * @brief Allocate and release identifiers
+ */
+static void run_id_cycle(struct worker *worker)
+{
+    for (uint64_t i = 0; i < worker->operations; i++) {
+        uint16_t id;
+
+        if (session_id_alloc(&id) == -1) {
+            fprintf(stderr, "Identifiers are exhausted\n");
+            exit(EXIT_FAILURE);
+        }
+        session_id_release(id);
+    }
+}
+
+/**
+ * @brief Start the routine of a worker together with the others
+ */
+static void *worker_routine(void *arg)
+{
+    struct worker *worker = arg;
+
+    pthread_barrier_wait(&start_barrier);
+    worker->run(worker);
+
+    return NULL;
+}
+
+/**
+ * @brief Split operations between threads which run at the same time
+ * @return Wall time in ns
+ */
+static uint64_t run_workers(void (*run)(struct worker *worker),
+                            size_t num_threads, uint64_t operations)
+{
+    struct worker workers[MAX_THREADS];
+
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)num_threads + 1);
+
+    for (size_t i = 0; i < num_threads; i++) {
+        workers[i] = (struct worker){.run = run,
+                                     .random = 0x9e3779b97f4a7c15u * (i + 1),
+                                     .operations = operations / num_threads};
+        pthread_create(&workers[i].thread, NULL, worker_routine, &workers[i]);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now();
+
+    for (size_t i = 0; i < num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    uint64_t elapsed = now() - start;
+    pthread_barrier_destroy(&start_barrier);
+
+    return elapsed;
+}
+
+/**
+ * @brief Run the benchmarks of the table filled to the share
+ * @param fill Share of identifiers in use
+ * @param operations Number of operations of each benchmark
+ * @param max_threads Largest number of threads of contention benchmarks
+ */
+static void bench_fill(double fill, uint64_t operations, size_t max_threads)
+{
+    size_t target = (size_t)(fill * SESSION_ID_MAX_COUNT);
+    size_t added = target - num_of_ids;
+    uint64_t random = 0x2545f4914f6cdd1du;
+
+    /* Filling grows the table from the size of the previous level */
+    uint64_t start = now();
+
+    while (num_of_ids < target) {
+        if (!add_session()) {
+            fprintf(stderr, "Unable to add session\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    report("session_add", fill, 1, added, now() - start);
+
+    collect_missing_ids();
+
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        report("session_acquire_hit", fill, threads, operations,
+               run_workers(run_lookup_hit, threads, operations));
+    }
+
+    report("session_acquire_miss", fill, 1, operations,
+           run_workers(run_lookup_miss, 1, operations));
+
+    /* Removal and insertion at a constant fill, as sessions come and go */
+    start = now();
+
+    for (uint64_t i = 0; i < operations; i++) {
+        remove_session(next_random(&random) % num_of_ids);
+        add_session();
+    }
+
+    report("churn_remove_add", fill, 1, operations, now() - start);
+
+    /* Lookups must not slow down with the number of removed sessions */
+    report("session_acquire_hit_after_churn", fill, 1, operations,
+           run_workers(run_lookup_hit, 1, operations));
+
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        report("session_id_alloc_release", fill, threads, operations,
+               run_workers(run_id_cycle, threads, operations));
+    }
+}
+
+/**
+ * @brief Remove all sessions and measure the removal
+ * @param fill Share of identifiers in use
+ */
+static void bench_remove_all(double fill)
+{
+    size_t removed = num_of_ids;
+    uint64_t start = now();
+
+    while (num_of_ids > 0) {
+        remove_session(num_of_ids - 1);
+    }
+
+    report("session_remove", fill, 1, removed, now() - start);
+}
+
+/**
+ * @brief Print usage of the benchmarks
+ */
+static void usage(void)
+{
+    printf("Usage:\n"
+           "  %s [-n COUNT] [-t COUNT] | [-h]\n"
+           "\n"
+           "Options:\n"
+           "  -n, --operations=COUNT   run COUNT operations per benchmark,\n"
+           "                           default: 1000000\n"
+           "  -t, --threads=COUNT      contend with up to COUNT threads,\n"
+           "                           default: 8\n"
+           "  -h, --help               give this help list\n"
+           "\n"
+           "Results are printed as tab separated values with a header line:\n"
+           "benchmark, fill factor of the identifier space, threads,\n"
+           "operations, wall time per operation in ns and millions of\n"
+           "operations per second of all threads.\n",
+           PROGRAM_NAME);
+}
+
+int32_t main(int32_t argc, char_t *argv[])
+{
+    uint64_t operations = 1000000;
+    size_t max_threads = 8;
+
+    static struct option long_options[] = {
+        {"operations", required_argument, NULL, 'n'},
+        {"threads", required_argument, NULL, 't'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, false, NULL, '\0'}};
+
+    while (true) {
+        int c = getopt_long(argc, argv, "n:t:h", long_options, NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'n':
+            operations = (uint64_t)atoll(optarg);
+            if (operations == 0) {
+                printf("Invalid number of operations: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            max_threads = (size_t)atol(optarg);
+            if (max_threads == 0 || max_threads > MAX_THREADS) {
+                printf("Invalid number of threads: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+        default: /* '?' */
+            usage();
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    if (session_id_init(SESSION_ID_MAX_COUNT) == -1) {
+        fprintf(stderr, "Unable to initialize session ids\n");
+        return EXIT_FAILURE;
+    }
+
+    session_init_table(INITIAL_SESSIONS);
+
+    printf("benchmark\tfill\tthreads\toperations\tns_per_op\tmops\n");
+
+    /* Levels are filled one after another, then the table is emptied */
+    size_t num_fills = sizeof(fill_factors) / sizeof(fill_factors[0]);
+
+    for (size_t i = 0; i < num_fills; i++) {
+        bench_fill(fill_factors[i], operations, max_threads);
+        fflush(stdout);
+    }
+
+    bench_remove_all(fill_factors[num_fills - 1]);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,370 @@
+/**
+ * @file buffer_pool.c
+ * @brief This file contains definitions for the size-class pool of buffers
+ * lent to messages in flight.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "buffer_pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "global.h"
+
+/* Capacity of the smallest class */
+#define MIN_CLASS_CAPACITY ((size_t)1024)
+
+/* Class index of buffers larger than the largest class */
+#define OVERSIZE_CLASS BUFFER_POOL_NUM_CLASSES
+
+/* Bytes of one class kept by the cache of a thread */
+static const size_t thread_cache_size = 512 * 1024;
+
+/* Bytes of one class kept by the shared depot, the rest is freed */
+static const size_t depot_size = 2 * 1024 * 1024;
+
+/**
+ * @brief Header placed in front of each buffer. Keeps the data aligned like
+ * memory returned by malloc.
+ */
+union buffer_header {
+    struct {
+        /* Next free buffer, used while the buffer is in a free list */
+        union buffer_header *next;
+        size_t size_class;
+    } info;
+    max_align_t align;
+};
+
+/**
+ * @brief List of free buffers of one class
+ */
+struct free_list {
+    union buffer_header *head;
+    size_t count;
+};
+
+/**
+ * @brief Free buffers owned by one thread, no locking is needed
+ */
+struct thread_cache {
+    struct free_list lists[BUFFER_POOL_NUM_CLASSES];
+};
+
+/**
+ * @brief Free buffers shared by all threads
+ */
+struct depot {
+    pthread_mutex_t lock;
+    struct free_list list;
+};
+
+/**
+ * @brief Counters of one class
+ */
+struct class_counters {
+    atomic_uint_least64_t hits;
+    atomic_uint_least64_t misses;
+    atomic_size_t in_use;
+    atomic_size_t high_water;
+};
+
+static _Thread_local struct thread_cache thread_cache;
+
+/* Set once the cache of the thread is registered for cleanup */
+static _Thread_local bool_t is_cache_registered;
+
+/* Key whose destructor moves the cache of an exiting thread to the depot */
+static pthread_key_t cache_key;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static struct depot depots[BUFFER_POOL_NUM_CLASSES];
+
+static struct class_counters counters[BUFFER_POOL_NUM_CLASSES];
+
+/**
+ * @brief Get the capacity of buffers of a class
+ * @param size_class Class index
+ * @return Capacity in bytes
+ */
+static size_t class_capacity(size_t size_class)
+{
+    return MIN_CLASS_CAPACITY << size_class;
+}
+
+/**
+ * @brief Find the smallest class which holds the requested size
+ * @param size Requested size
+ * @return Class index or OVERSIZE_CLASS
+ */
+static size_t find_class(size_t size)
+{
+    size_t size_class = 0;
+
+    while (size_class < BUFFER_POOL_NUM_CLASSES &&
+           class_capacity(size_class) < size) {
+        size_class++;
+    }
+
+    return size_class;
+}
+
+/**
+ * @brief Get the number of buffers of a class kept by a free list, at least
+ * two so that a buffer can be taken and returned without touching the depot
+ * @param size_class Class index
+ * @param bytes Number of bytes the list may keep
+ * @return Number of buffers
+ */
+static size_t list_limit(size_t size_class, size_t bytes)
+{
+    size_t limit = bytes / class_capacity(size_class);
+
+    return limit < 2 ? 2 : limit;
+}
+
+/**
+ * @brief Move buffers of a class from the cache of the thread to the depot,
+ * buffers which do not fit into the depot are freed
+ * @param size_class Class index
+ * @param count Number of buffers to move
+ */
+static void spill_to_depot(size_t size_class, size_t count)
+{
+    struct free_list *list = &thread_cache.lists[size_class];
+    struct depot *depot = &depots[size_class];
+    size_t depot_limit = list_limit(size_class, depot_size);
+
+    pthread_mutex_lock(&depot->lock);
+
+    while (count > 0 && list->head != NULL) {
+        union buffer_header *header = list->head;
+        list->head = header->info.next;
+        list->count--;
+        count--;
+
+        if (depot->list.count < depot_limit) {
+            header->info.next = depot->list.head;
+            depot->list.head = header;
+            depot->list.count++;
+        } else {
+            free(header);
+        }
+    }
+
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/**
+ * @brief Move up to half of the cache limit of buffers from the depot to the
+ * cache of the thread
+ * @param size_class Class index
+ */
+static void refill_from_depot(size_t size_class)
+{
+    struct free_list *list = &thread_cache.lists[size_class];
+    struct depot *depot = &depots[size_class];
+    size_t count = list_limit(size_class, thread_cache_size) / 2;
+
+    pthread_mutex_lock(&depot->lock);
+
+    while (count > 0 && depot->list.head != NULL) {
+        union buffer_header *header = depot->list.head;
+        depot->list.head = header->info.next;
+        depot->list.count--;
+        count--;
+
+        header->info.next = list->head;
+        list->head = header;
+        list->count++;
+    }
+
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/**
+ * @brief Destructor of the cache key, hands the buffers of an exiting thread
+ * over to the depot
+ * @param value Unused
+ */
+static void release_thread_cache(void *value)
+{
+    (void)value;
+
+    for (size_t i = 0; i < BUFFER_POOL_NUM_CLASSES; i++) {
+        spill_to_depot(i, thread_cache.lists[i].count);
+    }
+}
+
+/**
+ * @brief Initialize the depots and the cache key once per process
+ */
+static void init_pool(void)
+{
+    for (size_t i = 0; i < BUFFER_POOL_NUM_CLASSES; i++) {
+        pthread_mutex_init(&depots[i].lock, NULL);
+    }
+
+    pthread_key_create(&cache_key, release_thread_cache);
+}
+
+/**
+ * @brief Make sure the cache of the calling thread is released when the
+ * thread exits
+ */
+static void register_thread_cache(void)
+{
+    if (is_cache_registered) {
+        return;
+    }
+
+    pthread_once(&init_once, init_pool);
+
+    /* Any non-NULL value makes the destructor run */
+    pthread_setspecific(cache_key, &thread_cache);
+    is_cache_registered = true;
+}
+
+void *buffer_pool_get(size_t size, size_t *capacity)
+{
+    size_t size_class = find_class(size);
+    union buffer_header *header;
+
+    if (size_class == OVERSIZE_CLASS) {
+        header = malloc(sizeof(union buffer_header) + size);
+
+        if (header == NULL) {
+            return NULL;
+        }
+
+        header->info.size_class = OVERSIZE_CLASS;
+
+        if (capacity != NULL) {
+            *capacity = size;
+        }
+
+        return header + 1;
+    }
+
+    register_thread_cache();
+
+    struct free_list *list = &thread_cache.lists[size_class];
+    struct class_counters *class_counters = &counters[size_class];
+
+    if (list->head == NULL) {
+        refill_from_depot(size_class);
+    }
+
+    if (list->head != NULL) {
+        header = list->head;
+        list->head = header->info.next;
+        list->count--;
+        atomic_fetch_add_explicit(&class_counters->hits, 1,
+                                  memory_order_relaxed);
+    } else {
+        header = malloc(sizeof(union buffer_header) +
+                        class_capacity(size_class));
+
+        if (header == NULL) {
+            return NULL;
+        }
+
+        header->info.size_class = size_class;
+        atomic_fetch_add_explicit(&class_counters->misses, 1,
+                                  memory_order_relaxed);
+    }
+
+    size_t in_use = atomic_fetch_add_explicit(&class_counters->in_use, 1,
+                                              memory_order_relaxed) +
+                    1;
+    size_t high_water =
+        atomic_load_explicit(&class_counters->high_water, memory_order_relaxed);
+
+    while (in_use > high_water &&
+           !atomic_compare_exchange_weak_explicit(
+               &class_counters->high_water, &high_water, in_use,
+               memory_order_relaxed, memory_order_relaxed)) {
+    }
+
+    if (capacity != NULL) {
+        *capacity = class_capacity(size_class);
+    }
+
+    return header + 1;
+}
+
+void buffer_pool_put(void *buffer)
+{
+    if (buffer == NULL) {
+        return;
+    }
+
+    union buffer_header *header = (union buffer_header *)buffer - 1;
+    size_t size_class = header->info.size_class;
+
+    if (size_class == OVERSIZE_CLASS) {
+        free(header);
+        return;
+    }
+
+    register_thread_cache();
+
+    atomic_fetch_sub_explicit(&counters[size_class].in_use, 1,
+                              memory_order_relaxed);
+
+    struct free_list *list = &thread_cache.lists[size_class];
+    size_t limit = list_limit(size_class, thread_cache_size);
+
+    header->info.next = list->head;
+    list->head = header;
+    list->count++;
+
+    /* Keep half, so the next get or put does not touch the depot again */
+    if (list->count > limit) {
+        spill_to_depot(size_class, list->count - limit / 2);
+    }
+}
+
+void buffer_pool_get_stats(struct buffer_pool_stats *stats)
+{
+    for (size_t i = 0; i < BUFFER_POOL_NUM_CLASSES; i++) {
+        struct class_counters *class_counters = &counters[i];
+
+        stats[i] = (struct buffer_pool_stats){
+            .capacity = class_capacity(i),
+            .hits = atomic_load_explicit(&class_counters->hits,
+                                         memory_order_relaxed),
+            .misses = atomic_load_explicit(&class_counters->misses,
+                                           memory_order_relaxed),
+            .in_use = atomic_load_explicit(&class_counters->in_use,
+                                           memory_order_relaxed),
+            .high_water = atomic_load_explicit(&class_counters->high_water,
+                                               memory_order_relaxed)};
+    }
+}
@@ -0,0 +1,78 @@
+/**
+ * @file buffer_pool.h
+ * @brief This file contains declarations for the size-class pool of buffers
+ * lent to messages in flight.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "global.h"
+
+/* Number of size classes, capacities are powers of two from 1 KiB */
+#define BUFFER_POOL_NUM_CLASSES 9
+
+/**
+ * @brief Statistics of one size class
+ */
+struct buffer_pool_stats {
+    /* Capacity of buffers of the class */
+    size_t capacity;
+    /* Buffers taken from a free list */
+    uint64_t hits;
+    /* Buffers allocated because the free lists were empty */
+    uint64_t misses;
+    /* Buffers currently lent out */
+    size_t in_use;
+    /* Largest number of buffers lent out at once */
+    size_t high_water;
+};
+
+/**
+ * @brief Borrow a buffer. Freed buffers are kept in a cache of the calling
+ * thread and in a shared depot, so buffers returned by other threads are
+ * reused as well. Requests larger than the largest class are allocated
+ * directly.
+ * @param size Minimum capacity
+ * @param capacity Set to the actual capacity if not NULL
+ * @return Buffer or NULL for errors
+ */
+extern void *buffer_pool_get(size_t size, size_t *capacity);
+
+/**
+ * @brief Return a buffer to the pool, can be called from any thread
+ * @param buffer Buffer taken by buffer_pool_get, NULL is ignored
+ */
+extern void buffer_pool_put(void *buffer);
+
+/**
+ * @brief Copy statistics of all size classes
+ * @param stats Array of BUFFER_POOL_NUM_CLASSES elements
+ */
+extern void buffer_pool_get_stats(struct buffer_pool_stats *stats);
+
+#endif /* BUFFER_POOL_H_ */
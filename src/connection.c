@@ -0,0 +1,1288 @@
+/**
+ * @file connection.c
+ * @brief This file contains definitions of functions for non-blocking input
+ * and queued output of client connections.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "connection.h"
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "event_loop.h"
+#include "global.h"
+#include "log.h"
+#include "relay_pipe.h"
+#include "shared_buffer.h"
+#include "stats.h"
+
+static void release_connection(struct event_loop_source *source);
+static void reap_zerocopy_locked(struct connection *conn);
+
+/* Mark of data whose latency is not measured */
+static const struct latency_mark no_mark = {.path = LATENCY_PATH_NONE};
+
+/* Paths which measure queueing of frames of each lane */
+static const enum latency_path lane_paths[CONNECTION_NUM_LANES] = {
+    [CONNECTION_LANE_CONTROL] = LATENCY_PATH_CONTROL_QUEUE,
+    [CONNECTION_LANE_BULK] = LATENCY_PATH_BULK_QUEUE};
+
+/* Smallest shared body sent with MSG_ZEROCOPY, 0 if zero-copy is disabled */
+static size_t zerocopy_threshold;
+
+/* Released connections whose zero-copy sends are not completed yet */
+static struct connection *lingering_connections;
+
+/* Protects the list of lingering connections */
+static pthread_mutex_t lingering_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void connection_set_zerocopy_threshold(size_t threshold)
+{
+    zerocopy_threshold = threshold;
+}
+
+struct connection *connection_new(int32_t sockfd)
+{
+    struct connection *conn = calloc(1, sizeof(struct connection));
+
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    conn->source.fd = sockfd;
+    conn->source.release = release_connection;
+    conn->state = CONNECTION_STATE_HANDSHAKE;
+    pthread_mutex_init(&conn->out_lock, NULL);
+    atomic_init(&conn->is_read_paused, false);
+
+    /* Frames are written whole, Nagle's algorithm would only delay them */
+    int32_t nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    /* Kernels without support refuse the option, sends are copied then */
+    if (zerocopy_threshold > 0) {
+        int32_t enable = 1;
+        conn->is_zerocopy = setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY,
+                                       &enable, sizeof(enable)) == 0;
+    }
+
+    return conn;
+}
+
+/**
+ * @brief Allocate an empty chunk of the outbound queue
+ * @param capacity Number of bytes the chunk can hold in its own data
+ * @param mark Relay whose latency ends when the chunk is written
+ * @return New chunk or NULL for errors
+ */
+static struct outbound_chunk *new_chunk(size_t capacity,
+                                        const struct latency_mark *mark)
+{
+    struct outbound_chunk *chunk =
+        buffer_pool_get(sizeof(struct outbound_chunk) + capacity, NULL);
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    chunk->is_frame_end = false;
+    chunk->pipe = NULL;
+    chunk->shared = NULL;
+    chunk->bytes = chunk->data;
+    chunk->size = 0;
+    chunk->offset = 0;
+    chunk->mark = *mark;
+    chunk->queue_mark = no_mark;
+
+    return chunk;
+}
+
+/**
+ * @brief Free a chunk of the outbound queue
+ * @param chunk Chunk
+ */
+static void free_chunk(struct outbound_chunk *chunk)
+{
+    if (chunk->pipe != NULL) {
+        relay_pipe_unref(chunk->pipe);
+    }
+
+    shared_buffer_unref(chunk->shared);
+    buffer_pool_put(chunk);
+}
+
+/**
+ * @brief Free a chunk whose bytes are all written
+ * @param chunk Chunk
+ */
+static void complete_chunk(struct outbound_chunk *chunk)
+{
+    latency_record(&chunk->mark);
+    latency_record(&chunk->queue_mark);
+    free_chunk(chunk);
+}
+
+/**
+ * @brief Append a chunk to a lane of the outbound queue
+ * @param conn Connection
+ * @param lane Lane
+ * @param chunk Chunk
+ */
+static void append_chunk(struct connection *conn, enum connection_lane lane,
+                         struct outbound_chunk *chunk)
+{
+    struct outbound_lane *queue = &conn->out_lanes[lane];
+
+    chunk->next = NULL;
+    chunk->lane = lane;
+
+    if (queue->tail == NULL) {
+        queue->head = chunk;
+    } else {
+        queue->tail->next = chunk;
+    }
+    queue->tail = chunk;
+    conn->out_queued += chunk->size;
+}
+
+/**
+ * @brief End the frame whose chunks were appended last to the lane, its
+ * queueing is measured until the last chunk is written
+ * @param conn Connection
+ * @param lane Lane
+ */
+static void end_frame(struct connection *conn, enum connection_lane lane)
+{
+    struct outbound_chunk *chunk = conn->out_lanes[lane].tail;
+
+    chunk->is_frame_end = true;
+    chunk->queue_mark =
+        (struct latency_mark){.path = lane_paths[lane], .start = latency_now()};
+}
+
+/**
+ * @brief Check if the outbound queue is empty, the caller must hold the
+ * outbound lock
+ * @param conn Connection
+ * @return true if no lane has chunks
+ */
+static bool_t is_queue_empty_locked(const struct connection *conn)
+{
+    return conn->out_lanes[CONNECTION_LANE_CONTROL].head == NULL &&
+           conn->out_lanes[CONNECTION_LANE_BULK].head == NULL;
+}
+
+/**
+ * @brief Get the chunk which is written next: the rest of a partly written
+ * bulk frame, then control frames, then bulk frames. The caller must hold the
+ * outbound lock.
+ * @param conn Connection
+ * @return Chunk or NULL if the queue is empty
+ */
+static struct outbound_chunk *next_chunk_locked(const struct connection *conn)
+{
+    struct outbound_chunk *control =
+        conn->out_lanes[CONNECTION_LANE_CONTROL].head;
+    struct outbound_chunk *bulk = conn->out_lanes[CONNECTION_LANE_BULK].head;
+
+    if (conn->is_bulk_frame_open || control == NULL) {
+        return bulk;
+    }
+
+    return control;
+}
+
+/**
+ * @brief Resume the paused producer, the caller must hold the outbound lock
+ * @param conn Connection
+ */
+static void wake_producer_locked(struct connection *conn)
+{
+    struct connection *producer = conn->out_producer;
+
+    if (producer == NULL) {
+        return;
+    }
+
+    conn->out_producer = NULL;
+    atomic_store(&producer->is_read_paused, false);
+    event_loop_rearm(&producer->source);
+}
+
+/**
+ * @brief Account bytes removed from the outbound queue and resume the producer
+ * once the queue is drained enough, the caller must hold the outbound lock
+ * @param conn Connection
+ * @param size Number of removed bytes
+ */
+static void dequeue_bytes_locked(struct connection *conn, size_t size)
+{
+    conn->out_queued -= size;
+
+    if (conn->out_queued <= CONNECTION_QUEUE_LOW_WATERMARK) {
+        wake_producer_locked(conn);
+    }
+}
+
+/**
+ * @brief Drop all queued output
+ * @param conn Connection
+ */
+static void clear_outbound_queue(struct connection *conn)
+{
+    for (int32_t lane = 0; lane < CONNECTION_NUM_LANES; lane++) {
+        struct outbound_chunk *chunk = conn->out_lanes[lane].head;
+
+        while (chunk != NULL) {
+            struct outbound_chunk *next = chunk->next;
+            free_chunk(chunk);
+            chunk = next;
+        }
+
+        conn->out_lanes[lane].head = NULL;
+        conn->out_lanes[lane].tail = NULL;
+    }
+
+    conn->is_bulk_frame_open = false;
+    conn->out_gathered_count = 0;
+    dequeue_bytes_locked(conn, conn->out_queued);
+}
+
+/**
+ * @brief Mark the connection as unable to send after a send error, queued
+ * output is dropped. The caller must hold the output lock.
+ * @param conn Connection
+ */
+static void break_connection_locked(struct connection *conn)
+{
+    if (!conn->is_broken) {
+        stats_add(STATS_SEND_ERRORS, 1);
+    }
+
+    conn->is_broken = true;
+    clear_outbound_queue(conn);
+}
+
+/**
+ * @brief Close the socket and free the connection, whose zero-copy sends
+ * must be completed
+ * @param conn Connection
+ */
+static void destroy_connection(struct connection *conn)
+{
+    close(conn->source.fd);
+    pthread_mutex_destroy(&conn->out_lock);
+    free(conn);
+}
+
+/**
+ * @brief Destroy lingering connections whose zero-copy sends are completed
+ * meanwhile
+ */
+static void reap_lingering_connections(void)
+{
+    pthread_mutex_lock(&lingering_lock);
+
+    struct connection **link = &lingering_connections;
+
+    while (*link != NULL) {
+        struct connection *conn = *link;
+
+        /* Nobody else references the connection, so its lock is not taken */
+        reap_zerocopy_locked(conn);
+
+        if (conn->zerocopy_done == conn->zerocopy_next) {
+            *link = conn->next_lingering;
+            destroy_connection(conn);
+        } else {
+            link = &conn->next_lingering;
+        }
+    }
+
+    pthread_mutex_unlock(&lingering_lock);
+}
+
+/**
+ * @brief Close the socket and free the connection when its loop no longer
+ * references it
+ * @param source Connection source
+ */
+static void release_connection(struct event_loop_source *source)
+{
+    struct connection *conn = (struct connection *)source;
+
+    if (conn->in_pipe != NULL) {
+        relay_pipe_cancel_wait(conn->in_pipe, &conn->source);
+        relay_pipe_unref(conn->in_pipe);
+    }
+
+    if (conn->pipe != NULL) {
+        relay_pipe_close(conn->pipe);
+        relay_pipe_unref(conn->pipe);
+    }
+
+    clear_outbound_queue(conn);
+    shared_buffer_unref(conn->in_shared);
+    buffer_pool_put(conn->delta_base);
+
+    /*
+     * The kernel pins pages of pending zero-copy sends but does not stop
+     * their reuse, and it still sends them after the socket is closed. Their
+     * buffers stay pinned and the socket open until the completions are read
+     * from its error queue.
+     */
+    reap_zerocopy_locked(conn);
+
+    if (conn->zerocopy_done != conn->zerocopy_next) {
+        pthread_mutex_lock(&lingering_lock);
+        conn->next_lingering = lingering_connections;
+        lingering_connections = conn;
+        pthread_mutex_unlock(&lingering_lock);
+    } else {
+        destroy_connection(conn);
+    }
+
+    reap_lingering_connections();
+}
+
+void connection_free(struct connection *conn)
+{
+    /* Completes operations which io_uring may still have in flight */
+    shutdown(conn->source.fd, SHUT_RDWR);
+    event_loop_remove(&conn->source);
+}
+
+/**
+ * @brief Move input which is not processed yet to a new buffer borrowed from
+ * the pool
+ * @param conn Connection
+ * @param size Capacity of the new buffer
+ * @return 0 for success or -1 for errors, in this case the previous buffer is
+ * kept
+ */
+static int32_t replace_input(struct connection *conn, size_t size)
+{
+    size_t left = conn->in_size - conn->in_offset;
+    size_t capacity;
+    struct shared_buffer *in_shared = shared_buffer_alloc(size, &capacity);
+
+    if (in_shared == NULL) {
+        return -1;
+    }
+
+    if (left > 0) {
+        memcpy(in_shared->data, conn->in_buffer + conn->in_offset, left);
+    }
+
+    shared_buffer_unref(conn->in_shared);
+
+    conn->in_shared = in_shared;
+    conn->in_buffer = in_shared->data;
+    conn->in_buffer_size = capacity;
+    conn->in_size = left;
+    conn->in_offset = 0;
+
+    event_loop_set_recv_buffer(&conn->source, conn->in_buffer, capacity);
+
+    return 0;
+}
+
+int32_t connection_reserve_input(struct connection *conn, size_t size)
+{
+    if (size <= conn->in_buffer_size) {
+        return 0;
+    }
+
+    return replace_input(conn, size);
+}
+
+int32_t connection_compact_input(struct connection *conn)
+{
+    size_t left = conn->in_size - conn->in_offset;
+
+    if (conn->in_offset == 0) {
+        return 0;
+    }
+
+    /* Relayed bodies in the buffer must not be overwritten */
+    if (shared_buffer_is_shared(conn->in_shared)) {
+        return replace_input(conn, conn->in_buffer_size);
+    }
+
+    if (left > 0) {
+        memmove(conn->in_buffer, conn->in_buffer + conn->in_offset, left);
+    }
+
+    conn->in_size = left;
+    conn->in_offset = 0;
+
+    return 0;
+}
+
+void connection_release_input(struct connection *conn)
+{
+    if (conn->in_size > 0 || conn->in_buffer == NULL) {
+        return;
+    }
+
+    shared_buffer_unref(conn->in_shared);
+
+    conn->in_shared = NULL;
+    conn->in_buffer = NULL;
+    conn->in_buffer_size = 0;
+    conn->in_offset = 0;
+
+    event_loop_set_recv_buffer(&conn->source, NULL, 0);
+}
+
+ssize_t connection_recv(struct connection *conn, void *buffer, size_t size)
+{
+    ssize_t result;
+
+    do {
+        result = recv(conn->source.fd, buffer, size, MSG_DONTWAIT);
+    } while (result == -1 && errno == EINTR);
+
+    return result;
+}
+
+/**
+ * @brief Write buffers to the socket without blocking
+ * @param conn Connection
+ * @param iov Buffers to write
+ * @param iovcnt Number of buffers
+ * @param flags Additional flags of sendmsg(2)
+ * @return Number of bytes written, 0 if the socket is full or -1 for errors
+ */
+static ssize_t write_socket(struct connection *conn, const struct iovec *iov,
+                            int32_t iovcnt, int32_t flags)
+{
+    struct msghdr msg = {.msg_iov = (struct iovec *)iov,
+                         .msg_iovlen = (size_t)iovcnt};
+    ssize_t result;
+
+    do {
+        result = sendmsg(conn->source.fd, &msg,
+                         MSG_NOSIGNAL | MSG_DONTWAIT | flags);
+    } while (result == -1 && errno == EINTR);
+
+    if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+
+    if (result == -1) {
+        log_debug("Unable to write to socket %i: %s", conn->source.fd,
+                  strerror(errno));
+    }
+
+    return result;
+}
+
+/**
+ * @brief Copy the part of buffers which was not written to a lane of the
+ * outbound queue
+ * @param conn Connection
+ * @param lane Lane
+ * @param iov Buffers
+ * @param iovcnt Number of buffers
+ * @param written Number of bytes already written
+ * @param shared If not NULL, the last buffer is held by the shared buffer and
+ * a remainder of at least half of its capacity references it instead of being
+ * copied
+ * @param mark Relay whose latency ends when all buffers are written
+ * @return 1 if bytes were queued, 0 if all were written or -1 for errors
+ */
+static int32_t enqueue_remainder(struct connection *conn,
+                                enum connection_lane lane,
+                                const struct iovec *iov, int32_t iovcnt,
+                                size_t written, struct shared_buffer *shared,
+                                const struct latency_mark *mark)
+{
+    size_t total = 0;
+    for (int32_t i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    if (total == written) {
+        latency_record(mark);
+        return 0;
+    }
+
+    /* A bulk frame whose beginning is written must be finished first */
+    if (lane == CONNECTION_LANE_BULK && written > 0) {
+        conn->is_bulk_frame_open = true;
+    }
+
+    size_t left = total - written;
+    size_t shared_left = 0;
+
+    if (shared != NULL) {
+        iovcnt--;
+        shared_left =
+            left < iov[iovcnt].iov_len ? left : iov[iovcnt].iov_len;
+
+        /*
+         * A reference keeps the whole buffer alive while out_queued counts
+         * only the referenced bytes, so small remainders are copied. Queued
+         * chunks then hold at most twice the queued bytes.
+         */
+        if (shared_left * 2 < shared->size) {
+            shared_left = 0;
+            iovcnt++;
+        }
+    }
+
+    if (left > shared_left) {
+        struct outbound_chunk *chunk = new_chunk(
+            left - shared_left, shared_left > 0 ? &no_mark : mark);
+        if (chunk == NULL) {
+            return -1;
+        }
+
+        for (int32_t i = 0; i < iovcnt; i++) {
+            if (written >= iov[i].iov_len) {
+                written -= iov[i].iov_len;
+                continue;
+            }
+
+            size_t len = iov[i].iov_len - written;
+            memcpy(chunk->data + chunk->size,
+                   (uint8_t *)iov[i].iov_base + written, len);
+            chunk->size += len;
+            written = 0;
+        }
+
+        append_chunk(conn, lane, chunk);
+    }
+
+    if (shared_left > 0) {
+        struct outbound_chunk *chunk = new_chunk(0, mark);
+        if (chunk == NULL) {
+            return -1;
+        }
+
+        chunk->shared = shared_buffer_ref(shared);
+        chunk->bytes = (uint8_t *)iov[iovcnt].iov_base + iov[iovcnt].iov_len -
+                       shared_left;
+        chunk->size = shared_left;
+        append_chunk(conn, lane, chunk);
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Account bytes of a queued chunk written to the socket. A chunk
+ * written completely is removed from the head of its lane. The caller must
+ * hold the outbound lock.
+ * @param conn Connection
+ * @param chunk Chunk which is written next
+ * @param written Number of written bytes, may exceed the rest of the chunk
+ * @return Number of bytes which belonged to the chunk
+ */
+static size_t advance_chunk_locked(struct connection *conn,
+                                   struct outbound_chunk *chunk,
+                                   size_t written)
+{
+    size_t left = chunk->size - chunk->offset;
+    bool_t is_complete = written >= left;
+
+    if (chunk->lane == CONNECTION_LANE_BULK) {
+        conn->is_bulk_frame_open = !is_complete || !chunk->is_frame_end;
+    }
+
+    if (!is_complete) {
+        chunk->offset += written;
+        return written;
+    }
+
+    struct outbound_lane *queue = &conn->out_lanes[chunk->lane];
+
+    queue->head = chunk->next;
+    if (queue->head == NULL) {
+        queue->tail = NULL;
+    }
+    complete_chunk(chunk);
+
+    return left;
+}
+
+/**
+ * @brief Remove written bytes of the chunks gathered for the write, the
+ * caller must hold the outbound lock
+ * @param conn Connection
+ * @param written Number of written bytes
+ */
+static void consume_outbound_queue(struct connection *conn, size_t written)
+{
+    dequeue_bytes_locked(conn, written);
+
+    for (int32_t i = 0; i < conn->out_gathered_count && written > 0; i++) {
+        written -= advance_chunk_locked(conn, conn->out_gathered[i], written);
+    }
+
+    conn->out_gathered_count = 0;
+}
+
+/**
+ * @brief Describe chunks of a lane with buffers, up to the first pipe chunk
+ * @param conn Connection
+ * @param chunk First chunk to describe, set to the first chunk left
+ * @param is_one_frame Set to stop after the end of a frame
+ * @param iov Buffers to fill
+ * @param iovcnt Number of filled buffers, updated
+ * @return true if chunks of other lanes may follow, false if a pipe chunk or
+ * the limit of buffers was reached
+ */
+static bool_t gather_chunks(struct connection *conn,
+                            struct outbound_chunk **chunk, bool_t is_one_frame,
+                            struct iovec *iov, int32_t *iovcnt)
+{
+    while (*chunk != NULL) {
+        struct outbound_chunk *current = *chunk;
+
+        if (current->pipe != NULL || *iovcnt == CONNECTION_MAX_FLUSH_CHUNKS) {
+            return false;
+        }
+
+        iov[*iovcnt].iov_base = current->bytes + current->offset;
+        iov[*iovcnt].iov_len = current->size - current->offset;
+        conn->out_gathered[(*iovcnt)++] = current;
+        *chunk = current->next;
+
+        if (is_one_frame && current->is_frame_end) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Describe the outbound queue with buffers in the order of writing, up
+ * to the first pipe chunk. The described chunks are remembered for
+ * consume_outbound_queue.
+ * @param conn Connection
+ * @param iov Buffers to fill
+ * @return Number of buffers
+ */
+static int32_t gather_outbound_queue(struct connection *conn,
+                                     struct iovec *iov)
+{
+    struct outbound_chunk *control =
+        conn->out_lanes[CONNECTION_LANE_CONTROL].head;
+    struct outbound_chunk *bulk = conn->out_lanes[CONNECTION_LANE_BULK].head;
+    int32_t iovcnt = 0;
+
+    bool_t is_more = !conn->is_bulk_frame_open ||
+                     gather_chunks(conn, &bulk, true, iov, &iovcnt);
+
+    if (is_more && gather_chunks(conn, &control, false, iov, &iovcnt)) {
+        gather_chunks(conn, &bulk, false, iov, &iovcnt);
+    }
+
+    conn->out_gathered_count = iovcnt;
+
+    return iovcnt;
+}
+
+/**
+ * @brief Splice bytes of the pipe chunk which is written next to the socket,
+ * the chunk is removed once all its bytes are written
+ * @param conn Connection
+ * @param chunk Pipe chunk
+ * @return Number of bytes written, 0 if the socket is full or -1 for errors
+ */
+static ssize_t splice_chunk(struct connection *conn,
+                            struct outbound_chunk *chunk)
+{
+    ssize_t written = relay_pipe_drain(chunk->pipe, conn->source.fd,
+                                       chunk->size - chunk->offset);
+
+    if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+
+    if (written <= 0) {
+        log_debug("Unable to splice to socket %i: %s", conn->source.fd,
+                  strerror(errno));
+        return -1;
+    }
+
+    dequeue_bytes_locked(conn, (size_t)written);
+    advance_chunk_locked(conn, chunk, (size_t)written);
+
+    return written;
+}
+
+/**
+ * @brief Send data held back by the cork: the cork is removed and put back.
+ * The caller must hold the outbound lock.
+ * @param conn Connection
+ */
+static void push_locked(struct connection *conn)
+{
+    int32_t value = 0;
+
+    conn->is_push_pending = false;
+    setsockopt(conn->source.fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+
+    value = 1;
+    setsockopt(conn->source.fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
+
+/**
+ * @brief Push held back data once the whole queue is written, the caller
+ * must hold the outbound lock
+ * @param conn Connection
+ */
+static void push_if_drained_locked(struct connection *conn)
+{
+    if (conn->is_push_pending && is_queue_empty_locked(conn) &&
+        !conn->is_send_inflight) {
+        push_locked(conn);
+    }
+}
+
+/**
+ * @brief Write queued chunks until the socket is full, the caller must hold
+ * the outbound lock
+ * @param conn Connection
+ * @return 0 for success or -1 for errors
+ */
+static int32_t flush_locked(struct connection *conn)
+{
+    while (!is_queue_empty_locked(conn)) {
+        struct outbound_chunk *next = next_chunk_locked(conn);
+
+        if (next->pipe != NULL) {
+            ssize_t written = splice_chunk(conn, next);
+
+            if (written <= 0) {
+                return (int32_t)written;
+            }
+
+            continue;
+        }
+
+        struct iovec iov[CONNECTION_MAX_FLUSH_CHUNKS];
+        int32_t iovcnt = gather_outbound_queue(conn, iov);
+
+        ssize_t written = write_socket(conn, iov, iovcnt, 0);
+
+        if (written == -1) {
+            return -1;
+        }
+
+        if (written == 0) {
+            break;
+        }
+
+        consume_outbound_queue(conn, (size_t)written);
+    }
+
+    push_if_drained_locked(conn);
+
+    return 0;
+}
+
+/**
+ * @brief Submit the outbound queue to the io_uring of the owning loop, the
+ * caller must hold the outbound lock
+ * @param conn Connection
+ * @return 0 for success or -1 for errors
+ */
+static int32_t submit_locked(struct connection *conn)
+{
+    conn->is_flush_requested = false;
+
+    if (conn->is_send_inflight || is_queue_empty_locked(conn)) {
+        return 0;
+    }
+
+    memset(&conn->out_msg, 0, sizeof(conn->out_msg));
+    conn->out_msg.msg_iov = conn->out_iov;
+    conn->out_msg.msg_iovlen =
+        (size_t)gather_outbound_queue(conn, conn->out_iov);
+
+    if (event_loop_submit_send(&conn->source, &conn->out_msg) == -1) {
+        /* Ring is unusable, fall back to the system call */
+        return flush_locked(conn);
+    }
+
+    conn->is_send_inflight = true;
+
+    return 0;
+}
+
+/**
+ * @brief Make sure queued output is written: either directly or by asking the
+ * owning loop to submit it to io_uring. The caller must hold the outbound
+ * lock.
+ * @param conn Connection
+ * @return 0 for success or -1 for errors
+ */
+static int32_t schedule_flush_locked(struct connection *conn)
+{
+    if (event_loop_get_backend() == EVENT_LOOP_BACKEND_EPOLL) {
+        return 0;
+    }
+
+    if (event_loop_is_owner(&conn->source)) {
+        return submit_locked(conn);
+    }
+
+    if (!is_queue_empty_locked(conn) && !conn->is_send_inflight &&
+        !conn->is_flush_requested) {
+        conn->is_flush_requested = true;
+        event_loop_request_flush(&conn->source);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Release buffers of zero-copy sends with sequence numbers in the
+ * range, the caller must hold the outbound lock
+ * @param conn Connection
+ * @param first First sequence number
+ * @param last Last sequence number
+ * @param is_copied Set if the kernel copied the data anyway
+ */
+static void complete_zerocopy_locked(struct connection *conn, uint32_t first,
+                                     uint32_t last, bool_t is_copied)
+{
+    stats_add(is_copied ? STATS_ZEROCOPY_COPIED : STATS_ZEROCOPY_COMPLETED,
+              (int64_t)(last - first) + 1);
+
+    for (uint32_t seq = first; seq != last + 1; seq++) {
+        struct shared_buffer **pin =
+            &conn->zerocopy_pins[seq % CONNECTION_MAX_ZEROCOPY_PINS];
+        shared_buffer_unref(*pin);
+        *pin = NULL;
+    }
+
+    /* Ranges may complete out of order */
+    while (conn->zerocopy_done != conn->zerocopy_next &&
+           conn->zerocopy_pins[conn->zerocopy_done %
+                               CONNECTION_MAX_ZEROCOPY_PINS] == NULL) {
+        conn->zerocopy_done++;
+    }
+}
+
+/**
+ * @brief Read completions of zero-copy sends from the error queue of the
+ * socket, the caller must hold the outbound lock
+ * @param conn Connection
+ */
+static void reap_zerocopy_locked(struct connection *conn)
+{
+    while (conn->zerocopy_done != conn->zerocopy_next) {
+        uint8_t control[128];
+        struct msghdr msg = {.msg_control = control,
+                             .msg_controllen = sizeof(control)};
+
+        if (recvmsg(conn->source.fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) ==
+            -1) {
+            break;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            bool_t is_error =
+                (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                (cmsg->cmsg_level == SOL_IPV6 &&
+                 cmsg->cmsg_type == IPV6_RECVERR);
+
+            if (!is_error) {
+                continue;
+            }
+
+            struct sock_extended_err error;
+            memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+
+            if (error.ee_errno == 0 &&
+                error.ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                complete_zerocopy_locked(
+                    conn, error.ee_info, error.ee_data,
+                    (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Write a header and a body held by the shared buffer, the body is
+ * written with MSG_ZEROCOPY and the buffer is pinned until the kernel
+ * completes the send. The header is copied, since it does not outlive the
+ * call. The caller must hold the outbound lock.
+ * @param conn Connection
+ * @param iov Buffers, the last one is the body
+ * @param iovcnt Number of buffers
+ * @param shared Buffer which holds the body
+ * @return Number of bytes written, 0 if the socket is full or -1 for errors
+ */
+static ssize_t write_zerocopy_locked(struct connection *conn,
+                                     const struct iovec *iov, int32_t iovcnt,
+                                     struct shared_buffer *shared)
+{
+    const struct iovec *body = &iov[iovcnt - 1];
+    size_t header_size = 0;
+
+    for (int32_t i = 0; i < iovcnt - 1; i++) {
+        header_size += iov[i].iov_len;
+    }
+
+    ssize_t written = write_socket(conn, iov, iovcnt - 1, MSG_MORE);
+
+    if (written != (ssize_t)header_size) {
+        return written;
+    }
+
+    ssize_t result = write_socket(conn, body, 1, MSG_ZEROCOPY);
+
+    /* Pinned pages are limited, then the kernel refuses instead of copying */
+    if (result == -1 && errno == ENOBUFS) {
+        stats_add(STATS_ZEROCOPY_COPIED, 1);
+        result = write_socket(conn, body, 1, 0);
+    } else if (result > 0) {
+        /* Only sends which took data get a sequence number */
+        conn->zerocopy_pins[conn->zerocopy_next %
+                            CONNECTION_MAX_ZEROCOPY_PINS] =
+            shared_buffer_ref(shared);
+        conn->zerocopy_next++;
+        stats_add(STATS_ZEROCOPY_SENDS, 1);
+    }
+
+    return result == -1 ? -1 : written + result;
+}
+
+/**
+ * @brief Send buffers, see connection_sendv and connection_send_shared
+ * @param conn Connection
+ * @param lane Lane of the frame
+ * @param iov Buffers to send
+ * @param iovcnt Number of buffers
+ * @param shared Buffer which holds the last buffer or NULL if it is not
+ * shared
+ * @param mark Relay whose latency ends when all data is written, or NULL
+ * @return 0 for success or -1 for errors
+ */
+static int32_t send_buffers(struct connection *conn, enum connection_lane lane,
+                            const struct iovec *iov, int32_t iovcnt,
+                            struct shared_buffer *shared,
+                            const struct latency_mark *mark)
+{
+    int32_t result = 0;
+
+    if (mark == NULL) {
+        mark = &no_mark;
+    }
+
+    pthread_mutex_lock(&conn->out_lock);
+
+    /*
+     * Keep ordering: write directly only if nothing is queued. The owning
+     * loop of an io_uring connection batches its output in the ring instead.
+     */
+    bool_t is_direct = is_queue_empty_locked(conn) && !conn->is_send_inflight &&
+                       (event_loop_get_backend() == EVENT_LOOP_BACKEND_EPOLL ||
+                        !event_loop_is_owner(&conn->source));
+
+    bool_t is_zerocopy = is_direct && shared != NULL && conn->is_zerocopy &&
+                         iov[iovcnt - 1].iov_len >= zerocopy_threshold;
+
+    if (is_zerocopy && conn->zerocopy_next - conn->zerocopy_done ==
+                           CONNECTION_MAX_ZEROCOPY_PINS) {
+        reap_zerocopy_locked(conn);
+        is_zerocopy = conn->zerocopy_next - conn->zerocopy_done <
+                      CONNECTION_MAX_ZEROCOPY_PINS;
+    }
+
+    if (conn->is_broken) {
+        result = -1;
+    } else {
+        ssize_t written = 0;
+
+        if (is_zerocopy) {
+            written = write_zerocopy_locked(conn, iov, iovcnt, shared);
+        } else if (is_direct) {
+            written = write_socket(conn, iov, iovcnt, 0);
+        }
+
+        if (written != -1) {
+            int32_t queued = enqueue_remainder(conn, lane, iov, iovcnt,
+                                               (size_t)written, shared, mark);
+
+            if (queued == -1) {
+                /* A partly queued frame cannot be completed anymore */
+                written = -1;
+            } else {
+                if (queued == 1) {
+                    end_frame(conn, lane);
+                } else {
+                    latency_record_value(lane_paths[lane], 0);
+                }
+
+                written = schedule_flush_locked(conn);
+            }
+        }
+
+        if (written == -1) {
+            break_connection_locked(conn);
+            result = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&conn->out_lock);
+
+    return result;
+}
+
+int32_t connection_sendv(struct connection *conn, enum connection_lane lane,
+                         const struct iovec *iov, int32_t iovcnt,
+                         const struct latency_mark *mark)
+{
+    return send_buffers(conn, lane, iov, iovcnt, NULL, mark);
+}
+
+int32_t connection_send_shared(struct connection *conn,
+                               enum connection_lane lane, const void *header,
+                               size_t header_size, const void *body,
+                               size_t size, struct shared_buffer *buffer,
+                               const struct latency_mark *mark)
+{
+    const struct iovec iov[] = {
+        {.iov_base = (void *)header, .iov_len = header_size},
+        {.iov_base = (void *)body, .iov_len = size}};
+
+    return send_buffers(conn, lane, iov, 2, buffer, mark);
+}
+
+void connection_set_corked(struct connection *conn, bool_t is_corked)
+{
+    pthread_mutex_lock(&conn->out_lock);
+
+    if (conn->is_corked != is_corked) {
+        int32_t value = is_corked;
+
+        conn->is_corked = is_corked;
+        conn->is_push_pending = false;
+        setsockopt(conn->source.fd, IPPROTO_TCP, TCP_CORK, &value,
+                   sizeof(value));
+    }
+
+    pthread_mutex_unlock(&conn->out_lock);
+}
+
+void connection_push(struct connection *conn)
+{
+    pthread_mutex_lock(&conn->out_lock);
+
+    if (conn->is_corked) {
+        /* Queued data would still be held back, so it is pushed later */
+        if (!is_queue_empty_locked(conn) || conn->is_send_inflight) {
+            conn->is_push_pending = true;
+        } else {
+            push_locked(conn);
+        }
+    }
+
+    pthread_mutex_unlock(&conn->out_lock);
+}
+
+void connection_reap_zerocopy(struct connection *conn)
+{
+    pthread_mutex_lock(&conn->out_lock);
+    reap_zerocopy_locked(conn);
+    pthread_mutex_unlock(&conn->out_lock);
+}
+
+int32_t connection_send(struct connection *conn, enum connection_lane lane,
+                        const void *data, size_t size)
+{
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = size};
+
+    return connection_sendv(conn, lane, &iov, 1, NULL);
+}
+
+int32_t connection_send_pipe(struct connection *conn, const void *header,
+                             size_t header_size, struct relay_pipe *pipe,
+                             size_t size, const struct latency_mark *mark)
+{
+    struct iovec iov = {.iov_base = (void *)header, .iov_len = header_size};
+    int32_t result = 0;
+
+    if (mark == NULL) {
+        mark = &no_mark;
+    }
+
+    pthread_mutex_lock(&conn->out_lock);
+
+    if (conn->is_broken) {
+        result = -1;
+    } else {
+        ssize_t written = 0;
+
+        if (is_queue_empty_locked(conn)) {
+            written = write_socket(conn, &iov, 1, 0);
+        }
+
+        struct outbound_chunk *chunk = NULL;
+
+        if (written != -1 &&
+            enqueue_remainder(conn, CONNECTION_LANE_BULK, &iov, 1,
+                              (size_t)written, NULL, &no_mark) != -1) {
+            chunk = new_chunk(0, mark);
+        }
+
+        if (chunk == NULL) {
+            written = -1;
+        } else {
+            /* The body is queued, so a written header opens the frame */
+            if (written > 0) {
+                conn->is_bulk_frame_open = true;
+            }
+
+            chunk->pipe = relay_pipe_ref(pipe);
+            chunk->size = size;
+            append_chunk(conn, CONNECTION_LANE_BULK, chunk);
+            end_frame(conn, CONNECTION_LANE_BULK);
+
+            /* Header is written, so the body can go directly too */
+            if (next_chunk_locked(conn) == chunk) {
+                written = flush_locked(conn);
+            }
+        }
+
+        if (written == -1) {
+            break_connection_locked(conn);
+            result = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&conn->out_lock);
+
+    return result;
+}
+
+int32_t connection_flush(struct connection *conn)
+{
+    int32_t result = 0;
+
+    pthread_mutex_lock(&conn->out_lock);
+
+    int32_t (*flush)(struct connection *) =
+        event_loop_get_backend() == EVENT_LOOP_BACKEND_EPOLL ? flush_locked
+                                                             : submit_locked;
+
+    if (conn->is_broken) {
+        result = -1;
+    } else if (flush(conn) == -1) {
+        break_connection_locked(conn);
+        result = -1;
+    }
+
+    pthread_mutex_unlock(&conn->out_lock);
+
+    return result;
+}
+
+void connection_on_send(struct connection *conn, ssize_t result)
+{
+    pthread_mutex_lock(&conn->out_lock);
+
+    conn->is_send_inflight = false;
+
+    if (result == -1) {
+        log_debug("Unable to write to socket %i: %s", conn->source.fd,
+                  strerror(errno));
+        break_connection_locked(conn);
+    } else if (!conn->is_broken) {
+        consume_outbound_queue(conn, (size_t)result);
+
+        if (submit_locked(conn) == -1) {
+            break_connection_locked(conn);
+        } else {
+            push_if_drained_locked(conn);
+        }
+    }
+
+    pthread_mutex_unlock(&conn->out_lock);
+}
+
+bool_t connection_throttle(struct connection *conn,
+                           struct connection *producer)
+{
+    pthread_mutex_lock(&conn->out_lock);
+
+    /* Decided under the lock, so a drain cannot slip in before the pause */
+    bool_t is_paused = !conn->is_broken &&
+                       conn->out_queued >= CONNECTION_QUEUE_HIGH_WATERMARK;
+
+    if (is_paused) {
+        conn->out_producer = producer;
+        atomic_store(&producer->is_read_paused, true);
+    }
+
+    pthread_mutex_unlock(&conn->out_lock);
+
+    return is_paused;
+}
+
+void connection_resume_producer(struct connection *conn)
+{
+    pthread_mutex_lock(&conn->out_lock);
+    wake_producer_locked(conn);
+    pthread_mutex_unlock(&conn->out_lock);
+}
+
+size_t connection_get_queued(struct connection *conn)
+{
+    pthread_mutex_lock(&conn->out_lock);
+    size_t result = conn->out_queued;
+    pthread_mutex_unlock(&conn->out_lock);
+
+    return result;
+}
+
+bool_t connection_is_flushed(struct connection *conn)
+{
+    pthread_mutex_lock(&conn->out_lock);
+    bool_t result = is_queue_empty_locked(conn) && !conn->is_send_inflight;
+    pthread_mutex_unlock(&conn->out_lock);
+
+    return result;
+}
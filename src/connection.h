@@ -0,0 +1,428 @@
+/**
+ * @file connection.h
+ * @brief This file contains declarations for client connections driven by
+ * the event loops.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef CONNECTION_H_
+#define CONNECTION_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "event_loop.h"
+#include "global.h"
+#include "latency.h"
+#include "protocol.h"
+#include "relay_pipe.h"
+#include "shared_buffer.h"
+
+struct session_info;
+
+/* Maximum number of queued chunks written by one system call */
+#define CONNECTION_MAX_FLUSH_CHUNKS 64
+
+/* Queued bytes at which the producer of the data stops being read */
+#define CONNECTION_QUEUE_HIGH_WATERMARK (1024 * 1024)
+
+/* Queued bytes at which the paused producer is read again */
+#define CONNECTION_QUEUE_LOW_WATERMARK (256 * 1024)
+
+/* Number of zero-copy sends whose buffers may be pinned at once */
+#define CONNECTION_MAX_ZEROCOPY_PINS 64
+
+/**
+ * @brief States of the per-connection protocol state machine
+ */
+enum connection_state {
+    /* Waiting for the first request: make or join a session */
+    CONNECTION_STATE_HANDSHAKE,
+    /* Connection is the host of its session */
+    CONNECTION_STATE_HOST,
+    /* Connection is the target of its session */
+    CONNECTION_STATE_TARGET,
+    /* Input is ignored, connection is closed once the output is sent */
+    CONNECTION_STATE_CLOSING
+};
+
+/**
+ * @brief Lanes of the outbound queue. At frame boundaries queued control
+ * frames are written ahead of queued bulk frames, frames of a lane keep their
+ * order.
+ */
+enum connection_lane {
+    /* Events, session notifications and errors */
+    CONNECTION_LANE_CONTROL,
+    /* Bodies relayed between the host and targets */
+    CONNECTION_LANE_BULK,
+    CONNECTION_NUM_LANES
+};
+
+/**
+ * @brief Chunk of data waiting to be written to the socket
+ */
+struct outbound_chunk {
+    struct outbound_chunk *next;
+    enum connection_lane lane;
+    /* Set for the last chunk of a frame */
+    bool_t is_frame_end;
+    /*
+     * If set, the chunk has no data and its bytes are the next bytes of the
+     * pipe, they are spliced to the socket
+     */
+    struct relay_pipe *pipe;
+    /* If set, the bytes of the chunk are in the shared buffer */
+    struct shared_buffer *shared;
+    /* First byte of the chunk, in the data of the chunk or the shared buffer */
+    uint8_t *bytes;
+    size_t size;
+    /* Number of bytes already written */
+    size_t offset;
+    /* Relay whose latency ends when the last byte of the chunk is written */
+    struct latency_mark mark;
+    /* Queueing of the frame which ends with the chunk */
+    struct latency_mark queue_mark;
+    uint8_t data[];
+};
+
+/**
+ * @brief Chunks of one lane of the outbound queue
+ */
+struct outbound_lane {
+    struct outbound_chunk *head;
+    struct outbound_chunk *tail;
+};
+
+/**
+ * @brief State of one client connection
+ */
+struct connection {
+    /* Must be the first member, the loop passes it to the handler */
+    struct event_loop_source source;
+    enum connection_state state;
+    /* Wire format chosen by the first request of the client */
+    enum protocol_version version;
+    /* Session of the connection, NULL while handshaking */
+    struct session_info *session;
+    /* Id of the target within its session */
+    uint16_t target_id;
+    /* Next target of the session, protected by the lock of the session */
+    struct connection *next_target;
+    /* Codec negotiated with the client, none for clients which did not ask */
+    enum compression compression;
+    /* Delta encoding negotiated with a target */
+    enum delta_mode delta;
+    /*
+     * Last host body sent to the target, the base of the next delta. Borrowed
+     * from the pool and protected by the lock of the session.
+     */
+    uint8_t *delta_base;
+    size_t delta_base_size;
+    size_t delta_base_capacity;
+    /*
+     * Buffer used to receive requests, borrowed from the pool while needed.
+     * Bodies relayed from it keep references while they are queued.
+     */
+    struct shared_buffer *in_shared;
+    uint8_t *in_buffer;
+    size_t in_buffer_size;
+    /* Largest request accepted from the client */
+    size_t in_limit;
+    /* Number of bytes received to the input buffer */
+    size_t in_size;
+    /* Offset of the first byte of the input buffer which is not processed */
+    size_t in_offset;
+    /*
+     * When the last read ended, start of the relays of requests it completed.
+     * The idle timeout of the connection counts from it.
+     */
+    uint64_t recv_time;
+    /* Set if the client answers heartbeat probes */
+    bool_t is_heartbeat;
+    /* When the last heartbeat probe was sent */
+    uint64_t probe_time;
+    /* Number of body bytes of the current request left in the socket */
+    size_t in_body_left;
+    /* Pipe which receives the body of the current request, if it is spliced */
+    struct relay_pipe *in_pipe;
+    /* Pipe which carries spliced bodies to this connection */
+    struct relay_pipe *pipe;
+    /* Protects the outbound queue, since peers send from their own loops */
+    pthread_mutex_t out_lock;
+    struct outbound_lane out_lanes[CONNECTION_NUM_LANES];
+    /* Set while a bulk frame is partly written, control frames wait for it */
+    bool_t is_bulk_frame_open;
+    /* Chunks described by the buffers of the last write, in their order */
+    struct outbound_chunk *out_gathered[CONNECTION_MAX_FLUSH_CHUNKS];
+    int32_t out_gathered_count;
+    /* Number of bytes in the outbound queue */
+    size_t out_queued;
+    /* Connection paused until the outbound queue drains */
+    struct connection *out_producer;
+    /* Set while the connection is not read because its peer is congested */
+    atomic_bool is_read_paused;
+    /* Set when writing to the socket failed, further output is dropped */
+    bool_t is_broken;
+    /* Set while TCP_CORK holds partial segments back */
+    bool_t is_corked;
+    /* Set if held back segments are pushed once the queue is written */
+    bool_t is_push_pending;
+    /* Message of the send submitted to io_uring, valid until completion */
+    struct msghdr out_msg;
+    struct iovec out_iov[CONNECTION_MAX_FLUSH_CHUNKS];
+    bool_t is_send_inflight;
+    /* Set when the owning loop was asked to submit queued output */
+    bool_t is_flush_requested;
+    /*
+     * Set if large shared bodies are sent with MSG_ZEROCOPY. Completions are
+     * reported with EPOLLERR, real errors of the socket come with EPOLLHUP.
+     */
+    bool_t is_zerocopy;
+    /*
+     * Buffers of zero-copy sends indexed by the sequence number of the send,
+     * they are kept until the kernel completes the send
+     */
+    struct shared_buffer *zerocopy_pins[CONNECTION_MAX_ZEROCOPY_PINS];
+    /* Sequence number of the next zero-copy send */
+    uint32_t zerocopy_next;
+    /* Sequence number of the oldest zero-copy send which is not completed */
+    uint32_t zerocopy_done;
+    /* Next released connection which waits for its zero-copy sends */
+    struct connection *next_lingering;
+};
+
+/**
+ * @brief Send shared bodies of at least the specified size with MSG_ZEROCOPY.
+ * Only connections created afterwards use it, and only with the epoll backend.
+ * @param threshold Smallest body sent without copying, 0 disables zero-copy
+ */
+extern void connection_set_zerocopy_threshold(size_t threshold);
+
+/**
+ * @brief Create a connection for an accepted socket. With the epoll backend
+ * the socket must be accepted in non-blocking mode, io_uring needs blocking
+ * sockets and other I/O is done with MSG_DONTWAIT.
+ * @param sockfd Descriptor of the client
+ * @return New connection or NULL for errors. Handlers of the source must be
+ * set by the caller.
+ */
+extern struct connection *connection_new(int32_t sockfd);
+
+/**
+ * @brief Unregister the connection from its loop, close the socket and free
+ * the connection with all its buffers. With the io_uring backend the memory is
+ * released once pending operations are completed.
+ * @param conn Connection to destroy
+ */
+extern void connection_free(struct connection *conn);
+
+/**
+ * @brief Make sure the input buffer can hold the specified number of bytes. A
+ * larger buffer is borrowed from the pool if needed, input which is not
+ * processed yet is moved to the beginning of the buffer.
+ * @param conn Connection
+ * @param size Required capacity
+ * @return 0 for success or -1 for errors, in this case the previous buffer is
+ * kept
+ */
+extern int32_t connection_reserve_input(struct connection *conn, size_t size);
+
+/**
+ * @brief Return the input buffer to the pool if it holds no input. With the
+ * io_uring backend it must not be called while a receive is in flight.
+ * @param conn Connection
+ */
+extern void connection_release_input(struct connection *conn);
+
+/**
+ * @brief Drop processed input: input which is not processed yet is moved to
+ * the beginning of the buffer. If relayed bodies still reference the buffer,
+ * the input is moved to a new buffer instead. With the io_uring backend it
+ * must not be called while a receive is in flight.
+ * @param conn Connection
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t connection_compact_input(struct connection *conn);
+
+/**
+ * @brief Read available data from the socket without blocking
+ * @param conn Connection
+ * @param buffer Destination buffer
+ * @param size Destination buffer size
+ * @return Same as recv(2)
+ */
+extern ssize_t connection_recv(struct connection *conn, void *buffer,
+                               size_t size);
+
+/**
+ * @brief Send a frame gathered from several buffers. Data which cannot be
+ * written without blocking is copied to the lane of the outbound queue and is
+ * written by connection_flush later. Can be called from any thread.
+ * @param conn Connection
+ * @param lane Lane of the frame
+ * @param iov Buffers to send
+ * @param iovcnt Number of buffers
+ * @param mark Relay whose latency ends when all data is written, or NULL
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t connection_sendv(struct connection *conn,
+                                enum connection_lane lane,
+                                const struct iovec *iov, int32_t iovcnt,
+                                const struct latency_mark *mark);
+
+/**
+ * @brief Let the kernel hold partial segments back with TCP_CORK, so that
+ * consecutive frames are coalesced into full segments. Uncorking sends the
+ * held back data at once. Can be called from any thread.
+ * @param conn Connection
+ * @param is_corked Set to cork, clear to uncork
+ */
+extern void connection_set_corked(struct connection *conn, bool_t is_corked);
+
+/**
+ * @brief Send data held back by the cork at once. Data still queued by the
+ * server is pushed as soon as it is written. Does nothing for connections
+ * which are not corked. Can be called from any thread.
+ * @param conn Connection
+ */
+extern void connection_push(struct connection *conn);
+
+/**
+ * @brief Send a header followed by a body held by a shared buffer, see
+ * connection_sendv. If the body cannot be written without blocking, a
+ * remainder of at least half of the buffer is queued as a reference to it,
+ * smaller ones are copied, since the whole buffer stays alive for the
+ * reference. Large bodies may be sent with MSG_ZEROCOPY, then the buffer is
+ * referenced until the kernel completes the send. Can be called from any
+ * thread.
+ * @param conn Connection
+ * @param lane Lane of the frame
+ * @param header Header to send
+ * @param header_size Size of the header
+ * @param body Body to send, within the data of the buffer
+ * @param size Size of the body
+ * @param buffer Buffer which holds the body, must not change while it is
+ * shared
+ * @param mark Relay whose latency ends when all data is written, or NULL
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t connection_send_shared(struct connection *conn,
+                                      enum connection_lane lane,
+                                      const void *header, size_t header_size,
+                                      const void *body, size_t size,
+                                      struct shared_buffer *buffer,
+                                      const struct latency_mark *mark);
+
+/**
+ * @brief Release buffers of zero-copy sends which the kernel completed. Must
+ * be called when the socket reports EPOLLERR without EPOLLHUP. Can be called
+ * from any thread.
+ * @param conn Connection
+ */
+extern void connection_reap_zerocopy(struct connection *conn);
+
+/**
+ * @brief Send a frame from a single buffer, see connection_sendv
+ * @param conn Connection
+ * @param lane Lane of the frame
+ * @param data Data to send
+ * @param size Size of data
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t connection_send(struct connection *conn,
+                               enum connection_lane lane, const void *data,
+                               size_t size);
+
+/**
+ * @brief Send a header followed by bytes which are already in the pipe. The
+ * bytes are spliced from the pipe to the socket, so they never reach user
+ * space. The frame goes to the bulk lane. Can be called from any thread.
+ * @param conn Connection
+ * @param header Header to send
+ * @param header_size Size of the header
+ * @param pipe Pipe which holds the body
+ * @param size Size of the body
+ * @param mark Relay whose latency ends when the body is written, or NULL
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t connection_send_pipe(struct connection *conn,
+                                    const void *header, size_t header_size,
+                                    struct relay_pipe *pipe, size_t size,
+                                    const struct latency_mark *mark);
+
+/**
+ * @brief Write as much of the outbound queue as possible without blocking.
+ * With the io_uring backend the queue is submitted to the ring instead, in
+ * this case the function must be called by the owning loop.
+ * @param conn Connection
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t connection_flush(struct connection *conn);
+
+/**
+ * @brief Complete a send submitted to io_uring
+ * @param conn Connection
+ * @param result Result of the send
+ */
+extern void connection_on_send(struct connection *conn, ssize_t result);
+
+/**
+ * @brief Pause reading from the producer if the outbound queue of the
+ * connection is above the high watermark. The producer is resumed with
+ * event_loop_rearm once the queue drains below the low watermark. The caller
+ * must keep both connections alive, e.g. by holding the lock of their session.
+ * @param conn Connection which receives data from the producer
+ * @param producer Connection which sends data to conn
+ * @return true if the producer is paused, false if not
+ */
+extern bool_t connection_throttle(struct connection *conn,
+                                  struct connection *producer);
+
+/**
+ * @brief Resume the producer paused by the connection regardless of its
+ * outbound queue, must be called before either connection leaves the session
+ * @param conn Connection which may have paused its producer
+ */
+extern void connection_resume_producer(struct connection *conn);
+
+/**
+ * @brief Get the depth of the outbound queue
+ * @param conn Connection
+ * @return Number of queued bytes
+ */
+extern size_t connection_get_queued(struct connection *conn);
+
+/**
+ * @brief Check if the outbound queue is empty
+ * @param conn Connection
+ * @return true if all output was written to the socket, false if not
+ */
+extern bool_t connection_is_flushed(struct connection *conn);
+
+#endif /* CONNECTION_H_ */
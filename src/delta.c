@@ -0,0 +1,84 @@
+/**
+ * @file delta.c
+ * @brief This file contains the block delta encoding of host bodies.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "delta.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "global.h"
+#include "protocol.h"
+
+size_t delta_encode(const uint8_t *base, size_t base_size,
+                    const uint8_t *body, size_t size, uint8_t *output,
+                    size_t capacity)
+{
+    size_t num_blocks = (size + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+    size_t bitmap_size = (num_blocks + 7) / 8;
+    size_t offset = sizeof(struct delta_header) + bitmap_size;
+
+    if (offset > capacity) {
+        return 0;
+    }
+
+    struct delta_header header = {.original_size = (uint32_t)size};
+    memcpy(output, &header, sizeof(header));
+
+    uint8_t *bitmap = output + sizeof(header);
+    memset(bitmap, 0, bitmap_size);
+
+    for (size_t block = 0; block < num_blocks; block++) {
+        size_t start = block * DELTA_BLOCK_SIZE;
+        size_t length = size - start < DELTA_BLOCK_SIZE ? size - start
+                                                        : DELTA_BLOCK_SIZE;
+        /* Bytes past the end of the previous body are compared to zeros */
+        size_t common = start >= base_size ? 0
+                        : base_size - start < length ? base_size - start
+                                                     : length;
+
+        if (common == length &&
+            memcmp(base + start, body + start, length) == 0) {
+            continue;
+        }
+
+        if (length > capacity - offset) {
+            return 0;
+        }
+
+        bitmap[block / 8] |= (uint8_t)(1u << (block % 8));
+
+        uint8_t *out = output + offset;
+
+        for (size_t i = 0; i < common; i++) {
+            out[i] = base[start + i] ^ body[start + i];
+        }
+        memcpy(out + common, body + start + common, length - common);
+
+        offset += length;
+    }
+
+    return offset;
+}
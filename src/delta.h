@@ -0,0 +1,52 @@
+/**
+ * @file delta.h
+ * @brief This file contains declarations for the block delta encoding of host
+ * bodies.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef DELTA_H_
+#define DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "global.h"
+
+/**
+ * @brief Encode a body as the difference from the previous body, in the
+ * format of DATA_DELTA responses described by struct delta_header. Can be
+ * called from any thread.
+ * @param base Previous body
+ * @param base_size Size of the previous body
+ * @param body New body
+ * @param size Size of the new body
+ * @param output Buffer for the delta
+ * @param capacity Size of the buffer
+ * @return Size of the delta or 0 if it does not fit into the buffer
+ */
+extern size_t delta_encode(const uint8_t *base, size_t base_size,
+                           const uint8_t *body, size_t size, uint8_t *output,
+                           size_t capacity);
+
+#endif /* DELTA_H_ */
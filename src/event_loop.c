@@ -0,0 +1,1063 @@
+/**
+ * @file event_loop.c
+ * @brief This file contains definitions of the event loop threads. Sockets are
+ * driven either by edge-triggered epoll or by io_uring.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "event_loop.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "global.h"
+#include "log.h"
+#include "timer_wheel.h"
+#include "uring.h"
+
+/* Maximum number of events taken from the kernel per one epoll_wait call */
+#define MAX_EVENTS 256
+
+/* Events all sources are registered with */
+#define SOURCE_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+/* Number of submission queue entries of one loop ring */
+#define URING_ENTRIES 256
+
+/* Number of completion queue entries of one loop ring */
+#define URING_CQ_ENTRIES 4096
+
+/* Number of fixed file and buffer slots registered per loop ring */
+#define URING_SLOTS 4096
+
+/* Capacity of the queue of added sources of one loop, a power of two */
+#define ADOPT_QUEUE_SIZE 256
+
+/*
+ * Completions carry the source pointer with the operation in the low bits,
+ * sources are allocated by malloc, so these bits are always zero.
+ */
+enum uring_op {
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_CANCEL,
+    URING_OP_WAKEUP,
+    URING_OP_TICK
+};
+
+#define URING_OP_MASK 7ULL
+
+/**
+ * @brief State of one event loop thread
+ */
+struct event_loop {
+    pthread_t thread;
+    int32_t epoll_fd;
+    /* Used to wake the loop up for added sources and when stopping */
+    int32_t wakeup_fd;
+    /*
+     * Sources added by other threads, taken by this loop or stolen by an idle
+     * one. Indexes grow without bound and wrap with the queue size.
+     */
+    pthread_mutex_t adopt_lock;
+    struct event_loop_source *adopt_queue[ADOPT_QUEUE_SIZE];
+    uint32_t adopt_head;
+    uint32_t adopt_tail;
+
+    /* io_uring backend */
+    struct uring ring;
+    /* Value read from the wakeup descriptor */
+    uint64_t wakeup_value;
+    /* Sources with events posted by other threads */
+    pthread_mutex_t pending_lock;
+    struct event_loop_source *pending_head;
+    /* Stack of unused fixed file slots */
+    int32_t *free_slots;
+    int32_t num_of_free_slots;
+    /* Set if the ring has a sparse table of registered buffers */
+    bool_t has_fixed_buffers;
+    /* Timeout which wakes the ring for the next tick of the timers */
+    struct __kernel_timespec tick_timeout;
+    bool_t is_tick_inflight;
+
+    /* Timers of the owned sources */
+    struct timer_wheel timers;
+};
+
+/* All started loops */
+static struct event_loop *loops;
+
+/* Number of started loops */
+static int32_t num_of_loops;
+
+/* Backend of the started loops */
+static enum event_loop_backend loop_backend;
+
+/* Index of the loop which gets the next source */
+static atomic_uint next_loop;
+
+/* Cleared when loops must exit */
+static atomic_bool is_running;
+
+/* Loop run by the calling thread, NULL for other threads */
+static _Thread_local struct event_loop *current_loop;
+
+static void adopt_sources(struct event_loop *loop);
+
+/**
+ * @brief Get the current tick of the timers
+ * @return Number of ticks since an arbitrary point
+ */
+static uint64_t current_tick(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)now.tv_sec * 1000u + (uint64_t)now.tv_nsec / 1000000u) /
+           EVENT_LOOP_TIMER_TICK_MS;
+}
+
+/**
+ * @brief Expire timers of the loop. Called after the events of the last wait
+ * were handled, so handlers never get events of sources freed by timers.
+ * @param loop Loop
+ */
+static void expire_timers(struct event_loop *loop)
+{
+    if (loop->timers.count > 0) {
+        timer_wheel_advance(&loop->timers, current_tick());
+    }
+}
+
+/**
+ * @brief Epoll event loop thread start routine.
+ * @param arg Pointer to the loop state
+ */
+static void *epoll_loop_thread(void *arg)
+{
+    struct event_loop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    current_loop = loop;
+
+    while (atomic_load(&is_running)) {
+        /* Pending timers wake the loop each tick */
+        int32_t timeout =
+            loop->timers.count > 0 ? EVENT_LOOP_TIMER_TICK_MS : -1;
+        int32_t count =
+            epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_error("Event loop failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int32_t i = 0; i < count; i++) {
+            struct event_loop_source *source = events[i].data.ptr;
+
+            /* Wakeup descriptor is registered without a source */
+            if (source == NULL) {
+                uint64_t value;
+                if (read(loop->wakeup_fd, &value, sizeof(value)) == -1 &&
+                    errno != EAGAIN) {
+                    log_error("Unable to read wakeup descriptor: %s",
+                              strerror(errno));
+                }
+
+                adopt_sources(loop);
+                continue;
+            }
+
+            source->handler(source, events[i].events);
+        }
+
+        expire_timers(loop);
+    }
+
+    log_debug("Exit loop_thread");
+    return NULL;
+}
+
+/**
+ * @brief Get a submission entry of the loop ring
+ * @param loop Loop
+ * @param source Source of the operation or NULL
+ * @param op Operation
+ * @return Entry or NULL for errors
+ */
+static struct io_uring_sqe *get_sqe(struct event_loop *loop,
+                                    struct event_loop_source *source,
+                                    enum uring_op op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+
+    if (sqe == NULL) {
+        log_error("Unable to get submission entry: %s", strerror(errno));
+        return NULL;
+    }
+
+    sqe->user_data = (uint64_t)(uintptr_t)source | (uint64_t)op;
+
+    if (source == NULL) {
+        return sqe;
+    }
+
+    if (source->uring.file_index >= 0) {
+        sqe->fd = source->uring.file_index;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = source->fd;
+    }
+
+    return sqe;
+}
+
+/**
+ * @brief Submit a read of the wakeup descriptor
+ * @param loop Loop
+ */
+static void submit_wakeup_read(struct event_loop *loop)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop, NULL, URING_OP_WAKEUP);
+
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = loop->wakeup_fd;
+        sqe->addr = (uint64_t)(uintptr_t)&loop->wakeup_value;
+        sqe->len = sizeof(loop->wakeup_value);
+    }
+}
+
+/**
+ * @brief Submit a timeout which completes at the next tick if the loop has
+ * pending timers
+ * @param loop Loop
+ */
+static void submit_tick(struct event_loop *loop)
+{
+    if (loop->is_tick_inflight || loop->timers.count == 0) {
+        return;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(loop, NULL, URING_OP_TICK);
+
+    if (sqe != NULL) {
+        loop->tick_timeout.tv_sec = 0;
+        loop->tick_timeout.tv_nsec = EVENT_LOOP_TIMER_TICK_MS * 1000000L;
+
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)(uintptr_t)&loop->tick_timeout;
+        sqe->len = 1;
+        loop->is_tick_inflight = true;
+    }
+}
+
+/**
+ * @brief Register the receive buffer of the source in the buffer slot which
+ * has the same index as its file slot
+ * @param loop Loop
+ * @param source Source
+ * @return true if the buffer is registered, false if not
+ */
+static bool_t register_recv_buffer(struct event_loop *loop,
+                                   struct event_loop_source *source)
+{
+    if (!loop->has_fixed_buffers || source->uring.file_index < 0) {
+        return false;
+    }
+
+    if (source->uring.registered_buffer == source->recv_buffer) {
+        return true;
+    }
+
+    struct iovec iov = {.iov_base = source->recv_buffer,
+                        .iov_len = source->recv_size};
+    struct io_uring_rsrc_update2 update = {
+        .offset = (uint32_t)source->uring.file_index,
+        .data = (uint64_t)(uintptr_t)&iov,
+        .nr = 1};
+
+    if (uring_register(&loop->ring, IORING_REGISTER_BUFFERS_UPDATE, &update,
+                       sizeof(update)) == -1) {
+        log_debug("Unable to register buffer: %s", strerror(errno));
+        source->uring.registered_buffer = NULL;
+        return false;
+    }
+
+    source->uring.registered_buffer = source->recv_buffer;
+
+    return true;
+}
+
+/**
+ * @brief Submit a receive to the receive buffer of the source
+ * @param loop Loop
+ * @param source Source
+ */
+static void submit_recv(struct event_loop *loop,
+                        struct event_loop_source *source)
+{
+    if (source->uring.is_recv_inflight || source->uring.is_removed) {
+        return;
+    }
+
+    bool_t is_fixed = register_recv_buffer(loop, source);
+    struct io_uring_sqe *sqe = get_sqe(loop, source, URING_OP_RECV);
+
+    if (sqe == NULL) {
+        return;
+    }
+
+    /* The whole buffer is registered, so a fixed read may start inside it */
+    sqe->addr = (uint64_t)(uintptr_t)((uint8_t *)source->recv_buffer +
+                                      source->recv_offset);
+    sqe->len = (uint32_t)(source->recv_size - source->recv_offset);
+
+    if (is_fixed) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = (uint16_t)source->uring.file_index;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+    }
+
+    source->uring.is_recv_inflight = true;
+    source->uring.inflight++;
+}
+
+/**
+ * @brief Take a fixed file slot for the source, if no slot is free the source
+ * uses its plain descriptor
+ * @param loop Loop
+ * @param source Source
+ */
+static void attach_fixed_file(struct event_loop *loop,
+                              struct event_loop_source *source)
+{
+    source->uring.file_index = -1;
+
+    if (loop->num_of_free_slots == 0) {
+        return;
+    }
+
+    int32_t index = loop->free_slots[loop->num_of_free_slots - 1];
+    struct io_uring_files_update update = {
+        .offset = (uint32_t)index, .fds = (uint64_t)(uintptr_t)&source->fd};
+
+    if (uring_register(&loop->ring, IORING_REGISTER_FILES_UPDATE, &update,
+                       1) == -1) {
+        log_debug("Unable to register file: %s", strerror(errno));
+        return;
+    }
+
+    loop->num_of_free_slots--;
+    source->uring.file_index = index;
+}
+
+/**
+ * @brief Return file and buffer slots of the source
+ * @param loop Loop
+ * @param source Source
+ */
+static void detach_fixed_file(struct event_loop *loop,
+                              struct event_loop_source *source)
+{
+    if (source->uring.file_index < 0) {
+        return;
+    }
+
+    if (source->uring.registered_buffer != NULL) {
+        struct iovec iov = {.iov_base = NULL, .iov_len = 0};
+        struct io_uring_rsrc_update2 update = {
+            .offset = (uint32_t)source->uring.file_index,
+            .data = (uint64_t)(uintptr_t)&iov,
+            .nr = 1};
+
+        uring_register(&loop->ring, IORING_REGISTER_BUFFERS_UPDATE, &update,
+                       sizeof(update));
+    }
+
+    int32_t fd = -1;
+    struct io_uring_files_update update = {
+        .offset = (uint32_t)source->uring.file_index,
+        .fds = (uint64_t)(uintptr_t)&fd};
+
+    uring_register(&loop->ring, IORING_REGISTER_FILES_UPDATE, &update, 1);
+
+    loop->free_slots[loop->num_of_free_slots++] = source->uring.file_index;
+    source->uring.file_index = -1;
+}
+
+/**
+ * @brief Release a removed source once no operations or pending events
+ * reference it
+ * @param loop Loop
+ * @param source Source
+ */
+static void try_release(struct event_loop *loop,
+                        struct event_loop_source *source)
+{
+    if (!source->uring.is_removed || source->uring.inflight > 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&loop->pending_lock);
+    bool_t is_pending = source->uring.pending_events != 0;
+    pthread_mutex_unlock(&loop->pending_lock);
+
+    if (is_pending) {
+        return;
+    }
+
+    detach_fixed_file(loop, source);
+    source->release(source);
+}
+
+/**
+ * @brief Call the handler of the source whose timer expired
+ * @param timer Timer of the source
+ */
+static void on_source_timer(struct timer *timer)
+{
+    struct event_loop_source *source =
+        (struct event_loop_source *)((uint8_t *)timer -
+                                     offsetof(struct event_loop_source, timer));
+
+    if (loop_backend == EVENT_LOOP_BACKEND_EPOLL) {
+        source->on_timer(source);
+        return;
+    }
+
+    /* Keep the source alive while its handler runs */
+    source->uring.inflight++;
+    source->on_timer(source);
+    source->uring.inflight--;
+    try_release(source->loop, source);
+}
+
+/**
+ * @brief Handle events posted to the loop by other threads
+ * @param loop Loop
+ */
+static void process_pending(struct event_loop *loop)
+{
+    pthread_mutex_lock(&loop->pending_lock);
+    struct event_loop_source *source = loop->pending_head;
+    loop->pending_head = NULL;
+    pthread_mutex_unlock(&loop->pending_lock);
+
+    while (source != NULL) {
+        pthread_mutex_lock(&loop->pending_lock);
+        struct event_loop_source *next = source->uring.pending_next;
+        uint32_t events = source->uring.pending_events;
+        source->uring.pending_events = 0;
+        pthread_mutex_unlock(&loop->pending_lock);
+
+        /* Keep the source alive while its handlers run */
+        source->uring.inflight++;
+
+        if (!source->uring.is_removed && (events & EPOLLOUT)) {
+            source->handler(source, EPOLLOUT);
+        }
+
+        if (!source->uring.is_removed && (events & EPOLLIN)) {
+            submit_recv(loop, source);
+        }
+
+        source->uring.inflight--;
+        try_release(loop, source);
+
+        source = next;
+    }
+}
+
+/**
+ * @brief Wake the loop up
+ * @param loop Loop
+ */
+static void wake_loop(struct event_loop *loop)
+{
+    uint64_t one = 1;
+
+    if (write(loop->wakeup_fd, &one, sizeof(one)) == -1) {
+        log_error("Unable to wake event loop: %s", strerror(errno));
+    }
+}
+
+/**
+ * @brief Post events to the loop which owns the source
+ * @param source Source
+ * @param events Events to post
+ */
+static void post_events(struct event_loop_source *source, uint32_t events)
+{
+    struct event_loop *loop = source->loop;
+
+    pthread_mutex_lock(&loop->pending_lock);
+
+    bool_t need_wakeup = loop->pending_head == NULL;
+
+    if (source->uring.pending_events == 0) {
+        source->uring.pending_next = loop->pending_head;
+        loop->pending_head = source;
+    }
+    source->uring.pending_events |= events;
+
+    pthread_mutex_unlock(&loop->pending_lock);
+
+    if (need_wakeup) {
+        wake_loop(loop);
+    }
+}
+
+/**
+ * @brief Start watching a source added by another thread, called by the loop
+ * which takes the source
+ * @param loop Loop
+ * @param source Source
+ */
+static void adopt_source(struct event_loop *loop,
+                         struct event_loop_source *source)
+{
+    source->loop = loop;
+
+    if (source->initial_timeout > 0) {
+        event_loop_set_timer(source, source->initial_timeout);
+    }
+
+    if (loop_backend == EVENT_LOOP_BACKEND_URING) {
+        attach_fixed_file(loop, source);
+        submit_recv(loop, source);
+        return;
+    }
+
+    struct epoll_event event = {.events = SOURCE_EVENTS, .data.ptr = source};
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &event) == -1) {
+        log_error("Unable to watch descriptor %i: %s", source->fd,
+                  strerror(errno));
+
+        /* The owner tears the source down as if the peer hung up */
+        source->handler(source, EPOLLERR | EPOLLHUP);
+    }
+}
+
+/**
+ * @brief Take up to the specified number of sources from the queue of a loop
+ * @param victim Loop whose queue is taken from
+ * @param sources Taken sources
+ * @param max_count Maximum number of sources to take, 0 for the half of the
+ * queue rounded up
+ * @return Number of taken sources
+ */
+static uint32_t take_sources(struct event_loop *victim,
+                             struct event_loop_source **sources,
+                             uint32_t max_count)
+{
+    pthread_mutex_lock(&victim->adopt_lock);
+
+    uint32_t count = victim->adopt_tail - victim->adopt_head;
+
+    if (max_count == 0) {
+        max_count = (count + 1) / 2;
+    }
+
+    if (count > max_count) {
+        count = max_count;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        sources[i] =
+            victim->adopt_queue[victim->adopt_head++ & (ADOPT_QUEUE_SIZE - 1)];
+    }
+
+    pthread_mutex_unlock(&victim->adopt_lock);
+
+    return count;
+}
+
+/**
+ * @brief Adopt all sources queued to the loop. Then steal the half of the
+ * queue of each other loop which has not taken its sources yet because it is
+ * busy.
+ * @param loop Loop
+ */
+static void adopt_sources(struct event_loop *loop)
+{
+    struct event_loop_source *sources[ADOPT_QUEUE_SIZE];
+    int32_t self = (int32_t)(loop - loops);
+
+    for (int32_t i = 0; i < num_of_loops; i++) {
+        struct event_loop *victim = &loops[(self + i) % num_of_loops];
+        uint32_t count = take_sources(victim, sources,
+                                      victim == loop ? ADOPT_QUEUE_SIZE : 0);
+
+        for (uint32_t j = 0; j < count; j++) {
+            adopt_source(loop, sources[j]);
+        }
+    }
+}
+
+/**
+ * @brief Handle one completion of the loop ring
+ * @param loop Loop
+ * @param user_data Completion user data
+ * @param result Completion result
+ */
+static void handle_completion(struct event_loop *loop, uint64_t user_data,
+                              int32_t result)
+{
+    enum uring_op op = (enum uring_op)(user_data & URING_OP_MASK);
+    struct event_loop_source *source =
+        (struct event_loop_source *)(uintptr_t)(user_data & ~URING_OP_MASK);
+    ssize_t value = result;
+
+    /* Handlers get the same result as from the system calls */
+    if (result < 0) {
+        errno = -result;
+        value = -1;
+    }
+
+    switch (op) {
+    case URING_OP_RECV:
+        source->uring.is_recv_inflight = false;
+
+        if (!source->uring.is_removed &&
+            source->on_recv(source, value) && !source->uring.is_removed) {
+            submit_recv(loop, source);
+        }
+
+        source->uring.inflight--;
+        try_release(loop, source);
+        break;
+    case URING_OP_SEND:
+        if (!source->uring.is_removed) {
+            source->on_send(source, value);
+        }
+
+        source->uring.inflight--;
+        try_release(loop, source);
+        break;
+    case URING_OP_WAKEUP:
+        submit_wakeup_read(loop);
+        break;
+    case URING_OP_TICK:
+        loop->is_tick_inflight = false;
+        break;
+    case URING_OP_CANCEL:
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief io_uring event loop thread start routine.
+ * @param arg Pointer to the loop state
+ */
+static void *uring_loop_thread(void *arg)
+{
+    struct event_loop *loop = arg;
+
+    current_loop = loop;
+    submit_wakeup_read(loop);
+
+    while (atomic_load(&is_running)) {
+        process_pending(loop);
+        adopt_sources(loop);
+        submit_tick(loop);
+
+        if (uring_submit_and_wait(&loop->ring, 1) == -1) {
+            log_error("Event loop failed: %s", strerror(errno));
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+            uint64_t user_data = cqe->user_data;
+            int32_t result = cqe->res;
+
+            uring_cqe_seen(&loop->ring);
+            handle_completion(loop, user_data, result);
+        }
+
+        expire_timers(loop);
+    }
+
+    log_debug("Exit loop_thread");
+    return NULL;
+}
+
+/**
+ * @brief Create the ring of the loop and register file and buffer tables
+ * @param loop Loop to initialize
+ * @return 0 for success or -1 if io_uring is not usable
+ */
+static int32_t init_uring(struct event_loop *loop)
+{
+    static const uint8_t required_ops[] = {
+        IORING_OP_READ, IORING_OP_RECV, IORING_OP_READ_FIXED,
+        IORING_OP_SENDMSG, IORING_OP_ASYNC_CANCEL, IORING_OP_TIMEOUT};
+
+    if (uring_init(&loop->ring, URING_ENTRIES, URING_CQ_ENTRIES) == -1) {
+        return -1;
+    }
+
+    /* Without this feature completions can be lost on overflow */
+    if (!(loop->ring.features & IORING_FEAT_NODROP) ||
+        !uring_supports(&loop->ring, required_ops, sizeof(required_ops))) {
+        uring_destroy(&loop->ring);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    loop->free_slots = malloc(URING_SLOTS * sizeof(int32_t));
+    for (int32_t i = 0; i < URING_SLOTS; i++) {
+        loop->free_slots[i] = URING_SLOTS - 1 - i;
+    }
+
+    /* The table of files is registered as empty descriptors */
+    int32_t *fds = malloc(URING_SLOTS * sizeof(int32_t));
+    memset(fds, -1, URING_SLOTS * sizeof(int32_t));
+
+    if (uring_register(&loop->ring, IORING_REGISTER_FILES, fds,
+                       URING_SLOTS) == 0) {
+        loop->num_of_free_slots = URING_SLOTS;
+    } else {
+        log_warning("io_uring fixed files are not available: %s",
+                    strerror(errno));
+    }
+
+    free(fds);
+
+    struct io_uring_rsrc_register buffers = {
+        .nr = URING_SLOTS, .flags = IORING_RSRC_REGISTER_SPARSE};
+
+    loop->has_fixed_buffers =
+        uring_register(&loop->ring, IORING_REGISTER_BUFFERS2, &buffers,
+                       sizeof(buffers)) == 0;
+
+    if (!loop->has_fixed_buffers) {
+        log_warning("io_uring registered buffers are not available: %s",
+                    strerror(errno));
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Create descriptors of the loop
+ * @param loop Loop to initialize
+ * @param backend Backend of the loop
+ * @return 0 for success or -1 for errors
+ */
+static int32_t init_loop(struct event_loop *loop,
+                         enum event_loop_backend backend)
+{
+    pthread_mutex_init(&loop->pending_lock, NULL);
+    pthread_mutex_init(&loop->adopt_lock, NULL);
+    timer_wheel_init(&loop->timers, current_tick());
+
+    if (backend == EVENT_LOOP_BACKEND_URING) {
+        /* The ring waits for the descriptor, so it must be blocking */
+        loop->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+        if (loop->wakeup_fd == -1) {
+            return -1;
+        }
+
+        if (init_uring(loop) == -1) {
+            close(loop->wakeup_fd);
+            return -1;
+        }
+
+        loop->epoll_fd = -1;
+        return 0;
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        return -1;
+    }
+
+    loop->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wakeup_fd == -1) {
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd, &event) ==
+        -1) {
+        close(loop->wakeup_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Close descriptors of the loop
+ * @param loop Loop to destroy
+ */
+static void destroy_loop(struct event_loop *loop)
+{
+    if (loop_backend == EVENT_LOOP_BACKEND_URING) {
+        uring_destroy(&loop->ring);
+        free(loop->free_slots);
+    } else {
+        close(loop->epoll_fd);
+    }
+
+    close(loop->wakeup_fd);
+    pthread_mutex_destroy(&loop->pending_lock);
+    pthread_mutex_destroy(&loop->adopt_lock);
+}
+
+int32_t event_loop_start(int32_t num_loops, enum event_loop_backend backend)
+{
+    if (num_loops < 1) {
+        num_loops = (int32_t)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if (num_loops < 1) {
+        num_loops = 1;
+    }
+
+    loops = calloc((size_t)num_loops, sizeof(struct event_loop));
+    loop_backend = backend;
+    atomic_store(&is_running, true);
+
+    for (num_of_loops = 0; num_of_loops < num_loops; num_of_loops++) {
+        struct event_loop *loop = &loops[num_of_loops];
+
+        if (init_loop(loop, loop_backend) == -1) {
+            /* Only the first loop can fall back, all loops use one backend */
+            if (loop_backend == EVENT_LOOP_BACKEND_URING &&
+                num_of_loops == 0) {
+                log_warning("io_uring is not supported, using epoll: %s",
+                            strerror(errno));
+                loop_backend = EVENT_LOOP_BACKEND_EPOLL;
+                num_of_loops--;
+                continue;
+            }
+
+            log_error("Unable to create event loop: %s", strerror(errno));
+            event_loop_stop();
+            return -1;
+        }
+
+        void *(*routine)(void *) = loop_backend == EVENT_LOOP_BACKEND_URING
+                                       ? uring_loop_thread
+                                       : epoll_loop_thread;
+
+        int32_t result = pthread_create(&loop->thread, NULL, routine, loop);
+        if (result != 0) {
+            log_error("Failed to create thread: %i", result);
+            destroy_loop(loop);
+            event_loop_stop();
+            return -1;
+        }
+    }
+
+    log_info("Event loops: %i (%s)", num_of_loops,
+             loop_backend == EVENT_LOOP_BACKEND_URING ? "io_uring" : "epoll");
+
+    return 0;
+}
+
+void event_loop_stop(void)
+{
+    if (!atomic_exchange(&is_running, false)) {
+        return;
+    }
+
+    for (int32_t i = 0; i < num_of_loops; i++) {
+        wake_loop(&loops[i]);
+    }
+
+    for (int32_t i = 0; i < num_of_loops; i++) {
+        pthread_join(loops[i].thread, NULL);
+        destroy_loop(&loops[i]);
+    }
+
+    num_of_loops = 0;
+}
+
+enum event_loop_backend event_loop_get_backend(void)
+{
+    return loop_backend;
+}
+
+int32_t event_loop_add(struct event_loop_source *source)
+{
+    uint32_t first = atomic_fetch_add(&next_loop, 1);
+
+    source->loop = NULL;
+    source->uring.file_index = -1;
+
+    /* A full queue means its loop is overloaded, the next loop is tried */
+    for (int32_t i = 0; i < num_of_loops; i++) {
+        struct event_loop *loop =
+            &loops[(first + (uint32_t)i) % (uint32_t)num_of_loops];
+
+        pthread_mutex_lock(&loop->adopt_lock);
+
+        uint32_t count = loop->adopt_tail - loop->adopt_head;
+
+        if (count < ADOPT_QUEUE_SIZE) {
+            loop->adopt_queue[loop->adopt_tail++ & (ADOPT_QUEUE_SIZE - 1)] =
+                source;
+        }
+
+        pthread_mutex_unlock(&loop->adopt_lock);
+
+        if (count == ADOPT_QUEUE_SIZE) {
+            continue;
+        }
+
+        if (count == 0) {
+            wake_loop(loop);
+        } else if (num_of_loops > 1) {
+            /* The loop has not taken earlier sources, let a neighbor steal */
+            wake_loop(&loops[(loop - loops + 1) % num_of_loops]);
+        }
+
+        return 0;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+int32_t event_loop_rearm(struct event_loop_source *source)
+{
+    if (loop_backend == EVENT_LOOP_BACKEND_URING) {
+        post_events(source, EPOLLIN);
+        return 0;
+    }
+
+    struct epoll_event event = {.events = SOURCE_EVENTS, .data.ptr = source};
+
+    return epoll_ctl(source->loop->epoll_fd, EPOLL_CTL_MOD, source->fd, &event);
+}
+
+void event_loop_set_recv_buffer(struct event_loop_source *source,
+                                void *buffer, size_t size)
+{
+    source->recv_buffer = buffer;
+    source->recv_size = size;
+
+    /* Freed memory may come back at the same address with other pages */
+    source->uring.registered_buffer = NULL;
+}
+
+void event_loop_remove(struct event_loop_source *source)
+{
+    /* The source was never taken by a loop */
+    if (source->loop == NULL) {
+        source->release(source);
+        return;
+    }
+
+    timer_wheel_cancel(&source->loop->timers, &source->timer);
+
+    if (loop_backend == EVENT_LOOP_BACKEND_EPOLL) {
+        epoll_ctl(source->loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+        source->release(source);
+        return;
+    }
+
+    struct event_loop *loop = source->loop;
+    source->uring.is_removed = true;
+
+    if (source->uring.is_recv_inflight) {
+        struct io_uring_sqe *sqe = get_sqe(loop, NULL, URING_OP_CANCEL);
+
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t)source | URING_OP_RECV;
+        }
+    }
+
+    try_release(loop, source);
+}
+
+void event_loop_set_timer(struct event_loop_source *source, uint64_t delay)
+{
+    struct timer_wheel *timers = &source->loop->timers;
+
+    /* An empty wheel is not advanced, so it may lag behind */
+    if (timers->count == 0) {
+        timer_wheel_advance(timers, current_tick());
+    }
+
+    source->timer.callback = on_source_timer;
+    timer_wheel_add(timers, &source->timer,
+                    timers->now + (delay + EVENT_LOOP_TIMER_TICK_MS - 1) /
+                                      EVENT_LOOP_TIMER_TICK_MS);
+}
+
+bool_t event_loop_is_owner(const struct event_loop_source *source)
+{
+    return current_loop != NULL && current_loop == source->loop;
+}
+
+int32_t event_loop_submit_send(struct event_loop_source *source,
+                               const struct msghdr *msg)
+{
+    struct io_uring_sqe *sqe = get_sqe(source->loop, source, URING_OP_SEND);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+
+    source->uring.inflight++;
+
+    return 0;
+}
+
+void event_loop_request_flush(struct event_loop_source *source)
+{
+    post_events(source, EPOLLOUT);
+}
@@ -0,0 +1,215 @@
+/**
+ * @file event_loop.h
+ * @brief This file contains declarations for the pool of event loop threads
+ * which drive all client sockets.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "global.h"
+#include "timer_wheel.h"
+
+/* Resolution of source timers in milliseconds */
+#define EVENT_LOOP_TIMER_TICK_MS 100
+
+struct event_loop;
+
+/**
+ * @brief Mechanisms used by the loops to drive sockets
+ */
+enum event_loop_backend {
+    /* Edge-triggered readiness notifications, I/O by system calls */
+    EVENT_LOOP_BACKEND_EPOLL,
+    /* Batched submissions and completions through io_uring */
+    EVENT_LOOP_BACKEND_URING
+};
+
+/**
+ * @brief File descriptor watched by an event loop. Structures which need to be
+ * driven by a loop embed it as the first member.
+ */
+struct event_loop_source {
+    int32_t fd;
+    /* Loop which owns the source, only this loop calls the handlers */
+    struct event_loop *loop;
+    /*
+     * Called by the owning loop thread with the epoll event mask. With the
+     * epoll backend sources are registered edge-triggered, so the handler must
+     * consume the descriptor until it would block. With the io_uring backend
+     * the handler is only called with EPOLLOUT after event_loop_request_flush.
+     */
+    void (*handler)(struct event_loop_source *source, uint32_t events);
+    /*
+     * Called by the io_uring backend when data was received to recv_buffer at
+     * recv_offset, the result has the same meaning as the result of recv(2).
+     * Returns true if the loop must submit the next receive.
+     */
+    bool_t (*on_recv)(struct event_loop_source *source, ssize_t result);
+    /*
+     * Called by the io_uring backend when a send submitted by
+     * event_loop_submit_send is completed, the result has the same meaning as
+     * the result of sendmsg(2).
+     */
+    void (*on_send)(struct event_loop_source *source, ssize_t result);
+    /* Called once the loop no longer references a removed source */
+    void (*release)(struct event_loop_source *source);
+    /* Called by the owning loop thread when the timer of the source expired */
+    void (*on_timer)(struct event_loop_source *source);
+    /*
+     * Delay of the timer set by the loop which takes the source, in
+     * milliseconds, 0 for no timer
+     */
+    uint64_t initial_timeout;
+    /* Timer of the source, kept by the wheel of the owning loop */
+    struct timer timer;
+    /*
+     * Buffer used by the io_uring backend to receive data, must be changed
+     * with event_loop_set_recv_buffer
+     */
+    void *recv_buffer;
+    size_t recv_size;
+    /* Position in the buffer where the next received data is placed */
+    size_t recv_offset;
+    /* Bookkeeping of the io_uring backend, not used by the owner */
+    struct {
+        struct event_loop_source *pending_next;
+        uint32_t pending_events;
+        uint32_t inflight;
+        int32_t file_index;
+        void *registered_buffer;
+        bool_t is_recv_inflight;
+        bool_t is_removed;
+    } uring;
+};
+
+/**
+ * @brief Start event loop threads
+ * @param num_loops Number of loop threads, if less than 1 then one thread per
+ * online CPU is started
+ * @param backend Requested backend, if io_uring is not supported by the kernel
+ * then epoll is used
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t event_loop_start(int32_t num_loops,
+                                enum event_loop_backend backend);
+
+/**
+ * @brief Stop all event loop threads and wait for them to finish. Safe to call
+ * several times.
+ */
+extern void event_loop_stop(void);
+
+/**
+ * @brief Get the backend used by the started loops
+ * @return Active backend
+ */
+extern enum event_loop_backend event_loop_get_backend(void);
+
+/**
+ * @brief Queue a source to one of the loops, loops are chosen in round robin
+ * order. The source is taken by that loop or stolen by an idle one, which
+ * then owns it. The source must be completely initialized, since its handler
+ * may be called before this function returns. If the loop cannot watch the
+ * descriptor, the handler is called with EPOLLERR and EPOLLHUP. The loop
+ * which takes the source sets its timer to initial_timeout. Never blocks.
+ * @param source Source to register
+ * @return 0 for success or -1 for errors, errno is EAGAIN if queues of all
+ * loops are full
+ */
+extern int32_t event_loop_add(struct event_loop_source *source);
+
+/**
+ * @brief Re-arm a registered source, so the owning loop receives a new event
+ * if the descriptor is still readable or writable. Can be called from any
+ * thread.
+ * @param source Registered source
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t event_loop_rearm(struct event_loop_source *source);
+
+/**
+ * @brief Set the buffer used by the io_uring backend to receive data. A new
+ * buffer is registered with the ring before the next receive, even if its
+ * address was used before. Must be called by the owning loop, or before the
+ * source is added.
+ * @param source Source
+ * @param buffer Buffer
+ * @param size Size of the buffer
+ */
+extern void event_loop_set_recv_buffer(struct event_loop_source *source,
+                                       void *buffer, size_t size);
+
+/**
+ * @brief Unregister the source from its loop. The release callback of the
+ * source is called as soon as the loop no longer references it, the
+ * descriptor must be closed there. Must be called by the owning loop.
+ * @param source Registered source
+ */
+extern void event_loop_remove(struct event_loop_source *source);
+
+/**
+ * @brief Set the timer of the source, its on_timer handler is called once the
+ * delay passed. A pending timer is moved. Each loop keeps its timers in a
+ * wheel, so setting and cancelling timers costs the same for any number of
+ * sources. Delays are rounded up to EVENT_LOOP_TIMER_TICK_MS. The timer is
+ * cancelled when the source is removed. Must be called by the owning loop.
+ * @param source Registered source
+ * @param delay Delay in milliseconds
+ */
+extern void event_loop_set_timer(struct event_loop_source *source,
+                                 uint64_t delay);
+
+/**
+ * @brief Check if the calling thread is the loop which owns the source
+ * @param source Registered source
+ * @return true if the caller is the owner, false if not
+ */
+extern bool_t event_loop_is_owner(const struct event_loop_source *source);
+
+/**
+ * @brief Submit a send to the io_uring of the owning loop, the on_send handler
+ * is called on completion. Message and buffers must stay valid until then.
+ * Must be called by the owning loop.
+ * @param source Registered source
+ * @param msg Message to send
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t event_loop_submit_send(struct event_loop_source *source,
+                                      const struct msghdr *msg);
+
+/**
+ * @brief Ask the owning loop to call the handler of the source with EPOLLOUT.
+ * Used by the io_uring backend to pass output queued by other threads to the
+ * owning loop. Can be called from any thread.
+ * @param source Registered source
+ */
+extern void event_loop_request_flush(struct event_loop_source *source);
+
+#endif /* EVENT_LOOP_H_ */
@@ -0,0 +1,220 @@
+/**
+ * @file latency.c
+ * @brief This file contains definitions of functions recording the relay
+ * latency to per-thread histograms and merging them.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "latency.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "global.h"
+
+/**
+ * @brief Histograms of one thread. Only the owner writes them, so counters
+ * are updated with plain atomic stores and readers see whole values.
+ */
+struct thread_histograms {
+    struct thread_histograms *next;
+    struct {
+        atomic_uint_least64_t counts[LATENCY_NUM_BUCKETS];
+        atomic_uint_least64_t max;
+    } paths[LATENCY_NUM_PATHS];
+};
+
+static _Thread_local struct thread_histograms *thread_histograms;
+
+/* Histograms of all threads which recorded, they live until exit */
+static struct thread_histograms *all_histograms;
+static pthread_mutex_t all_histograms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Get the bucket of a value
+ * @param value Value
+ * @return Bucket index
+ */
+static size_t bucket_index(uint64_t value)
+{
+    if (value < 2 * LATENCY_SUB_BUCKETS) {
+        return (size_t)value;
+    }
+
+    uint32_t exponent = 63 - (uint32_t)__builtin_clzll(value);
+
+    if (exponent > LATENCY_MAX_EXPONENT) {
+        return LATENCY_NUM_BUCKETS - 1;
+    }
+
+    uint32_t shift = exponent - LATENCY_SUB_BUCKET_BITS;
+
+    /* The top bits of the value select a bucket within its range */
+    return 2 * LATENCY_SUB_BUCKETS + (shift - 1) * LATENCY_SUB_BUCKETS +
+           (size_t)((value >> shift) - LATENCY_SUB_BUCKETS);
+}
+
+/**
+ * @brief Get the highest value of a bucket
+ * @param index Bucket index
+ * @return Value
+ */
+static uint64_t bucket_highest_value(size_t index)
+{
+    if (index < 2 * LATENCY_SUB_BUCKETS) {
+        return index;
+    }
+
+    size_t offset = index - 2 * LATENCY_SUB_BUCKETS;
+    uint32_t shift = (uint32_t)(offset / LATENCY_SUB_BUCKETS) + 1;
+    uint64_t sub_bucket = offset % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+uint64_t latency_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Get histograms of the calling thread, registered on first use
+ * @return Histograms or NULL if there is no memory
+ */
+static struct thread_histograms *get_thread_histograms(void)
+{
+    if (thread_histograms != NULL) {
+        return thread_histograms;
+    }
+
+    struct thread_histograms *histograms =
+        calloc(1, sizeof(struct thread_histograms));
+
+    if (histograms != NULL) {
+        pthread_mutex_lock(&all_histograms_lock);
+        histograms->next = all_histograms;
+        all_histograms = histograms;
+        pthread_mutex_unlock(&all_histograms_lock);
+    }
+
+    thread_histograms = histograms;
+
+    return histograms;
+}
+
+void latency_record(const struct latency_mark *mark)
+{
+    if (mark->path == LATENCY_PATH_NONE) {
+        return;
+    }
+
+    uint64_t now = latency_now();
+
+    latency_record_value(mark->path, now > mark->start ? now - mark->start : 0);
+}
+
+void latency_record_value(enum latency_path path, uint64_t value)
+{
+    struct thread_histograms *histograms = get_thread_histograms();
+
+    if (histograms == NULL) {
+        return;
+    }
+
+    atomic_uint_least64_t *count =
+        &histograms->paths[path].counts[bucket_index(value)];
+    atomic_store_explicit(
+        count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+
+    atomic_uint_least64_t *max = &histograms->paths[path].max;
+    if (value > atomic_load_explicit(max, memory_order_relaxed)) {
+        atomic_store_explicit(max, value, memory_order_relaxed);
+    }
+}
+
+void latency_merge(enum latency_path path, struct latency_histogram *merged)
+{
+    memset(merged, 0, sizeof(*merged));
+
+    pthread_mutex_lock(&all_histograms_lock);
+
+    for (struct thread_histograms *histograms = all_histograms;
+         histograms != NULL; histograms = histograms->next) {
+        for (size_t i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+            uint64_t count = atomic_load_explicit(
+                &histograms->paths[path].counts[i], memory_order_relaxed);
+            merged->counts[i] += count;
+            merged->total += count;
+        }
+
+        uint64_t max = atomic_load_explicit(&histograms->paths[path].max,
+                                            memory_order_relaxed);
+        if (max > merged->max) {
+            merged->max = max;
+        }
+    }
+
+    pthread_mutex_unlock(&all_histograms_lock);
+}
+
+uint64_t latency_percentile(const struct latency_histogram *histogram,
+                            double percentile)
+{
+    if (histogram->total == 0) {
+        return 0;
+    }
+
+    /* Rank of the value rounded up, the smallest value for percentile 0 */
+    double exact_rank = percentile / 100 * (double)histogram->total;
+    uint64_t rank = (uint64_t)exact_rank;
+    if ((double)rank < exact_rank) {
+        rank++;
+    }
+    if (rank == 0) {
+        rank = 1;
+    }
+    if (rank > histogram->total) {
+        rank = histogram->total;
+    }
+
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+
+        if (seen >= rank) {
+            uint64_t value = bucket_highest_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
@@ -0,0 +1,127 @@
+/**
+ * @file latency.h
+ * @brief This file contains declarations for the per-thread log-linear
+ * histograms of the relay latency.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <stdint.h>
+
+#include "global.h"
+
+/* Each power of two range of values is split into this many buckets */
+#define LATENCY_SUB_BUCKET_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+
+/* Largest exactly tracked power of two, larger values fall into the top */
+#define LATENCY_MAX_EXPONENT 40
+
+/* Values below two ranges have a bucket each, then every range has a set */
+#define LATENCY_NUM_BUCKETS                                                    \
+    (2 * LATENCY_SUB_BUCKETS +                                                 \
+     (LATENCY_MAX_EXPONENT - LATENCY_SUB_BUCKET_BITS) * LATENCY_SUB_BUCKETS)
+
+/**
+ * @brief Relay paths whose latency is measured, from the end of the read of
+ * the request to the end of the write of the response. Queue paths measure
+ * how long frames wait in outbound queues, from the send to the write of
+ * their last byte.
+ */
+enum latency_path {
+    LATENCY_PATH_NONE = -1,
+    /* DATA request of the host sent to the target */
+    LATENCY_PATH_HOST_DATA,
+    /* RAISE_EVENT request of the host sent to the target */
+    LATENCY_PATH_HOST_EVENT,
+    /* DATA request of the target sent to the host */
+    LATENCY_PATH_TARGET_DATA,
+    /* Frames of the control lane of outbound queues */
+    LATENCY_PATH_CONTROL_QUEUE,
+    /* Frames of the bulk lane of outbound queues */
+    LATENCY_PATH_BULK_QUEUE,
+    LATENCY_NUM_PATHS
+};
+
+/**
+ * @brief Start of a measured relay, travels with the relayed message
+ */
+struct latency_mark {
+    enum latency_path path;
+    /* Time when the request was read, in ns */
+    uint64_t start;
+};
+
+/**
+ * @brief Histogram of latencies in ns. Relative error of values is below
+ * 1 / LATENCY_SUB_BUCKETS.
+ */
+struct latency_histogram {
+    uint64_t counts[LATENCY_NUM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+/**
+ * @brief Get the clock used for latencies
+ * @return Monotonic time in ns
+ */
+extern uint64_t latency_now(void);
+
+/**
+ * @brief Add the time elapsed since the mark to the histogram of its path
+ * kept by the calling thread. Marks without path are ignored.
+ * @param mark Start of the relay
+ */
+extern void latency_record(const struct latency_mark *mark);
+
+/**
+ * @brief Add a latency to the histogram of the path kept by the calling
+ * thread
+ * @param path Path
+ * @param value Latency in ns
+ */
+extern void latency_record_value(enum latency_path path, uint64_t value);
+
+/**
+ * @brief Merge histograms of a path kept by all threads. Can be called from
+ * any thread while other threads record.
+ * @param path Relay path
+ * @param merged Filled with the sum of histograms
+ */
+extern void latency_merge(enum latency_path path,
+                          struct latency_histogram *merged);
+
+/**
+ * @brief Get a percentile of the histogram
+ * @param histogram Histogram
+ * @param percentile Percentile, from 0 to 100
+ * @return Highest value equivalent to the percentile, in ns, or 0 if the
+ * histogram is empty
+ */
+extern uint64_t latency_percentile(const struct latency_histogram *histogram,
+                                   double percentile);
+
+#endif /* LATENCY_H_ */
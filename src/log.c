@@ -28,15 +28,37 @@
 #include "log.h"
 
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <time.h>
 
 #include "global.h"
+#include "log_binary.h"
+
+/* Size of a formatted message, longer messages are truncated */
+#define LOG_MESSAGE_SIZE 256
+
+/* Length of a formatted timestamp with the terminating null */
+#define TIMESTAMP_SIZE 20
+
+/* How long the idle log thread sleeps without being woken, in ms */
+#define LOG_THREAD_IDLE_TIMEOUT 100
+
+/* Number of slots of the table of format ids, a power of two */
+#define FORMAT_TABLE_SIZE 4096
+
+/* Formats registered at most, the rest is formatted by the caller */
+#define MAX_FORMATS (FORMAT_TABLE_SIZE / 4 * 3)
 
 static enum log_level min_log_level;
 
@@ -44,7 +66,81 @@ static bool_t use_stdout;
 
 static FILE *out_file;
 
-static void (*logger_func)(enum log_level level, const char_t *message);
+/* Messages are written in the binary format, see log_binary.h */
+static bool_t is_binary;
+
+static void (*logger_func)(enum log_level level, time_t time,
+                           const char_t *message);
+
+/**
+ * @brief Message waiting in the ring for the log thread
+ */
+struct log_record {
+    /*
+     * Position of the record when it is ready to be read, the position plus
+     * the ring capacity when it is free to be written again
+     */
+    atomic_size_t sequence;
+    enum log_level level;
+    time_t time;
+    /* Size of the binary record in the frame, 0 for text messages */
+    uint16_t size;
+    union {
+        char_t message[LOG_MESSAGE_SIZE];
+        uint8_t frame[LOG_MESSAGE_SIZE];
+    };
+};
+
+/**
+ * @brief Id assigned to a format string of the binary log
+ */
+struct format_slot {
+    /* Format strings are literals, so they are compared by address */
+    _Atomic(const char_t *) format;
+    uint32_t id;
+};
+
+/**
+ * @brief Timestamp formatted for the last second seen by a thread
+ */
+struct timestamp_cache {
+    time_t second;
+    char_t text[TIMESTAMP_SIZE];
+};
+
+/* Ring of records, written by any thread and read by the log thread */
+static struct log_record *ring;
+static size_t ring_mask;
+
+/* Next position to write, shared by the writers */
+static _Alignas(64) atomic_size_t ring_tail;
+
+/* Next position to read, owned by the log thread */
+static _Alignas(64) size_t ring_head;
+
+static atomic_bool is_async;
+static enum log_overflow_policy overflow_policy;
+
+/* Threads which may put a record into the ring, see log_stop_async() */
+static _Alignas(64) atomic_uint num_producers;
+
+/* Records dropped because the ring was full */
+static atomic_uint_least64_t num_dropped;
+
+static pthread_t log_thread;
+static atomic_bool is_log_thread_stopping;
+
+/* The log thread sleeps on the condition only while the ring is empty */
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static atomic_bool is_log_thread_idle;
+
+static _Thread_local struct timestamp_cache timestamp_cache = {.second = -1};
+
+/* Format ids, looked up without locking and added under the lock */
+static struct format_slot format_table[FORMAT_TABLE_SIZE];
+static uint32_t num_formats;
+static pthread_mutex_t format_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /**
  * @brief Prefixes for the different logging levels
@@ -54,8 +150,10 @@ static const char_t *log_level_prefixes[] = {[LOG_LEVEL_ERROR] = "ERROR",
                                              [LOG_LEVEL_INFO] = "INFO",
                                              [LOG_LEVEL_DEBUG] = "DEBUG"};
 
-static void print_to_syslog(enum log_level level, const char_t *message);
-static void print_to_file(enum log_level level, const char_t *message);
+static void print_to_syslog(enum log_level level, time_t time,
+                            const char_t *message);
+static void print_to_file(enum log_level level, time_t time,
+                          const char_t *message);
 
 /**
  * @brief Close remaining file descriptor and reset global params
@@ -68,6 +166,7 @@ static void cleanup_internal(void)
         }
 
         use_stdout = false;
+        is_binary = false;
         out_file = NULL;
     }
 }
@@ -79,37 +178,263 @@ void log_reset_state(void)
     logger_func = print_to_syslog;
 }
 
+/**
+ * @brief Format local time of a moment, the text is reused within a second
+ * @param time Moment
+ * @return Formatted time, valid until the next call on the same thread
+ */
+static const char_t *format_timestamp(time_t time)
+{
+    if (timestamp_cache.second != time) {
+        struct tm current_tm;
+        localtime_r(&time, &current_tm);
+
+        strftime(timestamp_cache.text, TIMESTAMP_SIZE, "%Y-%m-%d %H:%M:%S",
+                 &current_tm);
+        timestamp_cache.second = time;
+    }
+
+    return timestamp_cache.text;
+}
+
 /**
  * @brief Print to syslog
  */
-static void print_to_syslog(enum log_level level, const char_t *message)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void print_to_syslog(enum log_level level, time_t time,
+                            const char_t *message)
 {
     syslog(LOG_INFO, "[%s] %s\n", log_level_prefixes[level], message);
 }
+#pragma GCC diagnostic pop
+
+/**
+ * @brief Write a message to the stream of the file without flushing it
+ * @return 0 for success or -1 for errors
+ */
+static int32_t write_to_file(enum log_level level, time_t time,
+                             const char_t *message)
+{
+    int32_t res = fprintf(out_file, "%s: %s [%s] %s\n", PROGRAM_NAME,
+                          format_timestamp(time), log_level_prefixes[level],
+                          message);
+
+    if (res == -1) {
+        print_to_syslog(LOG_LEVEL_ERROR, time, "Unable to write to log file");
+        return -1;
+    }
+
+    return 0;
+}
 
 /**
  * @brief Print to file which can be a regular text file or STDOUT "file"
  */
-static void print_to_file(enum log_level level, const char_t *message)
+static void print_to_file(enum log_level level, time_t time,
+                          const char_t *message)
 {
-    struct tm *current_tm;
-    time_t time_now;
+    if (write_to_file(level, time, message) == 0) {
+        fflush(out_file);
+    }
+}
 
-    time(&time_now);
-    current_tm = localtime(&time_now);
+/**
+ * @brief Get the monotonic clock used by binary messages
+ * @return Time in ns
+ */
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    int32_t res = fprintf(
-        out_file, "%s: %04i-%02i-%02i %02i:%02i:%02i [%s] %s\n", PROGRAM_NAME,
-        current_tm->tm_year + 1900, current_tm->tm_mon + 1, current_tm->tm_mday,
-        current_tm->tm_hour, current_tm->tm_min, current_tm->tm_sec,
-        log_level_prefixes[level], message);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
 
-    if (res == -1) {
-        print_to_syslog(LOG_LEVEL_ERROR, "Unable to write to log file");
-        return;
+/**
+ * @brief Write a record of the binary log to the stream without flushing it
+ * @param frame Header and payload of the record
+ * @param size Size of the record
+ * @return 0 for success or -1 for errors
+ */
+static int32_t write_binary(const uint8_t *frame, size_t size)
+{
+    /* Each call writes under the lock of the stream, records never mix */
+    if (fwrite(frame, 1, size, out_file) != size) {
+        print_to_syslog(LOG_LEVEL_ERROR, 0, "Unable to write to log file");
+        return -1;
     }
 
-    fflush(out_file);
+    return 0;
+}
+
+/**
+ * @brief Write a record whose payload is made of two parts to the binary log
+ * @return 0 for success or -1 for errors
+ */
+static int32_t write_binary_record(enum log_binary_record_type type,
+                                   const void *head, size_t head_size,
+                                   const void *tail, size_t tail_size)
+{
+    uint8_t frame[sizeof(struct log_binary_header) + UINT16_MAX];
+
+    if (head_size + tail_size > UINT16_MAX) {
+        return -1;
+    }
+
+    struct log_binary_header header = {.type = (uint8_t)type,
+                                       .size =
+                                           (uint16_t)(head_size + tail_size)};
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), head, head_size);
+    memcpy(frame + sizeof(header) + head_size, tail, tail_size);
+
+    return write_binary(frame, sizeof(header) + header.size);
+}
+
+/**
+ * @brief Find the slot of a format string in the table of format ids
+ * @return Slot holding the format or the empty slot where it belongs
+ */
+static struct format_slot *find_format(const char_t *format)
+{
+    size_t index = ((uint64_t)(uintptr_t)format * 0x9E3779B97F4A7C15u) >> 52;
+
+    while (true) {
+        struct format_slot *slot = &format_table[index];
+        const char_t *slot_format =
+            atomic_load_explicit(&slot->format, memory_order_acquire);
+
+        if (slot_format == format || slot_format == NULL) {
+            return slot;
+        }
+
+        index = (index + 1) & (FORMAT_TABLE_SIZE - 1);
+    }
+}
+
+/**
+ * @brief Get the id of a format string, a new id is written to the binary
+ * log before it is used by messages
+ * @param format Format string
+ * @return Id or -1 if the table of ids is full
+ */
+static int64_t get_format_id(const char_t *format)
+{
+    struct format_slot *slot = find_format(format);
+
+    if (atomic_load_explicit(&slot->format, memory_order_acquire) != NULL) {
+        return slot->id;
+    }
+
+    int64_t id = -1;
+
+    pthread_mutex_lock(&format_lock);
+
+    /* Another thread may register the format first */
+    slot = find_format(format);
+
+    if (atomic_load_explicit(&slot->format, memory_order_relaxed) != NULL) {
+        id = slot->id;
+    } else if (num_formats < MAX_FORMATS) {
+        uint32_t new_id = num_formats;
+        if (write_binary_record(LOG_BINARY_RECORD_FORMAT, &new_id,
+                                sizeof(new_id), format,
+                                strlen(format)) == 0) {
+            slot->id = new_id;
+            atomic_store_explicit(&slot->format, format, memory_order_release);
+            num_formats++;
+            id = new_id;
+        }
+    }
+
+    pthread_mutex_unlock(&format_lock);
+
+    return id;
+}
+
+/**
+ * @brief Fill the header and the beginning of the payload of a message
+ * @return Size of the filled part
+ */
+static size_t begin_message(enum log_level level, uint32_t id, uint8_t *frame)
+{
+    struct log_binary_header header = {.type = LOG_BINARY_RECORD_MESSAGE,
+                                       .level = (uint8_t)level};
+    uint64_t time = monotonic_ns();
+    size_t size = sizeof(header);
+
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + size, &id, sizeof(id));
+    size += sizeof(id);
+    memcpy(frame + size, &time, sizeof(time));
+    size += sizeof(time);
+
+    return size;
+}
+
+/**
+ * @brief Set the payload size in the header of a message
+ * @return Size of the whole record
+ */
+static size_t end_message(uint8_t *frame, size_t size)
+{
+    struct log_binary_header header;
+    memcpy(&header, frame, sizeof(header));
+    header.size = (uint16_t)(size - sizeof(header));
+    memcpy(frame, &header, sizeof(header));
+
+    return size;
+}
+
+/**
+ * @brief Encode a message already formatted by the caller
+ * @param level Log level
+ * @param message Formatted message
+ * @param frame Encoded record
+ * @param frame_size Size of the frame buffer
+ * @return Size of the record
+ */
+static size_t encode_text(enum log_level level, const char_t *message,
+                          uint8_t *frame, size_t frame_size)
+{
+    size_t size = begin_message(level, LOG_BINARY_TEXT_FORMAT_ID, frame);
+
+    uint16_t length = (uint16_t)strnlen(message, frame_size - size - 2);
+    memcpy(frame + size, &length, sizeof(length));
+    memcpy(frame + size + sizeof(length), message, length);
+
+    return end_message(frame, size + sizeof(length) + length);
+}
+
+/**
+ * @brief Encode a message with the id of its format and raw arguments, the
+ * message is formatted by the caller if the format can not be encoded
+ * @param level Log level
+ * @param format Format string
+ * @param args Arguments of the format string
+ * @param frame Encoded record
+ * @param frame_size Size of the frame buffer
+ * @return Size of the record
+ */
+static size_t encode_message(enum log_level level, const char_t *format,
+                             va_list args, uint8_t *frame, size_t frame_size)
+{
+    int64_t id = get_format_id(format);
+
+    if (id != -1) {
+        size_t size = begin_message(level, (uint32_t)id, frame);
+        int32_t args_size = log_binary_encode_args(format, args, frame + size,
+                                                   frame_size - size);
+        if (args_size != -1) {
+            return end_message(frame, size + (size_t)args_size);
+        }
+    }
+
+    char_t message[LOG_MESSAGE_SIZE];
+    vsnprintf(message, sizeof(message), format, args);
+
+    return encode_text(level, message, frame, frame_size);
 }
 
 void log_set_min_level(enum log_level level)
@@ -142,12 +467,358 @@ void log_set_out_stdout(void)
     out_file = stdout;
 }
 
+int32_t log_set_binary_file(const char_t *filename)
+{
+    cleanup_internal();
+
+    out_file = fopen(filename, "a");
+
+    if (out_file == NULL) {
+        log_error("Failed to open file %s error %s", filename, strerror(errno));
+        return -1;
+    }
+
+    if (fseek(out_file, 0, SEEK_END) == 0 && ftell(out_file) == 0) {
+        fwrite(LOG_BINARY_MAGIC, 1, LOG_BINARY_MAGIC_SIZE, out_file);
+    }
+
+    /* Ids of a new run start from scratch after the clock record */
+    memset(format_table, 0, sizeof(format_table));
+    num_formats = 0;
+
+    struct timespec realtime;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+
+    int64_t clocks[] = {
+        (int64_t)realtime.tv_sec * 1000000000 + realtime.tv_nsec,
+        (int64_t)monotonic_ns()};
+    write_binary_record(LOG_BINARY_RECORD_CLOCK, clocks, sizeof(clocks),
+                        PROGRAM_NAME, strlen(PROGRAM_NAME));
+
+    if (get_format_id("%s") != LOG_BINARY_TEXT_FORMAT_ID) {
+        cleanup_internal();
+        return -1;
+    }
+
+    fflush(out_file);
+
+    is_binary = true;
+    logger_func = print_to_file;
+
+    return 0;
+}
+
+/**
+ * @brief Write a record taken from the ring, the stream is flushed once the
+ * ring is drained
+ */
+static void write_record(const struct log_record *record)
+{
+    if (record->size > 0) {
+        write_binary(record->frame, record->size);
+    } else if (logger_func == print_to_file) {
+        write_to_file(record->level, record->time, record->message);
+    } else {
+        logger_func(record->level, record->time, record->message);
+    }
+}
+
+/**
+ * @brief Write all records published to the ring
+ * @return Number of written records
+ */
+static size_t drain_ring(void)
+{
+    size_t count = 0;
+
+    while (true) {
+        struct log_record *record = &ring[ring_head & ring_mask];
+        size_t sequence =
+            atomic_load_explicit(&record->sequence, memory_order_acquire);
+
+        if (sequence != ring_head + 1) {
+            break;
+        }
+
+        write_record(record);
+
+        /* Free the record for the writers of the next lap */
+        atomic_store_explicit(&record->sequence, ring_head + ring_mask + 1,
+                              memory_order_release);
+        ring_head++;
+        count++;
+    }
+
+    uint64_t dropped = atomic_exchange(&num_dropped, 0);
+    if (dropped > 0) {
+        struct log_record record = {.level = LOG_LEVEL_WARNING,
+                                    .time = time(NULL)};
+        char_t message[LOG_MESSAGE_SIZE];
+        snprintf(message, sizeof(message), "%" PRIu64 " log records dropped",
+                 dropped);
+
+        if (is_binary) {
+            record.size = (uint16_t)encode_text(record.level, message,
+                                                record.frame, LOG_MESSAGE_SIZE);
+        } else {
+            strcpy(record.message, message);
+        }
+        write_record(&record);
+        count++;
+    }
+
+    if (count > 0 && out_file != NULL) {
+        fflush(out_file);
+    }
+
+    return count;
+}
+
+/**
+ * @brief Check whether the next record of the ring is published
+ */
+static bool_t is_ring_ready(void)
+{
+    struct log_record *record = &ring[ring_head & ring_mask];
+
+    return atomic_load(&record->sequence) == ring_head + 1 ||
+           atomic_load(&num_dropped) > 0;
+}
+
+/**
+ * @brief Routine of the log thread
+ * @param arg Unused
+ * @return NULL
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void *log_thread_routine(void *arg)
+{
+    while (!atomic_load(&is_log_thread_stopping)) {
+        if (drain_ring() > 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&wake_lock);
+
+        /* Writers check the flag after publishing, see wake_log_thread() */
+        atomic_store(&is_log_thread_idle, true);
+
+        if (!is_ring_ready() && !atomic_load(&is_log_thread_stopping)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LOG_THREAD_IDLE_TIMEOUT * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+
+            pthread_cond_timedwait(&wake_cond, &wake_lock, &deadline);
+        }
+
+        atomic_store(&is_log_thread_idle, false);
+        pthread_mutex_unlock(&wake_lock);
+    }
+
+    drain_ring();
+
+    return NULL;
+}
+#pragma GCC diagnostic pop
+
+/**
+ * @brief Wake the log thread if it sleeps, called after a record is published
+ */
+static void wake_log_thread(void)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&is_log_thread_idle, memory_order_relaxed)) {
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_lock);
+    }
+}
+
+/**
+ * @brief Claim a free record of the ring
+ * @return Record or NULL if the ring is full
+ */
+static struct log_record *claim_record(void)
+{
+    size_t position = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+
+    while (true) {
+        struct log_record *record = &ring[position & ring_mask];
+        size_t sequence =
+            atomic_load_explicit(&record->sequence, memory_order_acquire);
+
+        if (sequence == position) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &ring_tail, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                return record;
+            }
+        } else if ((intptr_t)(sequence - position) < 0) {
+            /* The record of the previous lap is not written yet */
+            return NULL;
+        } else {
+            position =
+                atomic_load_explicit(&ring_tail, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Put a message into the ring for the log thread
+ * @return 0 if the message is queued or dropped, -1 if it must be written by
+ * the caller because asynchronous logging stopped
+ */
+static int32_t push_record(enum log_level level, const char_t *format,
+                           va_list args)
+{
+    struct log_record *record = claim_record();
+
+    while (record == NULL) {
+        if (overflow_policy == LOG_OVERFLOW_DROP) {
+            atomic_fetch_add_explicit(&num_dropped, 1, memory_order_relaxed);
+            return 0;
+        }
+
+        if (!atomic_load(&is_async)) {
+            return -1;
+        }
+
+        wake_log_thread();
+        sched_yield();
+        record = claim_record();
+    }
+
+    record->level = level;
+
+    if (is_binary) {
+        record->size = (uint16_t)encode_message(
+            level, format, args, record->frame, LOG_MESSAGE_SIZE);
+    } else {
+        record->time = time(NULL);
+        record->size = 0;
+        vsnprintf(record->message, LOG_MESSAGE_SIZE, format, args);
+    }
+
+    /* Publish the record to the log thread */
+    size_t sequence =
+        atomic_load_explicit(&record->sequence, memory_order_relaxed);
+    atomic_store_explicit(&record->sequence, sequence + 1,
+                          memory_order_release);
+
+    wake_log_thread();
+
+    return 0;
+}
+
+int32_t log_start_async(size_t capacity, enum log_overflow_policy policy)
+{
+    if (atomic_load(&is_async)) {
+        return 0;
+    }
+
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    ring = calloc(size, sizeof(struct log_record));
+    if (ring == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&ring[i].sequence, i);
+    }
+
+    ring_mask = size - 1;
+    ring_head = 0;
+    atomic_store(&ring_tail, 0);
+    overflow_policy = policy;
+    atomic_store(&is_log_thread_stopping, false);
+
+    /* Signals are handled by the other threads, the log thread is joined */
+    sigset_t mask;
+    sigset_t old_mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    int32_t result = pthread_create(&log_thread, NULL, log_thread_routine,
+                                    NULL);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (result != 0) {
+        free(ring);
+        ring = NULL;
+        errno = result;
+        return -1;
+    }
+
+    atomic_store(&is_async, true);
+
+    return 0;
+}
+
+void log_stop_async(void)
+{
+    if (!atomic_exchange(&is_async, false)) {
+        return;
+    }
+
+    /* Records claimed before the flag changed are published for the drain */
+    while (atomic_load(&num_producers) > 0) {
+        sched_yield();
+    }
+
+    atomic_store(&is_log_thread_stopping, true);
+
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
+
+    pthread_join(log_thread, NULL);
+}
+
 static void log_generic(enum log_level level, const char_t *format,
                         va_list args)
 {
-    char_t buffer[256];
-    vsprintf(buffer, format, args);
-    logger_func(level, buffer);
+    int32_t result = -1;
+
+    /* Counted before the check, so a stopping ring waits for the record */
+    atomic_fetch_add(&num_producers, 1);
+
+    if (atomic_load(&is_async)) {
+        va_list copy;
+        va_copy(copy, args);
+        result = push_record(level, format, copy);
+        va_end(copy);
+    }
+
+    atomic_fetch_sub(&num_producers, 1);
+
+    if (result == 0) {
+        return;
+    }
+
+    if (is_binary) {
+        uint8_t frame[LOG_MESSAGE_SIZE];
+        size_t size = encode_message(level, format, args, frame, sizeof(frame));
+
+        if (write_binary(frame, size) == 0) {
+            fflush(out_file);
+        }
+        return;
+    }
+
+    char_t buffer[LOG_MESSAGE_SIZE];
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    logger_func(level, time(NULL), buffer);
 }
 
 void log_error(const char_t *format, ...)
@@ -28,6 +28,7 @@
 #ifndef LOG_H_
 #define LOG_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "global.h"
@@ -42,6 +43,17 @@ enum log_level {
     LOG_LEVEL_DEBUG
 };
 
+/**
+ * @brief What a logging call does when the ring of asynchronous logging is
+ * full
+ */
+enum log_overflow_policy {
+    /* Discard the message, the number of discarded messages is logged later */
+    LOG_OVERFLOW_DROP,
+    /* Wait until the log thread frees a record */
+    LOG_OVERFLOW_BLOCK
+};
+
 /**
  * @brief Writes the diagnostic message at the @b Error level using the
  * specified parameters and formatting them with the supplied format string.
@@ -99,4 +111,33 @@ extern int32_t log_set_log_file(const char_t *filename);
  */
 extern void log_set_out_stdout(void);
 
+/**
+ * @brief Set log target to specified file in the binary format. Messages keep
+ * the id of the format string, raw arguments and a monotonic timestamp, they
+ * are turned into text by the baltmonitor-logdecode tool.
+ * @param filename The name of the file where the logs will be sent.
+ * If the file already exists, it will be appended.
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t log_set_binary_file(const char_t *filename);
+
+/**
+ * @brief Start asynchronous logging. Logging calls only format the message
+ * into a lock-free ring, a background thread adds timestamps and writes the
+ * messages to the current target in batches. The target must not be changed
+ * until asynchronous logging is stopped.
+ * @param capacity Number of messages the ring holds, rounded up to a power of
+ * two
+ * @param policy What to do with messages which do not fit into the ring
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t log_start_async(size_t capacity,
+                               enum log_overflow_policy policy);
+
+/**
+ * @brief Write all queued messages and stop the background thread, further
+ * logging calls write messages themselves
+ */
+extern void log_stop_async(void);
+
 #endif /* LOG_H_ */
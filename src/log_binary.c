@@ -0,0 +1,613 @@
+/**
+ * @file log_binary.c
+ * @brief This file contains definitions of functions encoding arguments of
+ * binary log messages and formatting messages from them.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "log_binary.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "global.h"
+
+/* Longest conversion specification supported by the decoder */
+#define MAX_SPEC_SIZE 32
+
+/**
+ * @brief Kinds of arguments taken by conversions
+ */
+enum arg_type {
+    /* "%%" takes no argument */
+    ARG_NONE,
+    ARG_SIGNED,
+    ARG_UNSIGNED,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER,
+    /* Conversions which can not be encoded, such as "%n" */
+    ARG_INVALID
+};
+
+/**
+ * @brief Length modifiers of conversions
+ */
+enum arg_length {
+    LENGTH_DEFAULT,
+    LENGTH_CHAR,
+    LENGTH_SHORT,
+    LENGTH_LONG,
+    LENGTH_LONG_LONG,
+    LENGTH_INTMAX,
+    LENGTH_SIZE,
+    LENGTH_PTRDIFF,
+    LENGTH_LONG_DOUBLE
+};
+
+/**
+ * @brief Parsed conversion specification
+ */
+struct conversion {
+    enum arg_type type;
+    enum arg_length length;
+    /* Width and precision are taken from int arguments */
+    bool_t is_width_arg;
+    bool_t is_precision_arg;
+    /* Number of characters of the specification including '%' */
+    size_t size;
+};
+
+/**
+ * @brief Parse a conversion specification
+ * @param spec Specification starting with '%'
+ * @param conv Parsed specification
+ */
+static void parse_conversion(const char_t *spec, struct conversion *conv)
+{
+    size_t i = 1;
+
+    *conv = (struct conversion){.type = ARG_INVALID};
+
+    while (spec[i] != '\0' && strchr("-+ #0'", spec[i]) != NULL) {
+        i++;
+    }
+
+    if (spec[i] == '*') {
+        conv->is_width_arg = true;
+        i++;
+    } else {
+        while (spec[i] >= '0' && spec[i] <= '9') {
+            i++;
+        }
+    }
+
+    if (spec[i] == '.') {
+        i++;
+
+        if (spec[i] == '*') {
+            conv->is_precision_arg = true;
+            i++;
+        } else {
+            while (spec[i] >= '0' && spec[i] <= '9') {
+                i++;
+            }
+        }
+    }
+
+    switch (spec[i]) {
+    case 'h':
+        i++;
+        conv->length = LENGTH_SHORT;
+        if (spec[i] == 'h') {
+            i++;
+            conv->length = LENGTH_CHAR;
+        }
+        break;
+    case 'l':
+        i++;
+        conv->length = LENGTH_LONG;
+        if (spec[i] == 'l') {
+            i++;
+            conv->length = LENGTH_LONG_LONG;
+        }
+        break;
+    case 'j':
+        i++;
+        conv->length = LENGTH_INTMAX;
+        break;
+    case 'z':
+        i++;
+        conv->length = LENGTH_SIZE;
+        break;
+    case 't':
+        i++;
+        conv->length = LENGTH_PTRDIFF;
+        break;
+    case 'L':
+        i++;
+        conv->length = LENGTH_LONG_DOUBLE;
+        break;
+    default:
+        break;
+    }
+
+    if (spec[i] == '\0') {
+        conv->size = i;
+        return;
+    }
+
+    conv->size = i + 1;
+
+    switch (spec[i]) {
+    case '%':
+        conv->type = ARG_NONE;
+        break;
+    case 'd':
+    case 'i':
+    case 'c':
+        conv->type = ARG_SIGNED;
+        break;
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        conv->type = ARG_UNSIGNED;
+        break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        conv->type = ARG_DOUBLE;
+        break;
+    case 's':
+        /* Wide strings are not supported */
+        if (conv->length == LENGTH_DEFAULT) {
+            conv->type = ARG_STRING;
+        }
+        break;
+    case 'p':
+        conv->type = ARG_POINTER;
+        break;
+    default:
+        break;
+    }
+
+    /* Integer modifiers only apply to integers */
+    if (conv->type != ARG_SIGNED && conv->type != ARG_UNSIGNED &&
+        conv->length != LENGTH_DEFAULT &&
+        !(conv->type == ARG_DOUBLE && (conv->length == LENGTH_LONG ||
+                                       conv->length == LENGTH_LONG_DOUBLE))) {
+        conv->type = ARG_INVALID;
+    }
+}
+
+/**
+ * @brief Take a signed integer argument
+ */
+static int64_t take_signed(enum arg_length length, va_list *args)
+{
+    switch (length) {
+    case LENGTH_LONG:
+        return va_arg(*args, long);
+    case LENGTH_LONG_LONG:
+        return va_arg(*args, long long);
+    case LENGTH_INTMAX:
+        return va_arg(*args, intmax_t);
+    case LENGTH_SIZE:
+        return va_arg(*args, ssize_t);
+    case LENGTH_PTRDIFF:
+        return va_arg(*args, ptrdiff_t);
+    default:
+        return va_arg(*args, int);
+    }
+}
+
+/**
+ * @brief Take an unsigned integer argument
+ */
+static uint64_t take_unsigned(enum arg_length length, va_list *args)
+{
+    switch (length) {
+    case LENGTH_LONG:
+        return va_arg(*args, unsigned long);
+    case LENGTH_LONG_LONG:
+        return va_arg(*args, unsigned long long);
+    case LENGTH_INTMAX:
+        return va_arg(*args, uintmax_t);
+    case LENGTH_SIZE:
+        return va_arg(*args, size_t);
+    case LENGTH_PTRDIFF:
+        return (uint64_t)va_arg(*args, ptrdiff_t);
+    default:
+        return va_arg(*args, unsigned int);
+    }
+}
+
+/**
+ * @brief Append a value to the encoded arguments
+ * @return 0 for success or -1 if there is no room
+ */
+static int32_t put_value(uint8_t **pos, const uint8_t *end, const void *value,
+                         size_t size)
+{
+    if ((size_t)(end - *pos) < size) {
+        return -1;
+    }
+
+    memcpy(*pos, value, size);
+    *pos += size;
+
+    return 0;
+}
+
+/**
+ * @brief Append a string to the encoded arguments, truncating it to fit
+ * @return 0 for success or -1 if there is no room
+ */
+static int32_t put_string(uint8_t **pos, const uint8_t *end,
+                          const char_t *string)
+{
+    if (string == NULL) {
+        string = "(null)";
+    }
+
+    size_t room = (size_t)(end - *pos);
+    if (room < sizeof(uint16_t)) {
+        return -1;
+    }
+
+    size_t length = strlen(string);
+    if (length > room - sizeof(uint16_t)) {
+        length = room - sizeof(uint16_t);
+    }
+    if (length > UINT16_MAX) {
+        length = UINT16_MAX;
+    }
+
+    uint16_t size = (uint16_t)length;
+    put_value(pos, end, &size, sizeof(size));
+    put_value(pos, end, string, length);
+
+    return 0;
+}
+
+int32_t log_binary_encode_args(const char_t *format, va_list args,
+                               uint8_t *buffer, size_t size)
+{
+    uint8_t *pos = buffer;
+    const uint8_t *end = buffer + size;
+    va_list ap;
+    va_copy(ap, args);
+
+    int32_t result = 0;
+
+    for (const char_t *spec = strchr(format, '%'); spec != NULL;
+         spec = strchr(spec, '%')) {
+        struct conversion conv;
+        parse_conversion(spec, &conv);
+        spec += conv.size;
+
+        if (conv.type == ARG_INVALID) {
+            result = -1;
+            break;
+        }
+
+        /* Arguments which do not fit are dropped, the decoder notices it */
+        if (conv.is_width_arg) {
+            int64_t width = va_arg(ap, int);
+            put_value(&pos, end, &width, sizeof(width));
+        }
+
+        if (conv.is_precision_arg) {
+            int64_t precision = va_arg(ap, int);
+            put_value(&pos, end, &precision, sizeof(precision));
+        }
+
+        switch (conv.type) {
+        case ARG_SIGNED: {
+            int64_t value = take_signed(conv.length, &ap);
+            put_value(&pos, end, &value, sizeof(value));
+            break;
+        }
+        case ARG_UNSIGNED: {
+            uint64_t value = take_unsigned(conv.length, &ap);
+            put_value(&pos, end, &value, sizeof(value));
+            break;
+        }
+        case ARG_DOUBLE: {
+            double value = conv.length == LENGTH_LONG_DOUBLE
+                               ? (double)va_arg(ap, long double)
+                               : va_arg(ap, double);
+            put_value(&pos, end, &value, sizeof(value));
+            break;
+        }
+        case ARG_STRING:
+            put_string(&pos, end, va_arg(ap, const char_t *));
+            break;
+        case ARG_POINTER: {
+            uint64_t value = (uintptr_t)va_arg(ap, void *);
+            put_value(&pos, end, &value, sizeof(value));
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    va_end(ap);
+
+    return result == 0 ? (int32_t)(pos - buffer) : -1;
+}
+
+/**
+ * @brief Take a value from the encoded arguments
+ * @return 0 for success or -1 if the arguments end
+ */
+static int32_t take_value(const uint8_t **pos, const uint8_t *end, void *value,
+                          size_t size)
+{
+    if ((size_t)(end - *pos) < size) {
+        return -1;
+    }
+
+    memcpy(value, *pos, size);
+    *pos += size;
+
+    return 0;
+}
+
+/**
+ * @brief Output of the decoder
+ */
+struct output {
+    char_t *text;
+    size_t size;
+    size_t length;
+};
+
+/**
+ * @brief Append characters to the output, truncating them to fit
+ */
+static void append(struct output *out, const char_t *text, size_t length)
+{
+    size_t room = out->size - out->length - 1;
+    if (length > room) {
+        length = room;
+    }
+
+    memcpy(out->text + out->length, text, length);
+    out->length += length;
+    out->text[out->length] = '\0';
+}
+
+/**
+ * @brief Copy a specification replacing '*' with the values taken from the
+ * encoded arguments
+ * @return 0 for success or -1 for errors
+ */
+static int32_t expand_spec(const char_t *spec, const struct conversion *conv,
+                           const uint8_t **pos, const uint8_t *end,
+                           char_t *expanded)
+{
+    size_t length = 0;
+
+    for (size_t i = 0; i < conv->size; i++) {
+        if (spec[i] != '*') {
+            if (length + 1 >= MAX_SPEC_SIZE) {
+                return -1;
+            }
+            expanded[length++] = spec[i];
+            continue;
+        }
+
+        int64_t value;
+        if (take_value(pos, end, &value, sizeof(value)) == -1) {
+            return -1;
+        }
+
+        /* A negative precision is the same as no precision */
+        bool_t is_precision = i > 0 && spec[i - 1] == '.';
+        if (is_precision && value < 0) {
+            length--;
+            continue;
+        }
+
+        int32_t written = snprintf(expanded + length, MAX_SPEC_SIZE - length,
+                                   "%" PRId64, value);
+        if (written < 0 || (size_t)written >= MAX_SPEC_SIZE - length) {
+            return -1;
+        }
+        length += (size_t)written;
+    }
+
+    expanded[length] = '\0';
+
+    return 0;
+}
+
+/**
+ * @brief Format one encoded argument
+ * @return 0 for success or -1 for errors
+ */
+static int32_t format_arg(const char_t *spec, const struct conversion *conv,
+                          const uint8_t **pos, const uint8_t *end,
+                          struct output *out)
+{
+    char_t text[1024];
+    int32_t written = 0;
+
+    /* The specification is already checked by the encoder */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+    switch (conv->type) {
+    case ARG_SIGNED: {
+        int64_t value;
+        if (take_value(pos, end, &value, sizeof(value)) == -1) {
+            return -1;
+        }
+
+        switch (conv->length) {
+        case LENGTH_LONG:
+            written = snprintf(text, sizeof(text), spec, (long)value);
+            break;
+        case LENGTH_LONG_LONG:
+            written = snprintf(text, sizeof(text), spec, (long long)value);
+            break;
+        case LENGTH_INTMAX:
+            written = snprintf(text, sizeof(text), spec, (intmax_t)value);
+            break;
+        case LENGTH_SIZE:
+            written = snprintf(text, sizeof(text), spec, (ssize_t)value);
+            break;
+        case LENGTH_PTRDIFF:
+            written = snprintf(text, sizeof(text), spec, (ptrdiff_t)value);
+            break;
+        default:
+            written = snprintf(text, sizeof(text), spec, (int)value);
+            break;
+        }
+        break;
+    }
+    case ARG_UNSIGNED: {
+        uint64_t value;
+        if (take_value(pos, end, &value, sizeof(value)) == -1) {
+            return -1;
+        }
+
+        switch (conv->length) {
+        case LENGTH_LONG:
+            written = snprintf(text, sizeof(text), spec, (unsigned long)value);
+            break;
+        case LENGTH_LONG_LONG:
+            written =
+                snprintf(text, sizeof(text), spec, (unsigned long long)value);
+            break;
+        case LENGTH_INTMAX:
+            written = snprintf(text, sizeof(text), spec, (uintmax_t)value);
+            break;
+        case LENGTH_SIZE:
+            written = snprintf(text, sizeof(text), spec, (size_t)value);
+            break;
+        case LENGTH_PTRDIFF:
+            written = snprintf(text, sizeof(text), spec, (ptrdiff_t)value);
+            break;
+        default:
+            written = snprintf(text, sizeof(text), spec, (unsigned int)value);
+            break;
+        }
+        break;
+    }
+    case ARG_DOUBLE: {
+        double value;
+        if (take_value(pos, end, &value, sizeof(value)) == -1) {
+            return -1;
+        }
+
+        if (conv->length == LENGTH_LONG_DOUBLE) {
+            written = snprintf(text, sizeof(text), spec, (long double)value);
+        } else {
+            written = snprintf(text, sizeof(text), spec, value);
+        }
+        break;
+    }
+    case ARG_STRING: {
+        uint16_t length;
+        char_t string[UINT16_MAX + 1];
+        if (take_value(pos, end, &length, sizeof(length)) == -1 ||
+            take_value(pos, end, string, length) == -1) {
+            return -1;
+        }
+
+        string[length] = '\0';
+        written = snprintf(text, sizeof(text), spec, string);
+        break;
+    }
+    case ARG_POINTER: {
+        uint64_t value;
+        if (take_value(pos, end, &value, sizeof(value)) == -1) {
+            return -1;
+        }
+
+        written = snprintf(text, sizeof(text), spec, (void *)(uintptr_t)value);
+        break;
+    }
+    case ARG_NONE:
+        written = snprintf(text, sizeof(text), "%%");
+        break;
+    default:
+        return -1;
+    }
+#pragma GCC diagnostic pop
+
+    if (written < 0) {
+        return -1;
+    }
+
+    append(out, text,
+           (size_t)written < sizeof(text) ? (size_t)written : sizeof(text) - 1);
+
+    return 0;
+}
+
+int32_t log_binary_format(const char_t *format, const uint8_t *args,
+                          size_t size, char_t *message, size_t message_size)
+{
+    struct output out = {.text = message, .size = message_size};
+    const uint8_t *pos = args;
+    const uint8_t *end = args + size;
+
+    message[0] = '\0';
+
+    const char_t *literal = format;
+
+    for (const char_t *spec = strchr(format, '%'); spec != NULL;
+         spec = strchr(literal, '%')) {
+        append(&out, literal, (size_t)(spec - literal));
+
+        struct conversion conv;
+        parse_conversion(spec, &conv);
+        literal = spec + conv.size;
+
+        char_t expanded[MAX_SPEC_SIZE];
+        if (conv.type == ARG_INVALID ||
+            expand_spec(spec, &conv, &pos, end, expanded) == -1 ||
+            format_arg(expanded, &conv, &pos, end, &out) == -1) {
+            return -1;
+        }
+    }
+
+    append(&out, literal, strlen(literal));
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+/**
+ * @file log_binary.h
+ * @brief This file contains declarations for the binary log format, whose
+ * messages keep the id of the format string and raw arguments and are
+ * formatted offline by the decoder.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef LOG_BINARY_H_
+#define LOG_BINARY_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "global.h"
+
+/*
+ * A binary log starts with the magic and continues with records. Numbers are
+ * stored in the byte order of the host, so the decoder must run on a machine
+ * with the same byte order.
+ */
+#define LOG_BINARY_MAGIC "BMLOG\001\r\n"
+#define LOG_BINARY_MAGIC_SIZE 8
+
+/* Id of the format "%s" used for messages formatted by the caller */
+#define LOG_BINARY_TEXT_FORMAT_ID 0
+
+/**
+ * @brief Types of records of a binary log
+ */
+enum log_binary_record_type {
+    /*
+     * Written each time the log is opened. Payload: realtime and monotonic
+     * clocks in ns (int64 each) and the program name. Format ids of the
+     * records before it are forgotten.
+     */
+    LOG_BINARY_RECORD_CLOCK = 1,
+    /* Payload: format id (uint32) and the format string */
+    LOG_BINARY_RECORD_FORMAT,
+    /* Payload: format id (uint32), monotonic clock in ns (uint64), arguments */
+    LOG_BINARY_RECORD_MESSAGE
+};
+
+/**
+ * @brief Header of a record, followed by the payload
+ */
+struct log_binary_header {
+    uint8_t type;
+    /* Log level of messages */
+    uint8_t level;
+    /* Size of the payload */
+    uint16_t size;
+};
+
+/**
+ * @brief Encode arguments of a message. Integers and pointers take 8 bytes,
+ * floating point numbers are stored as double, strings as their size
+ * (uint16) followed by the characters. Strings are truncated to fit.
+ * @param format Format string
+ * @param args Arguments of the format string
+ * @param buffer Encoded arguments
+ * @param size Size of the buffer
+ * @return Size of the encoded arguments or -1 if the format has conversions
+ * which can not be encoded
+ */
+extern int32_t log_binary_encode_args(const char_t *format, va_list args,
+                                      uint8_t *buffer, size_t size);
+
+/**
+ * @brief Format a message from encoded arguments
+ * @param format Format string
+ * @param args Encoded arguments
+ * @param size Size of the encoded arguments
+ * @param message Formatted message, always null-terminated
+ * @param message_size Size of the message buffer
+ * @return 0 for success or -1 if the arguments do not match the format
+ */
+extern int32_t log_binary_format(const char_t *format, const uint8_t *args,
+                                 size_t size, char_t *message,
+                                 size_t message_size);
+
+#endif /* LOG_BINARY_H_ */
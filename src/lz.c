@@ -0,0 +1,303 @@
+/**
+ * @file lz.c
+ * @brief This file contains the LZ compressor of relayed bodies, it writes and
+ * reads the LZ4 block format.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "lz.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "global.h"
+
+/* Binary logarithm of the number of entries of the match finder */
+#define HASH_BITS 12
+
+/* Shortest match, shorter repeats are stored as literals */
+#define MIN_MATCH 4
+
+/* The last bytes of a block are always literals */
+#define LAST_LITERALS 5
+
+/* The last match starts at least this many bytes before the end */
+#define MATCH_LIMIT 12
+
+/* Largest distance to a match */
+#define MAX_OFFSET 65535
+
+/* Lengths which do not fit into a nibble continue in the following bytes */
+#define RUN_MASK 15
+
+/**
+ * @brief Read four bytes at an arbitrary address
+ */
+static uint32_t read32(const uint8_t *position)
+{
+    uint32_t value;
+    memcpy(&value, position, sizeof(value));
+
+    return value;
+}
+
+/**
+ * @brief Get the entry of the match finder for four bytes
+ */
+static uint32_t hash32(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/**
+ * @brief Write the continuation of a length which does not fit into a nibble
+ * @return Position after the length or NULL if it does not fit
+ */
+static uint8_t *write_length(uint8_t *op, const uint8_t *end, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        if (op == end) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+
+    if (op == end) {
+        return NULL;
+    }
+    *op++ = (uint8_t)length;
+
+    return op;
+}
+
+/**
+ * @brief Write a sequence of literals followed by a match, the match is
+ * omitted if its length is zero
+ * @return Position after the sequence or NULL if it does not fit
+ */
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *end,
+                               const uint8_t *literals, size_t num_literals,
+                               size_t offset, size_t match_length)
+{
+    if (op == end) {
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+    size_t match_code = match_length > 0 ? match_length - MIN_MATCH : 0;
+
+    *token = (uint8_t)((num_literals < RUN_MASK ? num_literals : RUN_MASK)
+                       << 4);
+
+    if (num_literals >= RUN_MASK) {
+        op = write_length(op, end, num_literals - RUN_MASK);
+        if (op == NULL) {
+            return NULL;
+        }
+    }
+
+    if ((size_t)(end - op) < num_literals) {
+        return NULL;
+    }
+    memcpy(op, literals, num_literals);
+    op += num_literals;
+
+    if (match_length == 0) {
+        return op;
+    }
+
+    if (end - op < 2) {
+        return NULL;
+    }
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+
+    *token |= (uint8_t)(match_code < RUN_MASK ? match_code : RUN_MASK);
+
+    if (match_code >= RUN_MASK) {
+        op = write_length(op, end, match_code - RUN_MASK);
+    }
+
+    return op;
+}
+
+size_t lz_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+size_t lz_compress(const uint8_t *input, size_t size, uint8_t *output,
+                   size_t capacity)
+{
+    /* Positions of recent sequences of four bytes */
+    uint32_t table[1 << HASH_BITS] = {0};
+    uint8_t *op = output;
+    const uint8_t *end = output + capacity;
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    while (size > MATCH_LIMIT && ip < size - MATCH_LIMIT) {
+        uint32_t sequence = read32(input + ip);
+        uint32_t hash = hash32(sequence);
+        size_t candidate = table[hash];
+
+        table[hash] = (uint32_t)ip;
+
+        if (candidate >= ip || ip - candidate > MAX_OFFSET ||
+            read32(input + candidate) != sequence) {
+            /* Step faster through data which does not compress */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        size_t length = MIN_MATCH;
+
+        while (ip + length < size - LAST_LITERALS &&
+               input[candidate + length] == input[ip + length]) {
+            length++;
+        }
+
+        op = write_sequence(op, end, input + anchor, ip - anchor,
+                            ip - candidate, length);
+        if (op == NULL) {
+            return 0;
+        }
+
+        ip += length;
+        anchor = ip;
+    }
+
+    op = write_sequence(op, end, input + anchor, size - anchor, 0, 0);
+
+    return op == NULL ? 0 : (size_t)(op - output);
+}
+
+/**
+ * @brief Read the continuation of a length
+ * @return false if the block ends within the length
+ */
+static bool_t read_length(const uint8_t **ip, const uint8_t *end,
+                          size_t *length)
+{
+    uint8_t byte;
+
+    do {
+        if (*ip == end) {
+            return false;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+/**
+ * @brief Decode an LZ4 block, see lz_decompress
+ * @param output Buffer for the data or NULL to only check the block
+ * @return Size of the data or -1 if the block is malformed or does not fit
+ */
+static ssize_t decode_block(const uint8_t *input, size_t size,
+                            uint8_t *output, size_t capacity)
+{
+    const uint8_t *ip = input;
+    const uint8_t *in_end = input + size;
+    size_t position = 0;
+
+    while (ip < in_end) {
+        uint8_t token = *ip++;
+        size_t num_literals = token >> 4;
+
+        if (num_literals == RUN_MASK &&
+            !read_length(&ip, in_end, &num_literals)) {
+            return -1;
+        }
+
+        if (num_literals > (size_t)(in_end - ip) ||
+            num_literals > capacity - position) {
+            return -1;
+        }
+
+        if (output != NULL) {
+            memcpy(output + position, ip, num_literals);
+        }
+        ip += num_literals;
+        position += num_literals;
+
+        /* The last sequence has no match */
+        if (ip == in_end) {
+            break;
+        }
+
+        if (in_end - ip < 2) {
+            return -1;
+        }
+
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+
+        if (offset == 0 || offset > position) {
+            return -1;
+        }
+
+        size_t length = token & RUN_MASK;
+
+        if (length == RUN_MASK && !read_length(&ip, in_end, &length)) {
+            return -1;
+        }
+        length += MIN_MATCH;
+
+        if (length > capacity - position) {
+            return -1;
+        }
+
+        if (output != NULL) {
+            uint8_t *op = output + position;
+            const uint8_t *match = op - offset;
+
+            /* Overlapping matches repeat the bytes just written */
+            if (offset >= length) {
+                memcpy(op, match, length);
+            } else {
+                for (size_t i = 0; i < length; i++) {
+                    op[i] = match[i];
+                }
+            }
+        }
+        position += length;
+    }
+
+    return (ssize_t)position;
+}
+
+ssize_t lz_decompress(const uint8_t *input, size_t size, uint8_t *output,
+                      size_t capacity)
+{
+    return decode_block(input, size, output, capacity);
+}
+
+ssize_t lz_validate(const uint8_t *input, size_t size, size_t capacity)
+{
+    return decode_block(input, size, NULL, capacity);
+}
@@ -0,0 +1,80 @@
+/**
+ * @file lz.h
+ * @brief This file contains declarations for the LZ compressor of relayed
+ * bodies.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "global.h"
+
+/**
+ * @brief Largest compressed size of the input, incompressible input grows a
+ * little
+ * @param size Size of the input
+ * @return Size of the output buffer which always fits the compressed input
+ */
+extern size_t lz_bound(size_t size);
+
+/**
+ * @brief Compress a block. The output is an LZ4 block, so clients may decode
+ * it with LZ4_decompress_safe of liblz4. Can be called from any thread.
+ * @param input Data to compress
+ * @param size Size of the data
+ * @param output Buffer for the block
+ * @param capacity Size of the buffer
+ * @return Size of the block or 0 if it does not fit into the buffer
+ */
+extern size_t lz_compress(const uint8_t *input, size_t size, uint8_t *output,
+                          size_t capacity);
+
+/**
+ * @brief Decompress an LZ4 block. Malformed blocks are detected, reads and
+ * writes never leave the buffers. Can be called from any thread.
+ * @param input Block
+ * @param size Size of the block
+ * @param output Buffer for the data
+ * @param capacity Size of the buffer
+ * @return Size of the data or -1 if the block is malformed or does not fit
+ */
+extern ssize_t lz_decompress(const uint8_t *input, size_t size,
+                             uint8_t *output, size_t capacity);
+
+/**
+ * @brief Check an LZ4 block as lz_decompress does without writing the data.
+ * Can be called from any thread.
+ * @param input Block
+ * @param size Size of the block
+ * @param capacity Largest size of the data
+ * @return Size of the data or -1 if the block is malformed or does not fit
+ */
+extern ssize_t lz_validate(const uint8_t *input, size_t size,
+                           size_t capacity);
+
+#endif /* LZ_H_ */
@@ -24,6 +24,7 @@
  * THE SOFTWARE.
  */
 
+#include <errno.h>
 #include <getopt.h>
 #include <malloc.h>
 #include <signal.h>
@@ -32,13 +33,19 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "event_loop.h"
 #include "global.h"
 #include "log.h"
 #include "server.h"
+#include "session_id.h"
+
+/* Number of messages queued for the log thread in asynchronous mode */
+static const size_t log_ring_capacity = 4096;
 
 enum log_location {
     LOG_LOCATION_STDOUT,
     LOG_LOCATION_FILE,
+    LOG_LOCATION_BINARY_FILE,
     LOG_LOCATION_SYSLOG
 };
 
@@ -62,6 +69,9 @@ void configure_logging(enum log_location loc, const char_t *file)
     case LOG_LOCATION_FILE:
         log_set_log_file(file);
         break;
+    case LOG_LOCATION_BINARY_FILE:
+        log_set_binary_file(file);
+        break;
     case LOG_LOCATION_SYSLOG:
     default:
         break;
@@ -78,19 +88,50 @@ void usage(void)
 {
     printf(
         "Usage:\n"
-        "  %s [[-a IP_ADDRESS] [-p PORT_NUM] [-m COUNT] [[-f[=FILE_NAME]] | [-s]]] | [-h] \n"
+        "  %s [[-a IP_ADDRESS] [-p PORT_NUM] [-m COUNT] [-u] [-P] [-d COUNT] [-w COUNT] [-l COUNT] [-z] [-t COUNT] [-Z[=SIZE]] [-i SECONDS] [-o SECONDS] [-L[=POLICY]] [[-f[=FILE_NAME]] | [-b[=FILE_NAME]] | [-s]]] | [-h] \n"
         "\n"
         "Options:\n"
         "  -a, --address=IP_ADDRESS       start server at IP_ADDRESS \n"
         "  -p, --port=PORT_NUM            server will listen PORT_NUM\n"
         "  -m, --max-clients=COUNT        can serve simultaneously COUNT clients\n"
+        "  -u, --io-uring                 drive client sockets with io_uring, falls\n"
+        "                                 back to epoll if the kernel lacks support\n"
+        "  -P, --pass-through             splice bodies of host data requests to\n"
+        "                                 targets without copying them\n"
+        "  -d, --id-digits=COUNT          session ids have up to COUNT decimal digits,\n"
+        "                                 default: 4, at most 5, session ids are\n"
+        "                                 16-bit, so 5 digits give ids 0-65535\n"
+        "  -w, --workers=COUNT            serve clients with COUNT threads,\n"
+        "                                 default: one per online CPU\n"
+        "  -l, --listeners=COUNT          accept clients on COUNT sockets sharing\n"
+        "                                 the port with SO_REUSEPORT, default: 1,\n"
+        "                                 the server refuses to start if the port\n"
+        "                                 is in use, since sockets of another\n"
+        "                                 server would share the clients\n"
+        "  -z, --compression              offer LZ4 compression of host data to\n"
+        "                                 clients which ask for it in the handshake\n"
+        "  -t, --max-targets=COUNT        let up to COUNT targets join a session of\n"
+        "                                 a host which asks for several, default: 8,\n"
+        "                                 at most 255\n"
+        "  -Z, --zero-copy[=SIZE]         send host bodies of at least SIZE bytes to\n"
+        "                                 targets with MSG_ZEROCOPY, default: 32768\n"
+        "  -i, --idle-timeout=SECONDS     drop clients which send nothing for SECONDS,\n"
+        "                                 clients which ask for heartbeats are probed\n"
+        "                                 halfway, default: 0, idle clients are kept\n"
+        "  -o, --orphan-timeout=SECONDS   drop targets which stay in a session without\n"
+        "                                 host for SECONDS, default: 0, no limit\n"
+        "  -L, --async-log[=POLICY]       write logs from a background thread, POLICY\n"
+        "                                 for a full queue is drop (default) or block\n"
         "  -f, --file[=FILE_NAME]         server logs will be stored in the FILE_NAME,\n"
         "                                 default: server.log\n"
+        "  -b, --binary-file[=FILE_NAME]  server logs will be stored in the FILE_NAME\n"
+        "                                 in the binary format, default: server.blog,\n"
+        "                                 use baltmonitor-logdecode to read them\n"
         "  -s, --syslog                   server logs will be stored in the system log\n"
         "  -h, --help                     give this help list\n"
         "\n"
-        "By default server put logs into stdout. Use --file[=FILE_NAME] or --syslog to\n"
-        "store logs in another location.\n"
+        "By default server put logs into stdout. Use --file[=FILE_NAME],\n"
+        "--binary-file[=FILE_NAME] or --syslog to store logs in another location.\n"
         "\n"
         "Mandatory or optional arguments to long options are also mandatory or optional\n"
         "for any corresponding short options.\n",
@@ -103,6 +144,18 @@ int32_t main(int32_t argc, char_t *argv[])
     strcpy(addr, "127.0.0.1");
     int32_t port = 65000;
     int32_t max_clients = 50;
+    enum event_loop_backend backend = EVENT_LOOP_BACKEND_EPOLL;
+    bool_t is_pass_through = false;
+    int32_t id_digits = 4;
+    int32_t num_workers = 0;
+    int32_t num_listeners = 1;
+    bool_t is_compression = false;
+    int32_t max_targets = 8;
+    size_t zerocopy_threshold = 0;
+    uint32_t idle_timeout = 0;
+    uint32_t orphan_timeout = 0;
+    bool_t is_async_log = false;
+    enum log_overflow_policy log_policy = LOG_OVERFLOW_DROP;
     char_t *log_file = malloc(11);
     strcpy(log_file, "server.log");
     enum log_location log_loc = LOG_LOCATION_STDOUT;
@@ -111,13 +164,26 @@ int32_t main(int32_t argc, char_t *argv[])
         {"address", required_argument, NULL, 'a'},
         {"port", required_argument, NULL, 'p'},
         {"max-clients", required_argument, NULL, 'm'},
+        {"io-uring", no_argument, NULL, 'u'},
+        {"pass-through", no_argument, NULL, 'P'},
+        {"id-digits", required_argument, NULL, 'd'},
+        {"workers", required_argument, NULL, 'w'},
+        {"listeners", required_argument, NULL, 'l'},
+        {"compression", no_argument, NULL, 'z'},
+        {"max-targets", required_argument, NULL, 't'},
+        {"zero-copy", optional_argument, NULL, 'Z'},
+        {"idle-timeout", required_argument, NULL, 'i'},
+        {"orphan-timeout", required_argument, NULL, 'o'},
+        {"async-log", optional_argument, NULL, 'L'},
         {"file", optional_argument, NULL, 'f'},
+        {"binary-file", optional_argument, NULL, 'b'},
         {"syslog", no_argument, NULL, 's'},
         {"help", no_argument, NULL, 'h'},
         {NULL, false, NULL, '\0'}};
 
     while (true) {
-        int c = getopt_long(argc, argv, "a:p:m:f::sh", long_options, NULL);
+        int c = getopt_long(argc, argv, "a:p:m:uPd:w:l:zt:Z::i:o:L::f::b::sh",
+                            long_options, NULL);
         if (c == -1)
             break;
 
@@ -132,6 +198,74 @@ int32_t main(int32_t argc, char_t *argv[])
         case 'm':
             max_clients = atoi(optarg);
             break;
+        case 'u':
+            backend = EVENT_LOOP_BACKEND_URING;
+            break;
+        case 'P':
+            is_pass_through = true;
+            break;
+        case 'd':
+            id_digits = atoi(optarg);
+            if (id_digits < 1 || id_digits > SESSION_ID_MAX_DIGITS) {
+                printf("Invalid number of session id digits: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            break;
+        case 'l':
+            num_listeners = atoi(optarg);
+            if (num_listeners < 1) {
+                printf("Invalid number of listeners: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            is_compression = true;
+            break;
+        case 't':
+            max_targets = atoi(optarg);
+            if (max_targets < 1 || max_targets > UINT8_MAX) {
+                printf("Invalid number of targets: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'Z':
+            zerocopy_threshold = 32768;
+            if (optarg != NULL && atoi(optarg) < 1) {
+                printf("Invalid zero-copy threshold: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            if (optarg != NULL) {
+                zerocopy_threshold = (size_t)atoi(optarg);
+            }
+            break;
+        case 'i':
+            if (atoi(optarg) < 0) {
+                printf("Invalid idle timeout: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            idle_timeout = (uint32_t)atoi(optarg);
+            break;
+        case 'o':
+            if (atoi(optarg) < 0) {
+                printf("Invalid orphan timeout: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            orphan_timeout = (uint32_t)atoi(optarg);
+            break;
+        case 'L':
+            is_async_log = true;
+            if (optarg == NULL || strcmp(optarg, "drop") == 0) {
+                log_policy = LOG_OVERFLOW_DROP;
+            } else if (strcmp(optarg, "block") == 0) {
+                log_policy = LOG_OVERFLOW_BLOCK;
+            } else {
+                printf("Invalid log overflow policy: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 'f':
             if (log_loc != LOG_LOCATION_STDOUT) {
                 printf("Invalid option: %s\n", argv[optind]);
@@ -143,6 +277,20 @@ int32_t main(int32_t argc, char_t *argv[])
             }
             log_loc = LOG_LOCATION_FILE;
             break;
+        case 'b':
+            if (log_loc != LOG_LOCATION_STDOUT) {
+                printf("Invalid option: %s\n", argv[optind]);
+                break;
+            }
+
+            log_file = realloc(log_file, 12);
+            strcpy(log_file, "server.blog");
+            if (optarg != NULL) {
+                log_file = realloc(log_file, strlen(optarg) + 1);
+                strcpy(log_file, optarg);
+            }
+            log_loc = LOG_LOCATION_BINARY_FILE;
+            break;
         case 's':
             if (log_loc != LOG_LOCATION_STDOUT) {
                 printf("Invalid option: %s\n", argv[optind]);
@@ -166,9 +314,29 @@ int32_t main(int32_t argc, char_t *argv[])
     }
 
     signal(SIGINT, on_sigint);
+    /* Handlers run in reverse order, the last messages of the server first */
+    atexit(log_stop_async);
     atexit(server_stop);
 
     configure_logging(log_loc, log_file);
 
-    server_start(addr, (uint16_t)port, max_clients);
+    if (is_async_log && log_start_async(log_ring_capacity, log_policy) == -1) {
+        log_error("Unable to start asynchronous logging: %s", strerror(errno));
+    }
+
+    struct server_options options = {.addr = addr,
+                                     .port = (uint16_t)port,
+                                     .max_clients = max_clients,
+                                     .backend = backend,
+                                     .is_pass_through = is_pass_through,
+                                     .id_digits = id_digits,
+                                     .num_workers = num_workers,
+                                     .num_listeners = num_listeners,
+                                     .is_compression = is_compression,
+                                     .max_targets = max_targets,
+                                     .zerocopy_threshold = zerocopy_threshold,
+                                     .idle_timeout = idle_timeout,
+                                     .orphan_timeout = orphan_timeout};
+
+    server_start(&options);
 }
@@ -0,0 +1,177 @@
+/**
+ * @file protocol.c
+ * @brief This file contains encoding and decoding of headers of all versions
+ * of the wire format.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "protocol.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "global.h"
+
+/* Flags of version 2 requests which clients may set */
+#define V2_REQUEST_FLAGS (PROTOCOL_V2_MARKER | PROTOCOL_V2_ROLE_TARGET)
+
+/**
+ * @brief Read a little-endian 16-bit integer
+ * @param bytes Bytes
+ * @return Value
+ */
+static uint16_t get_le16(const uint8_t *bytes)
+{
+    return (uint16_t)(bytes[0] | bytes[1] << 8);
+}
+
+/**
+ * @brief Read a little-endian 32-bit integer
+ * @param bytes Bytes
+ * @return Value
+ */
+static uint32_t get_le32(const uint8_t *bytes)
+{
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+/**
+ * @brief Write a little-endian 16-bit integer
+ * @param bytes Bytes
+ * @param value Value
+ */
+static void put_le16(uint8_t *bytes, uint16_t value)
+{
+    bytes[0] = (uint8_t)value;
+    bytes[1] = (uint8_t)(value >> 8);
+}
+
+/**
+ * @brief Write a little-endian 32-bit integer
+ * @param bytes Bytes
+ * @param value Value
+ */
+static void put_le32(uint8_t *bytes, uint32_t value)
+{
+    bytes[0] = (uint8_t)value;
+    bytes[1] = (uint8_t)(value >> 8);
+    bytes[2] = (uint8_t)(value >> 16);
+    bytes[3] = (uint8_t)(value >> 24);
+}
+
+enum protocol_version protocol_get_version(const uint8_t *bytes)
+{
+    return (bytes[1] & PROTOCOL_V2_MARKER) != 0 ? PROTOCOL_VERSION_2
+                                                : PROTOCOL_VERSION_1;
+}
+
+size_t protocol_header_size(enum protocol_version version)
+{
+    return version == PROTOCOL_VERSION_2 ? PROTOCOL_V2_HEADER_SIZE
+                                         : sizeof(struct request_header);
+}
+
+bool_t protocol_decode_request(enum protocol_version version,
+                               const uint8_t *bytes,
+                               struct request_header *header)
+{
+    if (version == PROTOCOL_VERSION_1) {
+        memcpy(header, bytes, sizeof(*header));
+        return true;
+    }
+
+    uint8_t flags = bytes[1];
+
+    if ((flags & PROTOCOL_V2_MARKER) == 0 || (flags & ~V2_REQUEST_FLAGS) != 0) {
+        return false;
+    }
+
+    *header = (struct request_header){
+        .type = bytes[0],
+        .role = (flags & PROTOCOL_V2_ROLE_TARGET) != 0 ? ROLE_TARGET
+                                                       : ROLE_HOST,
+        .session_id = get_le16(bytes + 2),
+        .body_size = get_le32(bytes + 4)};
+
+    return true;
+}
+
+size_t protocol_encode_request(enum protocol_version version,
+                               const struct request_header *header,
+                               uint8_t *bytes)
+{
+    if (version == PROTOCOL_VERSION_1) {
+        memcpy(bytes, header, sizeof(*header));
+        return sizeof(*header);
+    }
+
+    bytes[0] = (uint8_t)header->type;
+    bytes[1] = PROTOCOL_V2_MARKER;
+    if (header->role == ROLE_TARGET) {
+        bytes[1] |= PROTOCOL_V2_ROLE_TARGET;
+    }
+    put_le16(bytes + 2, header->session_id);
+    put_le32(bytes + 4, (uint32_t)header->body_size);
+
+    return PROTOCOL_V2_HEADER_SIZE;
+}
+
+bool_t protocol_decode_response(enum protocol_version version,
+                                const uint8_t *bytes,
+                                struct response_header *header)
+{
+    if (version == PROTOCOL_VERSION_1) {
+        memcpy(header, bytes, sizeof(*header));
+        return true;
+    }
+
+    if (bytes[1] != PROTOCOL_V2_MARKER) {
+        return false;
+    }
+
+    *header = (struct response_header){.type = bytes[0],
+                                       .session_id = get_le16(bytes + 2),
+                                       .body_size = get_le32(bytes + 4)};
+
+    return true;
+}
+
+size_t protocol_encode_response(enum protocol_version version,
+                                const struct response_header *header,
+                                uint8_t *bytes)
+{
+    if (version == PROTOCOL_VERSION_1) {
+        memcpy(bytes, header, sizeof(*header));
+        return sizeof(*header);
+    }
+
+    bytes[0] = (uint8_t)header->type;
+    bytes[1] = PROTOCOL_V2_MARKER;
+    put_le16(bytes + 2, header->session_id);
+    put_le32(bytes + 4, (uint32_t)header->body_size);
+
+    return PROTOCOL_V2_HEADER_SIZE;
+}
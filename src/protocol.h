@@ -0,0 +1,321 @@
+/**
+ * @file protocol.h
+ * @brief This file contains the definitions of the request exchange protocol
+ * between the remote server and its clients.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "global.h"
+
+/**
+ * @brief The types of response messages that the server send to clients.
+ * Session responses, RAISE_EVENT, SESSION_CLOSED_*, BAD_REQUEST and
+ * HEARTBEAT may overtake data responses which wait for a slow client, data
+ * responses keep their order.
+ */
+enum response_type {
+    RESPONSE_MAKE_SESSION_SUCCESS,
+    RESPONSE_MAKE_SESSION_FAIL,
+    RESPONSE_JOIN_SESSION_SUCCESS,
+    RESPONSE_JOIN_SESSION_FAIL,
+    RESPONSE_SESSION_CLOSED_BY_HOST,
+    RESPONSE_SESSION_CLOSED_BY_TARGET,
+    RESPONSE_RAISE_EVENT,
+    RESPONSE_DATA,
+    RESPONSE_BAD_REQUEST,
+    RESPONSE_DATA_COMPRESSED,
+    RESPONSE_DATA_DELTA,
+    RESPONSE_TARGET_DATA,
+    /*
+     * Sent with no body to an idle client which negotiated heartbeats, the
+     * client answers with REQUEST_HEARTBEAT
+     */
+    RESPONSE_HEARTBEAT
+};
+
+/**
+ * @brief The types of requests that clients send to the server
+ */
+enum request_type {
+    REQUEST_MAKE_SESSION,
+    REQUEST_JOIN_SESSION,
+    REQUEST_CLOSE_SESSION,
+    REQUEST_RAISE_EVENT,
+    REQUEST_DATA,
+    REQUEST_DATA_COMPRESSED,
+    /*
+     * Keeps an idle connection of a host or a target alive, the body is
+     * ignored and nothing is answered
+     */
+    REQUEST_HEARTBEAT
+};
+
+/**
+ * @brief Roles of clients in the session. The creator of the session is the
+ * host, the one who connected to the session is the target.
+ */
+enum role { ROLE_HOST, ROLE_TARGET };
+
+/**
+ * @brief Codecs of compressed bodies
+ */
+enum compression { COMPRESSION_NONE, COMPRESSION_LZ4 };
+
+/**
+ * @brief Encodings of host bodies relative to the previous body
+ */
+enum delta_mode { DELTA_NONE, DELTA_XOR_BLOCKS };
+
+/* Size of the blocks compared by DELTA_XOR_BLOCKS, the last may be shorter */
+#define DELTA_BLOCK_SIZE 64
+
+/**
+ * @brief Transmission policies of sessions. Control messages and target
+ * traffic are always sent at once, the policy applies to host bodies.
+ */
+enum transmission_mode {
+    /* Chosen by the server from the sizes of host bodies */
+    TRANSMISSION_AUTO,
+    /* Each host body is sent to the network at once */
+    TRANSMISSION_LATENCY,
+    /* Host bodies are coalesced into full segments per read of the host */
+    TRANSMISSION_THROUGHPUT
+};
+
+/**
+ * @brief Optional body of MAKE_SESSION and JOIN_SESSION requests. If a client
+ * sends it, the success response carries it back with the options chosen by
+ * the server. Clients which send no body get no body. Clients may send only
+ * the leading fields they know, missing fields are zero and the response has
+ * the same size as the request.
+ */
+struct session_options {
+    /*
+     * Codec the client can use. A host which gets COMPRESSION_LZ4 back may
+     * send DATA_COMPRESSED requests, a target which gets it may receive
+     * DATA_COMPRESSED responses. Either side may still use plain DATA.
+     */
+    uint8_t compression;
+    /*
+     * A target which gets DELTA_XOR_BLOCKS back may receive DATA_DELTA
+     * responses, full bodies still arrive as DATA or DATA_COMPRESSED. Hosts
+     * always get DELTA_NONE.
+     */
+    uint8_t delta;
+    /*
+     * Number of targets a host lets join its session, the server grants at
+     * most its own limit and at least one. A host which sends this field
+     * gets DATA of its targets as TARGET_DATA and each CLOSED_BY_TARGET with
+     * a struct target_header body. Targets get the limit of the session.
+     */
+    uint8_t max_targets;
+    /*
+     * Transmission policy of the session, enum transmission_mode. Hosts ask
+     * for it, unknown policies are answered with TRANSMISSION_AUTO. Targets
+     * get the policy of the session.
+     */
+    uint8_t transmission;
+    /* Id of a target within its session, hosts get 0 */
+    uint16_t target_id;
+    /*
+     * Set by clients which answer RESPONSE_HEARTBEAT, answered with 1 if the
+     * server drops idle connections and probes such clients before that.
+     * Other clients must send requests often enough on their own.
+     */
+    uint8_t heartbeat;
+    uint8_t reserved;
+};
+
+/**
+ * @brief Start of the body of DATA_COMPRESSED requests and responses, an LZ4
+ * block of the original body follows it
+ */
+struct compressed_header {
+    uint32_t original_size;
+};
+
+/**
+ * @brief Start of the body of DATA_DELTA responses. The new body is made of
+ * DELTA_BLOCK_SIZE blocks of the previous host body received by the target,
+ * in any form, taken as zeros past its end. A bitmap of the changed blocks
+ * follows the header, one bit per block from the least significant bit of
+ * the first byte. Then each changed block follows in order, XORed with the
+ * same block of the previous body.
+ */
+struct delta_header {
+    uint32_t original_size;
+};
+
+/**
+ * @brief Start of the body of TARGET_DATA and CLOSED_BY_TARGET responses to
+ * hosts which negotiated max_targets, the body of the target follows it
+ */
+struct target_header {
+    uint16_t target_id;
+};
+
+/**
+ * @brief Structure of the response.
+ * The header contains service information and the body contains response data.
+ */
+struct response {
+    struct response_header {
+        enum response_type type : 8;
+        uint16_t session_id;
+        /*
+         * Since the size of the 'body' field can be different this field is
+         * used to indicate its size
+         */
+        size_t body_size;
+    } header;
+    /*
+     * This field is never used by the server.
+     * contains any information that will be used by clients.
+     * Used with response types RESPONSE_DATA, RESPONSE_DATA_COMPRESSED,
+     * RESPONSE_DATA_DELTA, RESPONSE_TARGET_DATA and RESPONSE_RAISE_EVENT,
+     * success responses of session requests may carry struct session_options.
+     */
+    uint8_t body[];
+};
+
+/**
+ * @brief Structure of the request.
+ * The header contains service information and the body contains request data.
+ */
+struct request {
+    struct request_header {
+        enum request_type type : 8;
+        enum role role : 8;
+        uint16_t session_id;
+        /*
+         * Since the size of the 'body' field can be different this field is
+         * used to indicate its size
+         */
+        size_t body_size;
+    } header;
+    /*
+     * This field is never used by the server.
+     * contains any information that will be used by clients.
+     * Used with request types REQUEST_DATA, REQUEST_DATA_COMPRESSED and
+     * REQUEST_RAISE_EVENT, session requests may carry struct session_options.
+     */
+    uint8_t body[];
+};
+
+/**
+ * @brief Versions of the wire format of headers. A client chooses the version
+ * with its first request and uses it for the whole connection, the server
+ * answers in the same version.
+ *
+ * Version 1 headers are struct request_header and struct response_header as
+ * laid out by the compiler of the server, 16 bytes on x86-64.
+ *
+ * Version 2 headers are PROTOCOL_V2_HEADER_SIZE bytes, integers are
+ * little-endian:
+ *   byte 0     type, enum request_type or enum response_type
+ *   byte 1     flags, PROTOCOL_V2_MARKER is always set
+ *   bytes 2-3  session id, 16-bit as in version 1
+ *   bytes 4-7  size of the body
+ */
+enum protocol_version { PROTOCOL_VERSION_1, PROTOCOL_VERSION_2 };
+
+/* Size of version 2 headers */
+#define PROTOCOL_V2_HEADER_SIZE 8
+
+/* Size of the largest header of all versions */
+#define PROTOCOL_MAX_HEADER_SIZE sizeof(struct request_header)
+
+/* Number of leading bytes which tell the version of a header */
+#define PROTOCOL_VERSION_PREFIX_SIZE 2
+
+/* Flag of version 2 headers, the role byte of version 1 never has the bit */
+#define PROTOCOL_V2_MARKER 0x20
+
+/* Flag of version 2 requests sent by targets */
+#define PROTOCOL_V2_ROLE_TARGET 0x01
+
+/**
+ * @brief Get the version of a header
+ * @param bytes At least PROTOCOL_VERSION_PREFIX_SIZE first bytes of the header
+ * @return Version
+ */
+extern enum protocol_version protocol_get_version(const uint8_t *bytes);
+
+/**
+ * @brief Get the size of headers of a version
+ * @param version Version
+ * @return Size of request and response headers in bytes
+ */
+extern size_t protocol_header_size(enum protocol_version version);
+
+/**
+ * @brief Decode a request header
+ * @param version Version of the header
+ * @param bytes Header, protocol_header_size bytes
+ * @param header Decoded header
+ * @return true on success, false if the header is malformed
+ */
+extern bool_t protocol_decode_request(enum protocol_version version,
+                                      const uint8_t *bytes,
+                                      struct request_header *header);
+
+/**
+ * @brief Encode a request header
+ * @param version Version of the header
+ * @param header Header
+ * @param bytes Encoded header, PROTOCOL_MAX_HEADER_SIZE bytes fit
+ * @return Size of the encoded header
+ */
+extern size_t protocol_encode_request(enum protocol_version version,
+                                      const struct request_header *header,
+                                      uint8_t *bytes);
+
+/**
+ * @brief Decode a response header
+ * @param version Version of the header
+ * @param bytes Header, protocol_header_size bytes
+ * @param header Decoded header
+ * @return true on success, false if the header is malformed
+ */
+extern bool_t protocol_decode_response(enum protocol_version version,
+                                       const uint8_t *bytes,
+                                       struct response_header *header);
+
+/**
+ * @brief Encode a response header
+ * @param version Version of the header
+ * @param header Header, the size of the body must fit 32 bits for version 2
+ * @param bytes Encoded header, PROTOCOL_MAX_HEADER_SIZE bytes fit
+ * @return Size of the encoded header
+ */
+extern size_t protocol_encode_response(enum protocol_version version,
+                                       const struct response_header *header,
+                                       uint8_t *bytes);
+
+#endif /* PROTOCOL_H_ */
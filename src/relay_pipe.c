@@ -0,0 +1,183 @@
+/**
+ * @file relay_pipe.c
+ * @brief This file contains definitions of functions for the pipes used to
+ * move request bodies between sockets with splice(2).
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "relay_pipe.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "global.h"
+
+struct relay_pipe *relay_pipe_new(size_t capacity)
+{
+    struct relay_pipe *pipe = calloc(1, sizeof(struct relay_pipe));
+
+    if (pipe == NULL) {
+        return NULL;
+    }
+
+    if (pipe2(pipe->fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        free(pipe);
+        return NULL;
+    }
+
+    /* The kernel rounds the size up to a power of two number of pages */
+    int32_t size = fcntl(pipe->fds[1], F_SETPIPE_SZ, (int32_t)capacity);
+    if (size == -1) {
+        size = fcntl(pipe->fds[1], F_GETPIPE_SZ);
+    }
+
+    if (size == -1) {
+        close(pipe->fds[0]);
+        close(pipe->fds[1]);
+        free(pipe);
+        return NULL;
+    }
+
+    pipe->capacity = (size_t)size;
+    atomic_init(&pipe->queued, 0);
+    atomic_init(&pipe->refs, 1);
+    atomic_init(&pipe->is_closed, false);
+    pthread_mutex_init(&pipe->lock, NULL);
+
+    return pipe;
+}
+
+struct relay_pipe *relay_pipe_ref(struct relay_pipe *pipe)
+{
+    atomic_fetch_add(&pipe->refs, 1);
+
+    return pipe;
+}
+
+void relay_pipe_unref(struct relay_pipe *pipe)
+{
+    if (atomic_fetch_sub(&pipe->refs, 1) != 1) {
+        return;
+    }
+
+    close(pipe->fds[0]);
+    close(pipe->fds[1]);
+    pthread_mutex_destroy(&pipe->lock);
+    free(pipe);
+}
+
+ssize_t relay_pipe_read(struct relay_pipe *pipe, void *buffer, size_t size)
+{
+    ssize_t result;
+
+    do {
+        result = read(pipe->fds[0], buffer, size);
+    } while (result == -1 && errno == EINTR);
+
+    if (result > 0) {
+        atomic_fetch_sub(&pipe->queued, (size_t)result);
+    }
+
+    return result;
+}
+
+ssize_t relay_pipe_fill(struct relay_pipe *pipe, int32_t fd, size_t size)
+{
+    ssize_t result;
+
+    do {
+        result = splice(fd, NULL, pipe->fds[1], NULL, size,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (result == -1 && errno == EINTR);
+
+    if (result > 0) {
+        atomic_fetch_add(&pipe->queued, (size_t)result);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Re-arm the waiting writer
+ * @param pipe Pipe
+ */
+static void wake_writer(struct relay_pipe *pipe)
+{
+    pthread_mutex_lock(&pipe->lock);
+
+    if (pipe->waiter != NULL) {
+        event_loop_rearm(pipe->waiter);
+        pipe->waiter = NULL;
+    }
+
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+ssize_t relay_pipe_drain(struct relay_pipe *pipe, int32_t fd, size_t size)
+{
+    ssize_t result;
+
+    do {
+        result = splice(pipe->fds[0], NULL, fd, NULL, size,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (result == -1 && errno == EINTR);
+
+    if (result > 0) {
+        atomic_fetch_sub(&pipe->queued, (size_t)result);
+        wake_writer(pipe);
+    }
+
+    return result;
+}
+
+void relay_pipe_wait(struct relay_pipe *pipe, struct event_loop_source *writer)
+{
+    pthread_mutex_lock(&pipe->lock);
+    pipe->waiter = writer;
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+void relay_pipe_cancel_wait(struct relay_pipe *pipe,
+                            struct event_loop_source *writer)
+{
+    pthread_mutex_lock(&pipe->lock);
+
+    if (pipe->waiter == writer) {
+        pipe->waiter = NULL;
+    }
+
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+void relay_pipe_close(struct relay_pipe *pipe)
+{
+    atomic_store(&pipe->is_closed, true);
+    wake_writer(pipe);
+}
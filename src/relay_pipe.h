@@ -0,0 +1,135 @@
+/**
+ * @file relay_pipe.h
+ * @brief This file contains declarations for the pipes used to move request
+ * bodies between sockets without copying them to user space.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef RELAY_PIPE_H_
+#define RELAY_PIPE_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "event_loop.h"
+#include "global.h"
+
+/**
+ * @brief Reference counted pipe. One writer fills it from a socket and the
+ * outbound queue of the receiver drains it to another socket.
+ */
+struct relay_pipe {
+    /* Read and write ends */
+    int32_t fds[2];
+    /* Capacity of the pipe buffer */
+    size_t capacity;
+    /* Number of bytes in the pipe buffer */
+    atomic_size_t queued;
+    atomic_int refs;
+    /* Set when the receiver is gone, queued data will never be drained */
+    atomic_bool is_closed;
+    /* Protects the waiting writer */
+    pthread_mutex_t lock;
+    /* Writer waiting for free space, re-armed when the pipe is drained */
+    struct event_loop_source *waiter;
+};
+
+/**
+ * @brief Create a pipe able to hold at least the specified number of bytes
+ * @param capacity Requested capacity
+ * @return New pipe with one reference or NULL for errors
+ */
+extern struct relay_pipe *relay_pipe_new(size_t capacity);
+
+/**
+ * @brief Take a reference to the pipe
+ * @param pipe Pipe
+ * @return Same pipe
+ */
+extern struct relay_pipe *relay_pipe_ref(struct relay_pipe *pipe);
+
+/**
+ * @brief Drop a reference, the pipe is closed with the last one
+ * @param pipe Pipe
+ */
+extern void relay_pipe_unref(struct relay_pipe *pipe);
+
+/**
+ * @brief Read data from the pipe to user space
+ * @param pipe Pipe
+ * @param buffer Destination buffer
+ * @param size Number of bytes
+ * @return Same as read(2)
+ */
+extern ssize_t relay_pipe_read(struct relay_pipe *pipe, void *buffer,
+                               size_t size);
+
+/**
+ * @brief Move data from a socket to the pipe without blocking
+ * @param pipe Pipe
+ * @param fd Socket descriptor
+ * @param size Maximum number of bytes
+ * @return Same as splice(2)
+ */
+extern ssize_t relay_pipe_fill(struct relay_pipe *pipe, int32_t fd,
+                               size_t size);
+
+/**
+ * @brief Move data from the pipe to a socket without blocking. The waiting
+ * writer is re-armed.
+ * @param pipe Pipe
+ * @param fd Socket descriptor
+ * @param size Maximum number of bytes
+ * @return Same as splice(2)
+ */
+extern ssize_t relay_pipe_drain(struct relay_pipe *pipe, int32_t fd,
+                                size_t size);
+
+/**
+ * @brief Register the writer to be re-armed when free space appears or the
+ * pipe is closed. The caller must try to write again after this call.
+ * @param pipe Pipe
+ * @param writer Source of the writer
+ */
+extern void relay_pipe_wait(struct relay_pipe *pipe,
+                            struct event_loop_source *writer);
+
+/**
+ * @brief Unregister the waiting writer, must be called before the writer is
+ * destroyed
+ * @param pipe Pipe
+ * @param writer Source of the writer
+ */
+extern void relay_pipe_cancel_wait(struct relay_pipe *pipe,
+                                   struct event_loop_source *writer);
+
+/**
+ * @brief Mark the pipe as closed by the receiver and re-arm the waiting writer
+ * @param pipe Pipe
+ */
+extern void relay_pipe_close(struct relay_pipe *pipe);
+
+#endif /* RELAY_PIPE_H_ */
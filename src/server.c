@@ -27,214 +27,408 @@
  */
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "buffer_pool.h"
+#include "connection.h"
+#include "delta.h"
+#include "event_loop.h"
 #include "global.h"
+#include "latency.h"
 #include "log.h"
+#include "lz.h"
+#include "protocol.h"
+#include "relay_pipe.h"
+#include "server.h"
 #include "session.h"
+#include "session_id.h"
+#include "shared_buffer.h"
+#include "stats.h"
 
-/**
- * @brief The types of response messages that the server send to clients
+/* The limit of the size of a request from the host */
+static const size_t host_request_limit = 150000;
+
+/* The limit of the size of a request from the target */
+static const size_t target_request_limit = 1000;
+
+/* The limit of the size of the first request of a client */
+static const size_t handshake_request_limit = 1000;
+
+/*
+ * Average host body sizes at which TRANSMISSION_AUTO starts and stops
+ * coalescing host bodies. Smaller bodies are operator input and screen
+ * updates, which must not wait.
  */
-enum response_type {
-    RESPONSE_MAKE_SESSION_SUCCESS,
-    RESPONSE_MAKE_SESSION_FAIL,
-    RESPONSE_JOIN_SESSION_SUCCESS,
-    RESPONSE_JOIN_SESSION_FAIL,
-    RESPONSE_SESSION_CLOSED_BY_HOST,
-    RESPONSE_SESSION_CLOSED_BY_TARGET,
-    RESPONSE_RAISE_EVENT,
-    RESPONSE_DATA,
-    RESPONSE_BAD_REQUEST
-};
+static const size_t auto_bulk_body_size = 2048;
+static const size_t auto_interactive_body_size = 512;
 
-/**
- * @brief The types of requests that clients send to the server
+/* Smaller host bodies are not compressed, they would barely shrink */
+static const size_t compression_min_size = 64;
+
+/* Targets of a hosted session check for the host this often per timeout */
+static const uint64_t orphan_checks_per_timeout = 4;
+
+/*
+ * The smallest input buffer borrowed for reading, larger buffers are borrowed
+ * only while a larger request is being received
  */
-enum request_type {
-    REQUEST_MAKE_SESSION,
-    REQUEST_JOIN_SESSION,
-    REQUEST_CLOSE_SESSION,
-    REQUEST_RAISE_EVENT,
-    REQUEST_DATA
-};
+static const size_t input_buffer_min_size = 4096;
 
-/**
- * @brief Roles of clients in the session. The creator of the session is the
- * host, the one who connected to the session is the target.
+/*
+ * Capacity of the pipes used in pass-through mode. The pipe must hold a whole
+ * host body and the kernel may put a small socket fragment into each of its
+ * page slots, so it is much larger than the body.
  */
-enum role { ROLE_HOST, ROLE_TARGET };
+static const size_t pass_through_pipe_size = 1048576;
+
+/* Listening sockets of the server, each is served by its own acceptor */
+static int32_t *listener_fds;
+static int32_t num_of_listeners;
+
+/* Set once the server stops, acceptors quit instead of reporting errors */
+static atomic_bool is_stopping;
+
+/* Maximum number of simultaneously connected clients */
+static int32_t max_connections;
+
+/* Number of connected clients */
+static atomic_int num_of_connections;
+
+/* Set if bodies of host DATA requests are spliced to targets */
+static bool_t is_pass_through;
+
+/* Set if clients may negotiate compression of host bodies */
+static bool_t is_compression;
+
+/* Largest number of targets granted to a session */
+static int32_t max_targets;
+
+/* Milliseconds without input after which a client is dropped, 0 for never */
+static uint64_t idle_timeout;
+
+/* Milliseconds targets may stay in a session without host, 0 for no limit */
+static uint64_t orphan_timeout;
 
 /**
- * @brief Structure of the response.
- * The header contains service information and the body contains response data.
+ * @brief Request received in any version of the wire format
  */
-struct response {
-    struct response_header {
-        enum response_type type : 8;
-        uint16_t session_id;
-        /*
-         * Since the size of the 'body' field can be different this field is
-         * used to indicate its size
-         */
-        size_t body_size;
-    } header;
-    /*
-     * This field is never used by the server.
-     * contains any information that will be used by clients.
-     * Used with response types RESPONSE_DATA and RESPONSE_RAISE_EVENT.
-     */
-    uint8_t body[];
+struct decoded_request {
+    struct request_header header;
+    /* Body, follows the header in the input buffer */
+    const uint8_t *body;
+    /* Size of the header on the wire */
+    size_t header_size;
 };
 
 /**
- * @brief Structure of the request.
- * The header contains service information and the body contains request data.
+ * @brief Body of a host DATA request in the form sent to the target
  */
-struct request {
-    struct request_header {
-        enum request_type type : 8;
-        enum role role : 8;
-        uint16_t session_id;
-        /*
-         * Since the size of the 'body' field can be different this field is
-         * used to indicate its size
-         */
-        size_t body_size;
-    } header;
-    /*
-     * This field is never used by the server.
-     * contains any information that will be used by clients.
-     * Used with request types REQUEST_DATA and REQUEST_RAISE_EVENT.
-     */
-    uint8_t body[];
+struct relay_body {
+    enum response_type type;
+    const uint8_t *data;
+    size_t size;
+    /* Reference to the buffer which holds the body, queued sends share it */
+    struct shared_buffer *buffer;
 };
 
-/* The size of the socket buffer used to store the request from the host */
-static const size_t host_socket_buffer_size = 150000;
+/**
+ * @brief Send a response without body
+ * @param conn Receiver of the response
+ * @param type The type of response
+ * @param session_id Unique identification number of the session with which the
+ * response is associated
+ */
+static void send_empty_response(struct connection *conn,
+                                enum response_type type, uint16_t session_id)
+{
+    struct response_header header = {.type = type,
+                                     .session_id = session_id,
+                                     .body_size = 0};
+    uint8_t wire[PROTOCOL_MAX_HEADER_SIZE];
+
+    connection_send(conn, CONNECTION_LANE_CONTROL, wire,
+                    protocol_encode_response(conn->version, &header, wire));
 
-/* The size of the socket buffer used to store the request from the target */
-static const size_t target_socket_buffer_size = 1000;
+    /* Control messages go out at once, with the bodies queued before them */
+    connection_push(conn);
+}
 
-/* Server's socket file descriptor */
-static int32_t server_sockfd;
+/**
+ * @brief Send a successful response to a session request. Clients which sent
+ * options get as many leading bytes of the negotiated options back, others
+ * get no body.
+ * @param conn Receiver of the response
+ * @param type The type of response
+ * @param session_id Id of the session
+ * @param options Negotiated options
+ * @param options_size Size of the options sent by the client
+ */
+static void send_session_response(struct connection *conn,
+                                  enum response_type type, uint16_t session_id,
+                                  const struct session_options *options,
+                                  size_t options_size)
+{
+    if (options_size == 0) {
+        send_empty_response(conn, type, session_id);
+        return;
+    }
 
-/* Active working threads, one per client */
-/* TODO: Use linked list */
-static pthread_t threads[60];
+    struct response_header header = {.type = type,
+                                     .session_id = session_id,
+                                     .body_size = options_size};
+    uint8_t wire[PROTOCOL_MAX_HEADER_SIZE];
+    const struct iovec iov[] = {
+        {.iov_base = wire,
+         .iov_len = protocol_encode_response(conn->version, &header, wire)},
+        {.iov_base = (void *)options, .iov_len = options_size}};
+
+    connection_sendv(conn, CONNECTION_LANE_CONTROL, iov, 2, NULL);
+    connection_push(conn);
+}
 
-/* Number of active working threads */
-static int32_t num_of_threads = 0;
+/**
+ * @brief Close the connection once all queued output is written. Input is
+ * ignored from now on.
+ * @param conn Connection to close
+ */
+static void close_connection(struct connection *conn)
+{
+    conn->state = CONNECTION_STATE_CLOSING;
+    shutdown(conn->source.fd, SHUT_RD);
 
-/* Active opened sockets, one per client */
-/* TODO: Use linked list or get sockets from sessions */
-static int32_t opened_sockets[60];
+    /* Output which the client does not read is not kept forever */
+    if (idle_timeout > 0) {
+        event_loop_set_timer(&conn->source, idle_timeout);
+    }
+}
 
-/* Number of active opened sockets */
-static int32_t num_of_opened_sockets = 0;
+/**
+ * @brief Free the connection and release its client slot
+ * @param conn Connection to destroy
+ */
+static void destroy_connection(struct connection *conn)
+{
+    log_debug("Close connection %i", conn->source.fd);
+    connection_free(conn);
+    atomic_fetch_sub(&num_of_connections, 1);
+    stats_add(STATS_CONNECTIONS_ACTIVE, -1);
+}
 
 /**
- * @brief Join all active socket threads
+ * @brief Сheck the activity of the session and close it if no one is
+ * connected to it, so nobody can join it anymore. The caller must hold the
+ * session lock.
+ * @param session Information about the session which need to check
+ * @return true if the session is closed and must be removed, false if not
  */
-void join_threads(void)
+static bool_t close_empty_session(struct session_info *session)
 {
-    for (int32_t i = 0; i < num_of_threads; i++) {
-        pthread_join(threads[i], NULL);
+    if (session->host_connection == NULL && session->targets == NULL) {
+        session->is_closed = true;
     }
 
-    num_of_threads = 0;
+    return session->is_closed;
 }
 
 /**
- * @brief Shutdown and close all opened sockets
+ * @brief Remove the closed session from the table. The caller must not hold
+ * the session lock.
+ * @param session Closed session
  */
-void close_sockets(void)
+static void clear_closed_session(struct session_info *session)
 {
-    for (int32_t i = 0; i < num_of_opened_sockets; i++) {
-        shutdown(opened_sockets[i], SHUT_RDWR);
-        close(opened_sockets[i]);
+    uint16_t id = session->id;
+
+    /* Nobody relays anymore, so the counters are final */
+    if (session->compressed_bytes > 0) {
+        log_info("Session with id %i relayed %" PRIu64 " bytes compressed to "
+                 "%" PRIu64 " (ratio %.2f), codec CPU time %.3f ms",
+                 id, session->raw_bytes, session->compressed_bytes,
+                 (double)session->raw_bytes / (double)session->compressed_bytes,
+                 (double)session->codec_time / 1e6);
     }
 
-    num_of_opened_sockets = 0;
+    if (session->delta_bytes > 0) {
+        log_info("Session with id %i sent deltas of %" PRIu64 " bytes instead "
+                 "of %" PRIu64 " bytes",
+                 id, session->delta_bytes, session->delta_raw_bytes);
+    }
+
+    session_remove(session);
+
+    /* Released once the id is not in the table, so it can be added again */
+    session_id_release(id);
+
+    log_info("Session with id %i closed", id);
 }
 
 /**
- * @brief Initiate a session to be closed by the host. If the target is still
- * connected, then send a notification to it.
- * @param session The specified session to be closed
+ * @brief Initiate a session to be closed by the host. Targets which are still
+ * connected get a notification.
+ * @param conn Connection of the host
  */
-static void host_leave_session(struct session_info *session)
+static void host_leave_session(struct connection *conn)
 {
-    session->is_host_connected = false;
+    struct session_info *session = conn->session;
+
+    pthread_mutex_lock(&session->lock);
+
+    session->host_connection = NULL;
+    session->host_left_time = latency_now();
+    connection_resume_producer(conn);
+
+    for (struct connection *target = session->targets; target != NULL;
+         target = target->next_target) {
+        connection_resume_producer(target);
+        send_empty_response(target, RESPONSE_SESSION_CLOSED_BY_HOST,
+                            session->id);
+    }
 
-    if (session->is_target_connected) {
-        struct response resp;
-        resp.header.body_size = 0;
-        resp.header.type = RESPONSE_SESSION_CLOSED_BY_HOST;
-        resp.header.session_id = session->id;
-        send(session->target_sockfd, &resp, sizeof(resp), 0);
+    bool_t is_closed = close_empty_session(session);
+    pthread_mutex_unlock(&session->lock);
+
+    if (is_closed) {
+        clear_closed_session(session);
+    }
+
+    conn->session = NULL;
+    close_connection(conn);
+}
+
+/**
+ * @brief Notify the host that a target left the session. Hosts which
+ * negotiated max_targets get the id of the target.
+ * @param session Session
+ * @param target Connection of the target
+ */
+static void send_target_closed(struct session_info *session,
+                               const struct connection *target)
+{
+    if (!session->is_fan_out) {
+        send_empty_response(session->host_connection,
+                            RESPONSE_SESSION_CLOSED_BY_TARGET, session->id);
+        return;
     }
+
+    struct connection *host = session->host_connection;
+    struct response_header header = {.type = RESPONSE_SESSION_CLOSED_BY_TARGET,
+                                     .session_id = session->id,
+                                     .body_size = sizeof(struct target_header)};
+    struct target_header tag = {.target_id = target->target_id};
+    uint8_t wire[PROTOCOL_MAX_HEADER_SIZE];
+    const struct iovec iov[] = {
+        {.iov_base = wire,
+         .iov_len = protocol_encode_response(host->version, &header, wire)},
+        {.iov_base = &tag, .iov_len = sizeof(tag)}};
+
+    connection_sendv(host, CONNECTION_LANE_CONTROL, iov, 2, NULL);
+    connection_push(host);
 }
 
 /**
- * @brief Initiate a session to be closed by the target. If the host is still
- * connected, then send a notification to it.
- * @param session The specified session to be closed
+ * @brief Leave the session as a target. The session is closed once the host
+ * and all targets left. If the host is still connected, then send a
+ * notification to it.
+ * @param conn Connection of the target
  */
-static void target_leave_session(struct session_info *session)
+static void target_leave_session(struct connection *conn)
 {
-    session->is_target_connected = false;
+    struct session_info *session = conn->session;
+
+    pthread_mutex_lock(&session->lock);
+
+    struct connection **link = &session->targets;
+
+    while (*link != conn) {
+        link = &(*link)->next_target;
+    }
+
+    *link = conn->next_target;
+    conn->next_target = NULL;
+    session->num_targets--;
+    connection_resume_producer(conn);
+
+    if (session->host_connection != NULL) {
+        connection_resume_producer(session->host_connection);
+        send_target_closed(session, conn);
+    }
 
-    if (session->is_host_connected) {
-        struct response resp;
-        resp.header.body_size = 0;
-        resp.header.type = RESPONSE_SESSION_CLOSED_BY_TARGET;
-        resp.header.session_id = session->id;
+    bool_t is_closed = close_empty_session(session);
+    pthread_mutex_unlock(&session->lock);
 
-        send(session->host_sockfd, &resp, sizeof(resp), 0);
+    if (is_closed) {
+        clear_closed_session(session);
     }
+
+    conn->session = NULL;
+    close_connection(conn);
 }
 
 /**
  * @brief After receiving a bad request, send a response with information about
  * it.
- * @param sockfd Socket file descriptor of the bad request sender
+ * @param conn Connection of the bad request sender
  * @param session_id The session within which the bad request was received
  */
-static void send_bad_request(int32_t sockfd, uint16_t session_id)
+static void send_bad_request(struct connection *conn, uint16_t session_id)
+{
+    stats_add(STATS_BAD_REQUESTS, 1);
+    send_empty_response(conn, RESPONSE_BAD_REQUEST, session_id);
+}
+
+/**
+ * @brief Get the size of request headers of the client. The version of the
+ * wire format is chosen by the first request, so it is detected from the
+ * request which is received during the handshake.
+ * @param conn Connection of the client
+ * @return Size of the header or 0 if too few bytes are received to tell
+ */
+static size_t request_header_size(struct connection *conn)
 {
-    struct response resp;
-    resp.header.body_size = 0;
-    resp.header.type = RESPONSE_BAD_REQUEST;
-    resp.header.session_id = session_id;
+    if (conn->state == CONNECTION_STATE_HANDSHAKE) {
+        if (conn->in_size - conn->in_offset < PROTOCOL_VERSION_PREFIX_SIZE) {
+            return 0;
+        }
+
+        conn->version =
+            protocol_get_version(conn->in_buffer + conn->in_offset);
+    }
 
-    send(sockfd, &resp, sizeof(resp), 0);
+    return protocol_header_size(conn->version);
 }
 
 /**
- * @brief Check the result of reading data from a socket FD
- * @param req_size Size of data read.
- * @param buffer_size Client buffer size
- * @return true if socket error, false if not
+ * @brief Decode the request whose header is received to the input buffer
+ * @param conn Connection of the client
+ * @param offset Offset of the header in the input buffer
+ * @param req Decoded request, the body is not checked to be received
+ * @return true for success, false if the header is malformed
  */
-static bool_t is_socket_error(ssize_t req_size, size_t buffer_size)
+static bool_t decode_request(const struct connection *conn, size_t offset,
+                             struct decoded_request *req)
 {
-    /*
-     * If the size is less than or equal to 0, then this is a socket error,
-     * usually this happens when the socket is closed. The size of the buffer
-     * was chosen in such a way that the largest theoretically possible request
-     * would fit into it, therefore, too large requests are also incorrect.
-     * Well, if the request is less than the length of the header, then there is
-     * some problem with the socket.
-     */
-    return (req_size <= 0) || (req_size == (ssize_t)buffer_size) ||
-           (req_size < (ssize_t)sizeof(struct request));
+    const uint8_t *bytes = conn->in_buffer + offset;
+
+    req->header_size = protocol_header_size(conn->version);
+    req->body = bytes + req->header_size;
+
+    return protocol_decode_request(conn->version, bytes, &req->header);
 }
 
 /**
@@ -242,11 +436,11 @@ static bool_t is_socket_error(ssize_t req_size, size_t buffer_size)
  * @param role Role of client
  * @param session_id The session within which the request was received
  * @param req The request which need to verify
- * @param req_size Size of data read.
+ * @param req_size Size of the request frame
  * @return true if request is bad, false if not
  */
 static bool_t is_bad_request(enum role role, uint16_t session_id,
-                             const struct request *req, ssize_t req_size)
+                             const struct decoded_request *req, size_t req_size)
 {
     if (req->header.role != role) {
         return true;
@@ -256,10 +450,9 @@ static bool_t is_bad_request(enum role role, uint16_t session_id,
         return true;
     }
 
-    size_t expected_size =
-        req->header.body_size + sizeof(struct request_header);
+    size_t expected_size = req->header_size + req->header.body_size;
 
-    if (req_size != (ssize_t)expected_size) {
+    if (req_size != expected_size) {
         return true;
     }
 
@@ -267,355 +460,2036 @@ static bool_t is_bad_request(enum role role, uint16_t session_id,
 }
 
 /**
- * @brief Host request processing routine
- * @param session Information about the session in which the processing takes
- * place
+ * @brief Stop reading from the connection while the outbound queue of its
+ * peer is too deep, so a slow client does not make the server buffer without
+ * bound. The caller must hold the session lock.
+ * @param conn Connection which sent data to the peer
+ * @param peer Other side of the session
  */
-static void host_routine(struct session_info *session)
+static void throttle_producer(struct connection *conn, struct connection *peer)
 {
-    session->is_host_connected = true;
-    struct request *req = malloc(host_socket_buffer_size);
-    struct response *resp = malloc(host_socket_buffer_size);
+    bool_t was_paused = atomic_load(&conn->is_read_paused);
 
-    while (session->is_host_connected) {
-        ssize_t req_size =
-            recv(session->host_sockfd, req, host_socket_buffer_size, 0);
+    if (connection_throttle(peer, conn) && !was_paused) {
+        bool_t is_peer_host = peer->state == CONNECTION_STATE_HOST;
 
-        if (is_socket_error(req_size, host_socket_buffer_size)) {
-            host_leave_session(session);
-            continue;
-        }
+        log_warning("Session with id %i: %zu bytes queued to the %s, reading "
+                    "from the %s is paused",
+                    conn->session->id, connection_get_queued(peer),
+                    is_peer_host ? "host" : "target",
+                    is_peer_host ? "target" : "host");
+    }
+}
 
-        if (is_bad_request(ROLE_HOST, session->id, req, req_size)) {
-            send_bad_request(session->host_sockfd, session->id);
-            continue;
-        }
+/**
+ * @brief Forward the body of a host request to all targets of the session. If
+ * no target is connected, the request is dropped.
+ * @param conn Connection of the host
+ * @param type The type of response sent to the targets
+ * @param path Relay path whose latency is measured
+ * @param req The received request
+ */
+static void relay_request(struct connection *conn, enum response_type type,
+                          enum latency_path path,
+                          const struct decoded_request *req)
+{
+    struct session_info *session = conn->session;
+    struct response_header header = {.type = type,
+                                     .session_id = session->id,
+                                     .body_size = req->header.body_size};
+    struct latency_mark mark = {.path = path, .start = conn->recv_time};
+
+    pthread_mutex_lock(&session->lock);
+
+    /* The slowest target pauses the host */
+    for (struct connection *target = session->targets; target != NULL;
+         target = target->next_target) {
+        uint8_t wire[PROTOCOL_MAX_HEADER_SIZE];
+        size_t wire_size =
+            protocol_encode_response(target->version, &header, wire);
+
+        /* The body is sent from the input buffer, targets may reference it */
+        connection_send_shared(target, CONNECTION_LANE_CONTROL, wire,
+                               wire_size, req->body, req->header.body_size,
+                               conn->in_shared, &mark);
+        connection_push(target);
+        throttle_producer(conn, target);
+    }
 
-        switch (req->header.type) {
-        case REQUEST_CLOSE_SESSION:
-            host_leave_session(session);
-            break;
-        case REQUEST_DATA:
-            resp->header.type = RESPONSE_DATA;
-            resp->header.session_id = session->id;
-            resp->header.body_size = req->header.body_size;
+    pthread_mutex_unlock(&session->lock);
+}
 
-            memcpy(resp->body, req->body, req->header.body_size);
-            send(session->target_sockfd, &resp, sizeof(resp), 0);
-            break;
-        case REQUEST_RAISE_EVENT:
-            resp->header.type = RESPONSE_RAISE_EVENT;
-            resp->header.session_id = session->id;
-            resp->header.body_size = req->header.body_size;
+/**
+ * @brief Account a host body in the transmission policy of the session. The
+ * automatic policy coalesces bodies while they are large on average. The
+ * caller must hold the session lock.
+ * @param session Session
+ * @param size Size of the body as received from the host
+ */
+static void observe_host_body(struct session_info *session, size_t size)
+{
+    if (session->transmission != TRANSMISSION_AUTO) {
+        return;
+    }
 
-            memcpy(resp->body, req->body, req->header.body_size);
-            send(session->target_sockfd, &resp, sizeof(resp), 0);
-            break;
-        case REQUEST_MAKE_SESSION:
-        case REQUEST_JOIN_SESSION:
-        default:
-            send_bad_request(session->host_sockfd, session->id);
-            break;
-        }
+    /* The newest body weighs 1/8 */
+    session->avg_body_size = (session->avg_body_size * 7 + size) / 8;
+
+    bool_t is_bulk = session->is_bulk
+                         ? session->avg_body_size >= auto_interactive_body_size
+                         : session->avg_body_size >= auto_bulk_body_size;
+
+    if (is_bulk == session->is_bulk) {
+        return;
+    }
+
+    session->is_bulk = is_bulk;
+
+    for (struct connection *target = session->targets; target != NULL;
+         target = target->next_target) {
+        connection_set_corked(target, is_bulk);
     }
-    free(req);
 }
 
 /**
- * @brief Target request processing routine
- * @param session Information about the session in which the processing takes
- * place
+ * @brief Send host bodies coalesced by corked targets, called when the host
+ * has no complete request left to relay
+ * @param conn Connection of the host
  */
-static void target_routine(struct session_info *session)
+static void push_targets(struct connection *conn)
 {
-    session->is_target_connected = true;
-    struct request *req = malloc(target_socket_buffer_size);
-    struct response *resp = malloc(target_socket_buffer_size);
+    struct session_info *session = conn->session;
 
-    while (session->is_target_connected) {
-        ssize_t req_size =
-            recv(session->target_sockfd, req, target_socket_buffer_size, 0);
+    pthread_mutex_lock(&session->lock);
 
-        if (is_socket_error(req_size, target_socket_buffer_size)) {
-            target_leave_session(session);
-            continue;
+    if (session->is_bulk) {
+        for (struct connection *target = session->targets; target != NULL;
+             target = target->next_target) {
+            connection_push(target);
         }
+    }
 
-        if (is_bad_request(ROLE_TARGET, session->id, req, req_size)) {
-            send_bad_request(session->target_sockfd, session->id);
-            continue;
-        }
+    pthread_mutex_unlock(&session->lock);
+}
 
-        switch (req->header.type) {
-        case REQUEST_CLOSE_SESSION:
-            target_leave_session(session);
-            break;
-        case REQUEST_DATA:
-            resp->header.type = RESPONSE_DATA;
-            resp->header.session_id = session->id;
-            resp->header.body_size = req->header.body_size;
+/**
+ * @brief Forward the body of a target DATA request to the host. Hosts which
+ * negotiated max_targets get it as TARGET_DATA with the id of the target. If
+ * the host is not connected, the request is dropped.
+ * @param conn Connection of the target
+ * @param req The received request
+ */
+static void relay_target_data(struct connection *conn,
+                              const struct decoded_request *req)
+{
+    struct session_info *session = conn->session;
+    struct response_header header = {.type = RESPONSE_DATA,
+                                     .session_id = session->id,
+                                     .body_size = req->header.body_size};
+    struct target_header tag = {.target_id = conn->target_id};
+    struct latency_mark mark = {.path = LATENCY_PATH_TARGET_DATA,
+                                .start = conn->recv_time};
+    uint8_t wire[PROTOCOL_MAX_HEADER_SIZE];
+    struct iovec iov[3] = {{.iov_base = wire}};
+    int32_t iovcnt = 1;
+
+    if (session->is_fan_out) {
+        header.type = RESPONSE_TARGET_DATA;
+        header.body_size += sizeof(tag);
+        iov[iovcnt++] =
+            (struct iovec){.iov_base = &tag, .iov_len = sizeof(tag)};
+    }
 
-            memcpy(resp->body, req->body, req->header.body_size);
-            send(session->host_sockfd, &resp, sizeof(resp), 0);
-            break;
-        case REQUEST_RAISE_EVENT:
-        case REQUEST_MAKE_SESSION:
-        case REQUEST_JOIN_SESSION:
-        default:
-            send_bad_request(session->target_sockfd, session->id);
-            break;
-        }
+    /* The body is sent straight from the input buffer, it is not copied */
+    if (req->header.body_size > 0) {
+        iov[iovcnt++] = (struct iovec){.iov_base = (void *)req->body,
+                                       .iov_len = req->header.body_size};
+    }
+
+    pthread_mutex_lock(&session->lock);
+
+    struct connection *host = session->host_connection;
+
+    if (host != NULL) {
+        iov[0].iov_len = protocol_encode_response(host->version, &header, wire);
+        connection_sendv(host, CONNECTION_LANE_BULK, iov, iovcnt, &mark);
+        throttle_producer(conn, host);
     }
-    free(req);
+
+    pthread_mutex_unlock(&session->lock);
 }
 
 /**
- * @brief Generate a four-digit identifier for a new session
- * @return Unique Id for new session
+ * @brief Get the CPU time of the calling thread
+ * @return Time in ns
  */
-static uint16_t generate_session_id(void)
+static uint64_t thread_cpu_time(void)
 {
-    uint16_t id;
-    do {
-        id = (uint16_t)(rand() % 10000);
-    } while (session_is_exist(id));
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
 
-    return id;
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
 }
 
 /**
- * @brief Create a new session
- * @param host_sockfd Descriptor of the client who wants to create a new session
- * and be the host in it
- * @return A new session with a unique id in which the client is the host
+ * @brief Compress the body of a DATA request
+ * @param req Request
+ * @param body Set to the compressed body
+ * @return true on success, false if the body does not shrink or there is no
+ * memory
  */
-static struct session_info *new_session(int32_t host_sockfd)
+static bool_t compress_body(const struct decoded_request *req,
+                            struct relay_body *body)
 {
-    struct session_info *session = calloc(1, sizeof(struct session_info));
-    session->host_sockfd = host_sockfd;
-    session->is_host_connected = true;
+    size_t size = req->header.body_size;
 
-    session->id = generate_session_id();
+    if (size < compression_min_size) {
+        return false;
+    }
 
-    log_info("New session with id %i created", session->id);
+    /* Only blocks smaller than the original body are worth sending */
+    size_t capacity = sizeof(struct compressed_header) + size - 1;
+    struct shared_buffer *buffer = shared_buffer_alloc(capacity, NULL);
 
-    return session;
+    if (buffer == NULL) {
+        return false;
+    }
+
+    struct compressed_header header = {.original_size = (uint32_t)size};
+    memcpy(buffer->data, &header, sizeof(header));
+
+    size_t block_size =
+        lz_compress(req->body, size, buffer->data + sizeof(header),
+                    capacity - sizeof(header));
+
+    if (block_size == 0) {
+        shared_buffer_unref(buffer);
+        return false;
+    }
+
+    *body = (struct relay_body){.type = RESPONSE_DATA_COMPRESSED,
+                                .data = buffer->data,
+                                .size = sizeof(header) + block_size,
+                                .buffer = buffer};
+
+    return true;
 }
 
 /**
- * @brief Join an active session by session id
- * @param id Unique identification number of the session to which the target
- * wants to join
- * @param target_sockfd Descriptor of the client who wants to join the session
- * @return Session info on success, or NULL if no session with the specified
- * identifier was found
+ * @brief Check the header of the body of a DATA_COMPRESSED request
+ * @param req Request
+ * @return Original size of the body or 0 if the body is malformed, empty
+ * bodies are never compressed
  */
-static struct session_info *join_session(uint16_t id, int32_t target_sockfd)
+static size_t get_original_size(const struct decoded_request *req)
 {
-    if (!session_is_exist(id)) {
-        return NULL;
+    struct compressed_header header;
+
+    if (req->header.body_size < sizeof(header)) {
+        return 0;
     }
 
-    struct session_info *session = session_get(id);
-    session->target_sockfd = target_sockfd;
-    session->is_target_connected = true;
+    memcpy(&header, req->body, sizeof(header));
 
-    log_info("Joining to session with id %i success", session->id);
+    /* Targets are promised bodies no larger than hosts may send */
+    if (header.original_size >= host_request_limit) {
+        return 0;
+    }
 
-    return session;
+    return header.original_size;
 }
 
 /**
- * @brief Сheck the activity of the session and destroy it if no one is
- * connected to it.
- * @param session Information about the session which need to check
+ * @brief Decompress the body of a DATA_COMPRESSED request
+ * @param req Request
+ * @param body Set to the original body
+ * @return true on success, false if the body is malformed or there is no
+ * memory
  */
-static void clear_empty_session(struct session_info *session)
+static bool_t decompress_body(const struct decoded_request *req,
+                              struct relay_body *body)
 {
-    if (!session->is_host_connected && !session->is_target_connected) {
-        session_remove(session->id);
+    size_t size = get_original_size(req);
+    struct shared_buffer *buffer =
+        size > 0 ? shared_buffer_alloc(size, NULL) : NULL;
+
+    if (buffer == NULL) {
+        return false;
     }
+
+    const size_t header_size = sizeof(struct compressed_header);
+    ssize_t result = lz_decompress(req->body + header_size,
+                                   req->header.body_size - header_size,
+                                   buffer->data, size);
+
+    if (result != (ssize_t)size) {
+        shared_buffer_unref(buffer);
+        return false;
+    }
+
+    *body = (struct relay_body){.type = RESPONSE_DATA,
+                                .data = buffer->data,
+                                .size = size,
+                                .buffer = buffer};
+
+    return true;
 }
 
 /**
- * @brief Send a response about the status of the request related to session
- * management
- * @param sockfd Descriptor of the client
- * @param type The type of response, in this case the success or failure of the
- * operation
- * @param session_id Unique identification number of the session with which the
- * client's request was associated
+ * @brief Check that the block of a DATA_COMPRESSED request decodes to the
+ * original size without decompressing it
+ * @param req Request whose original size is checked already
+ * @return true if the block is valid, false if not
  */
-static void send_session_response(int32_t sockfd, enum response_type type,
-                                  uint16_t session_id)
+static bool_t is_block_valid(const struct decoded_request *req)
 {
-    struct response resp = {.header.type = type,
-                            .header.session_id = session_id};
+    size_t size = get_original_size(req);
+    const size_t header_size = sizeof(struct compressed_header);
 
-    send(sockfd, &resp, sizeof(resp), 0);
+    return lz_validate(req->body + header_size,
+                       req->header.body_size - header_size,
+                       size) == (ssize_t)size;
 }
 
 /**
- * @brief Processing the first client request if it is associated with session
- * management and transferring control to a subroutine
- * @param req First request from a client
- * @param sockfd Descriptor of the client
+ * @brief Encode the body as a delta from the previous body sent to the
+ * target. The caller must hold the session lock.
+ * @param target Connection of the target
+ * @param plain Original body
+ * @param limit Size of the body sent otherwise, the delta must be smaller
+ * @param body Set to the delta
+ * @return true on success, false if the target has no previous body, the
+ * delta is not smaller or there is no memory
  */
-static void handle_session_request(const struct request *req, int32_t sockfd)
+static bool_t encode_delta(const struct connection *target,
+                           const struct relay_body *plain, size_t limit,
+                           struct relay_body *body)
 {
-    switch (req->header.type) {
-    case REQUEST_MAKE_SESSION: {
-        if (req->header.role != ROLE_HOST) {
-            send_session_response(sockfd, RESPONSE_MAKE_SESSION_FAIL, 0);
-            break;
-        }
+    if (target->delta_base == NULL || limit <= sizeof(struct delta_header)) {
+        return false;
+    }
+
+    struct shared_buffer *buffer = shared_buffer_alloc(limit, NULL);
 
-        struct session_info *session = new_session(sockfd);
+    if (buffer == NULL) {
+        return false;
+    }
 
-        send_session_response(sockfd, RESPONSE_MAKE_SESSION_SUCCESS,
-                              session->id);
+    size_t size = delta_encode(target->delta_base, target->delta_base_size,
+                               plain->data, plain->size, buffer->data,
+                               limit - 1);
 
-        host_routine(session);
-        clear_empty_session(session);
-        break;
+    if (size == 0) {
+        shared_buffer_unref(buffer);
+        return false;
     }
 
-    case REQUEST_JOIN_SESSION: {
-        if (req->header.role != ROLE_TARGET) {
-            send_session_response(sockfd, RESPONSE_JOIN_SESSION_FAIL,
-                                  req->header.session_id);
-            break;
-        }
+    *body = (struct relay_body){.type = RESPONSE_DATA_DELTA,
+                                .data = buffer->data,
+                                .size = size,
+                                .buffer = buffer};
 
-        struct session_info *session =
-            join_session(req->header.session_id, sockfd);
+    return true;
+}
 
-        if (session == NULL) {
-            send_session_response(sockfd, RESPONSE_JOIN_SESSION_FAIL,
-                                  req->header.session_id);
-            break;
+/**
+ * @brief Keep a copy of the body sent to the target as the base of the next
+ * delta. Without memory the next body is sent whole. The caller must hold the
+ * session lock.
+ * @param target Connection of the target
+ * @param plain Original body
+ */
+static void remember_delta_base(struct connection *target,
+                                const struct relay_body *plain)
+{
+    if (target->delta_base == NULL ||
+        plain->size > target->delta_base_capacity) {
+        buffer_pool_put(target->delta_base);
+        target->delta_base_size = 0;
+        target->delta_base =
+            buffer_pool_get(plain->size > 0 ? plain->size : 1,
+                            &target->delta_base_capacity);
+
+        if (target->delta_base == NULL) {
+            return;
         }
+    }
 
-        send_session_response(sockfd, RESPONSE_JOIN_SESSION_SUCCESS,
-                              session->id);
+    memcpy(target->delta_base, plain->data, plain->size);
+    target->delta_base_size = plain->size;
+}
 
-        target_routine(session);
-        clear_empty_session(session);
-        break;
-    }
-    default:
-        break;
+/**
+ * @brief Check whether the target needs the original of compressed bodies
+ * @param target Connection of the target
+ * @return true if the target takes no compressed bodies or receives deltas,
+ * which are computed from originals
+ */
+static bool_t needs_original(const struct connection *target)
+{
+    return target->compression == COMPRESSION_NONE ||
+           target->delta != DELTA_NONE;
+}
+
+/**
+ * @brief Check whether a target of the session needs the original of
+ * compressed bodies. The caller must hold the session lock.
+ * @param session Session
+ * @return true if such a target is connected, false if not
+ */
+static bool_t is_original_wanted(const struct session_info *session)
+{
+    for (const struct connection *target = session->targets; target != NULL;
+         target = target->next_target) {
+        if (needs_original(target)) {
+            return true;
+        }
     }
+
+    return false;
 }
 
 /**
- * @brief Socket thread start routine.
- * @param arg Pointer to descriptor of the client
+ * @brief Send a host body to the target in the smallest form the target
+ * takes. The caller must hold the session lock.
+ * @param conn Connection of the host
+ * @param target Connection of the target
+ * @param plain Original body, may be missing if the target takes compressed
+ * bodies without deltas
+ * @param packed Compressed body, may be missing
+ * @return true if the compressed body was sent
  */
-static void *socket_thread(void *arg)
+static bool_t send_body(struct connection *conn, struct connection *target,
+                        struct relay_body *plain, struct relay_body *packed)
 {
-    int32_t sockfd = *((int32_t *)arg);
+    struct session_info *session = conn->session;
+    struct relay_body *body = plain;
+    struct relay_body delta = {.type = RESPONSE_DATA_DELTA};
 
-    char_t buffer[1000];
-    ssize_t recv_size = recv(sockfd, buffer, sizeof(buffer), 0);
+    if (target->compression == COMPRESSION_LZ4 && packed->data != NULL &&
+        (plain->data == NULL || packed->size < plain->size)) {
+        body = packed;
+    }
 
-    if (recv_size == sizeof(struct request_header)) {
-        struct request *req = (struct request *)buffer;
+    if (target->delta != DELTA_NONE) {
+        if (encode_delta(target, plain, body->size, &delta)) {
+            session->delta_raw_bytes += body->size;
+            session->delta_bytes += delta.size;
+            body = &delta;
+        }
 
-        handle_session_request(req, sockfd);
+        remember_delta_base(target, plain);
     }
 
-    log_debug("Exit socket_thread");
-    close(sockfd);
-    pthread_exit(NULL);
+    struct response_header header = {.type = body->type,
+                                     .session_id = session->id,
+                                     .body_size = body->size};
+    struct latency_mark mark = {.path = LATENCY_PATH_HOST_DATA,
+                                .start = conn->recv_time};
+
+    uint8_t wire[PROTOCOL_MAX_HEADER_SIZE];
+    size_t wire_size = protocol_encode_response(target->version, &header, wire);
+
+    connection_send_shared(target, CONNECTION_LANE_BULK, wire, wire_size,
+                           body->data, body->size, body->buffer, &mark);
+    throttle_producer(conn, target);
+
+    shared_buffer_unref(delta.buffer);
+
+    return body == packed;
 }
 
-noreturn void server_start(const char_t *addr, uint16_t port,
-                           int32_t max_clients)
+/**
+ * @brief Forward the body of a host DATA or DATA_COMPRESSED request to all
+ * targets, each in the form it negotiated. Compressed bodies are checked once,
+ * malformed ones are refused with BAD_REQUEST. Bodies are converted once
+ * outside of the session lock for the targets seen before; if a new target
+ * with other options joins meanwhile, it gets plain bodies, which every target
+ * accepts. Deltas are computed under the lock, since the previous body belongs
+ * to the target.
+ * @param conn Connection of the host
+ * @param req The received request
+ */
+static void relay_data(struct connection *conn,
+                       const struct decoded_request *req)
 {
-    log_info("Starting server: %s:%i", addr, port);
-    log_info("Max connections: %i", max_clients);
+    struct session_info *session = conn->session;
+    bool_t is_compressed = req->header.type == REQUEST_DATA_COMPRESSED;
+    struct relay_body plain = {.type = RESPONSE_DATA};
+    struct relay_body packed = {.type = RESPONSE_DATA_COMPRESSED};
+    struct relay_body *received = is_compressed ? &packed : &plain;
+
+    received->data = req->body;
+    received->size = req->header.body_size;
+
+    if (is_compressed && get_original_size(req) == 0) {
+        send_bad_request(conn, session->id);
+        return;
+    }
 
-    /* Set seed for rand function */
-    srand((uint16_t)time(NULL));
+    bool_t is_packed_wanted = false;
+    bool_t is_original_needed = false;
 
-    session_init_table((uint16_t)max_clients);
+    pthread_mutex_lock(&session->lock);
 
-    /*
-     * Create the server socket
-     * IP protocol family
-     * Sequenced, reliable, connection-based byte streams
-     * Auto-chosen protocol
-     */
-    server_sockfd = socket(PF_INET, SOCK_STREAM, 0);
-    int32_t one = 1;
-    setsockopt(server_sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int32_t));
+    bool_t has_targets = session->targets != NULL;
 
-    /*
-     * Configure settings of the server address struct
-     * Address family: Internet
-     * Port number, using htons function to use proper byte order
-     * IP address
-     */
-    struct sockaddr_in server_addr = {.sin_family = AF_INET,
-                                      .sin_port = htons(port),
-                                      .sin_addr.s_addr = inet_addr(addr)};
+    for (struct connection *target = session->targets; target != NULL;
+         target = target->next_target) {
+        is_packed_wanted |= target->compression == COMPRESSION_LZ4;
+        is_original_needed |= needs_original(target);
+    }
 
-    /* Set all bits of the padding field to 0 */
-    memset(server_addr.sin_zero, 0, sizeof(server_addr.sin_zero));
+    pthread_mutex_unlock(&session->lock);
 
-    /* Bind the address struct to the socket */
-    if (bind(server_sockfd, (struct sockaddr *)&server_addr,
-             sizeof(server_addr)) == -1) {
-        close(server_sockfd);
-        log_error("Unable to bind");
-        exit(EXIT_FAILURE);
+    if (!has_targets) {
+        return;
     }
 
-    /* Listen on the socket, with max connection requests queued */
-    if (listen(server_sockfd, max_clients) == 0) {
-        log_debug("Listening");
-    } else {
-        log_error("Unable to listen");
-        close(server_sockfd);
-        exit(EXIT_FAILURE);
+    bool_t is_packing = !is_compressed && is_packed_wanted;
+    uint64_t codec_time = 0;
+
+    /* The clock is read only around codec work, plain relays skip it */
+    if (is_packing || is_compressed) {
+        uint64_t codec_start = thread_cpu_time();
+        bool_t is_valid = true;
+
+        if (is_packing) {
+            compress_body(req, &packed);
+        } else if (is_original_needed) {
+            is_valid = decompress_body(req, &plain);
+        } else {
+            /* Targets which take the block as it is get valid blocks only */
+            is_valid = is_block_valid(req);
+        }
+
+        codec_time = thread_cpu_time() - codec_start;
+
+        if (!is_valid) {
+            send_bad_request(conn, session->id);
+            return;
+        }
     }
 
-    while (true) {
-        /* Accept call. Create a new socket for the incoming connection */
-        log_debug("Wait for a client");
-        struct sockaddr_storage client_storage;
-        socklen_t addr_size = sizeof(struct sockaddr_storage);
+    /* The received body is sent from the input buffer */
+    received->buffer = shared_buffer_ref(conn->in_shared);
 
-        int32_t new_sd = accept(server_sockfd,
-                                (struct sockaddr *)&client_storage, &addr_size);
+    pthread_mutex_lock(&session->lock);
 
-        log_debug("Accept client");
+    /* A new target needs the original, it is decompressed outside the lock */
+    while (is_compressed && plain.data == NULL &&
+           is_original_wanted(session)) {
+        pthread_mutex_unlock(&session->lock);
 
-        opened_sockets[num_of_opened_sockets++] = new_sd;
+        uint64_t codec_start = thread_cpu_time();
+        bool_t is_converted = decompress_body(req, &plain);
+        codec_time += thread_cpu_time() - codec_start;
 
-        /*
-         * For each client request creates a thread and assign the client
-         * request to it to process so the main thread can entertain next
-         * request
-         */
-        int32_t result = pthread_create(&threads[num_of_threads++], NULL,
-                                        socket_thread, &new_sd);
+        pthread_mutex_lock(&session->lock);
+
+        if (!is_converted) {
+            break;
+        }
+    }
+
+    bool_t is_relayed = false;
+    bool_t is_packed_sent = false;
 
-        if (result != 0) {
-            log_error("Failed to create thread: %i", result);
+    observe_host_body(session, req->header.body_size);
+
+    for (struct connection *target = session->targets; target != NULL;
+         target = target->next_target) {
+        /* Only without memory the original of a compressed body is missing */
+        if (needs_original(target) && plain.data == NULL) {
+            continue;
         }
 
-        if (num_of_threads >= max_clients) {
-            join_threads();
+        is_packed_sent |= send_body(conn, target, &plain, &packed);
+        is_relayed = true;
+    }
+
+    /* Counted once if the body travels compressed on either side */
+    if (is_relayed && (is_packed_sent || is_compressed || codec_time > 0)) {
+        size_t raw_size = 0;
+        size_t compressed_size = 0;
+
+        if (is_packed_sent || is_compressed) {
+            raw_size = is_compressed ? get_original_size(req)
+                                     : req->header.body_size;
+            compressed_size = packed.size;
         }
+
+        session->raw_bytes += raw_size;
+        session->compressed_bytes += compressed_size;
+        session->codec_time += codec_time;
+        stats_add_session_compression(session->id, raw_size, compressed_size,
+                                      codec_time);
+    }
+
+    pthread_mutex_unlock(&session->lock);
+
+    shared_buffer_unref(plain.buffer);
+    shared_buffer_unref(packed.buffer);
+}
+
+/**
+ * @brief Host request processing routine
+ * @param conn Connection of the host
+ * @param req Received request
+ * @param req_size Size of the request frame
+ */
+static void host_routine(struct connection *conn,
+                         const struct decoded_request *req, size_t req_size)
+{
+    struct session_info *session = conn->session;
+
+    if (is_bad_request(ROLE_HOST, session->id, req, req_size)) {
+        send_bad_request(conn, session->id);
+        return;
+    }
+
+    stats_add_request(req->header.type, req_size);
+    stats_add_session_request(session->id, ROLE_HOST, req_size);
+
+    switch (req->header.type) {
+    case REQUEST_CLOSE_SESSION:
+        host_leave_session(conn);
+        break;
+    case REQUEST_DATA:
+        relay_data(conn, req);
+        break;
+    case REQUEST_DATA_COMPRESSED:
+        if (conn->compression == COMPRESSION_NONE) {
+            send_bad_request(conn, session->id);
+        } else {
+            relay_data(conn, req);
+        }
+        break;
+    case REQUEST_RAISE_EVENT:
+        relay_request(conn, RESPONSE_RAISE_EVENT, LATENCY_PATH_HOST_EVENT, req);
+        break;
+    case REQUEST_HEARTBEAT:
+        /* Receiving it has already reset the idle timeout */
+        break;
+    case REQUEST_MAKE_SESSION:
+    case REQUEST_JOIN_SESSION:
+    default:
+        send_bad_request(conn, session->id);
+        break;
+    }
+}
+
+/**
+ * @brief Target request processing routine
+ * @param conn Connection of the target
+ * @param req Received request
+ * @param req_size Size of the request frame
+ */
+static void target_routine(struct connection *conn,
+                           const struct decoded_request *req, size_t req_size)
+{
+    struct session_info *session = conn->session;
+
+    if (is_bad_request(ROLE_TARGET, session->id, req, req_size)) {
+        send_bad_request(conn, session->id);
+        return;
+    }
+
+    stats_add_request(req->header.type, req_size);
+    stats_add_session_request(session->id, ROLE_TARGET, req_size);
+
+    switch (req->header.type) {
+    case REQUEST_CLOSE_SESSION:
+        target_leave_session(conn);
+        break;
+    case REQUEST_DATA:
+        relay_target_data(conn, req);
+        break;
+    case REQUEST_HEARTBEAT:
+        break;
+    case REQUEST_RAISE_EVENT:
+    case REQUEST_MAKE_SESSION:
+    case REQUEST_JOIN_SESSION:
+    default:
+        send_bad_request(conn, session->id);
+        break;
+    }
+}
+
+/**
+ * @brief Create a new session
+ * @param host Connection of the client who wants to create a new session and
+ * be the host in it
+ * @param options Options granted to the host
+ * @param is_fan_out Set if the host negotiated max_targets
+ * @return A new session with a unique id in which the client is the host or
+ * NULL for errors
+ */
+static struct session_info *new_session(struct connection *host,
+                                        const struct session_options *options,
+                                        bool_t is_fan_out)
+{
+    uint16_t id;
+
+    if (session_id_alloc(&id) == -1) {
+        log_warning("Unable to create session: all session ids are in use");
+        return NULL;
+    }
+
+    struct session_info *session = session_add(id);
+
+    if (session == NULL) {
+        log_error("Unable to create session: %s", strerror(errno));
+        session_id_release(id);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&session->lock);
+    session->host_connection = host;
+    session->max_targets = options->max_targets;
+    session->is_fan_out = is_fan_out;
+    session->transmission = options->transmission;
+    session->is_bulk = options->transmission == TRANSMISSION_THROUGHPUT;
+    pthread_mutex_unlock(&session->lock);
+
+    log_info("New session with id %i created", session->id);
+
+    return session;
+}
+
+/**
+ * @brief Pick an id for a new target of the session, ids of targets which
+ * left are reused only after the counter wraps. The caller must hold the
+ * session lock.
+ * @param session Session
+ * @return Id which no connected target has
+ */
+static uint16_t alloc_target_id(struct session_info *session)
+{
+    while (true) {
+        uint16_t id = ++session->next_target_id;
+        bool_t is_taken = id == 0;
+
+        for (struct connection *target = session->targets;
+             target != NULL && !is_taken; target = target->next_target) {
+            is_taken = target->target_id == id;
+        }
+
+        if (!is_taken) {
+            return id;
+        }
+    }
+}
+
+/**
+ * @brief Join an active session by session id
+ * @param id Unique identification number of the session to which the target
+ * wants to join
+ * @param target Connection of the client who wants to join the session
+ * @return Session info on success, or NULL if no session with the specified
+ * identifier was found, the session has all targets it allows or is closed
+ */
+static struct session_info *join_session(uint16_t id, struct connection *target)
+{
+    struct session_info *session = session_acquire(id);
+
+    if (session != NULL) {
+        bool_t is_free = session->num_targets < session->max_targets &&
+                         !session->is_closed;
+        if (is_free) {
+            target->target_id = alloc_target_id(session);
+            target->next_target = session->targets;
+            session->targets = target;
+            session->num_targets++;
+            connection_set_corked(target, session->is_bulk);
+        }
+
+        pthread_mutex_unlock(&session->lock);
+
+        if (!is_free) {
+            session = NULL;
+        }
+    }
+
+    if (session != NULL) {
+        log_info("Joining to session with id %i success", session->id);
+    }
+
+    return session;
+}
+
+/**
+ * @brief Processing the first client request if it is associated with session
+ * management and switching the connection to the requested role
+ * @param conn Connection of the client
+ * @param req First request from a client
+ */
+static void handle_session_request(struct connection *conn,
+                                   const struct decoded_request *req)
+{
+    const struct request_header header = req->header;
+    struct session_options options = {.compression = COMPRESSION_NONE,
+                                      .delta = DELTA_NONE};
+    size_t options_size = header.body_size;
+    bool_t is_fan_out =
+        options_size > offsetof(struct session_options, max_targets);
+
+    stats_add_request(header.type, req->header_size + header.body_size);
+
+    /* Options are answered only if the client sent them */
+    if (options_size > 0) {
+        memcpy(&options, req->body, options_size);
+
+        if (!is_compression || options.compression != COMPRESSION_LZ4) {
+            options.compression = COMPRESSION_NONE;
+        }
+
+        /* Only targets receive host bodies */
+        if (header.type != REQUEST_JOIN_SESSION ||
+            options.delta != DELTA_XOR_BLOCKS) {
+            options.delta = DELTA_NONE;
+        }
+
+        conn->compression = options.compression;
+        conn->delta = options.delta;
+
+        if (options.transmission > TRANSMISSION_THROUGHPUT) {
+            options.transmission = TRANSMISSION_AUTO;
+        }
+
+        /* Probes only make sense while idle clients are dropped */
+        conn->is_heartbeat = options.heartbeat != 0 && idle_timeout > 0;
+        options.heartbeat = conn->is_heartbeat;
+        options.reserved = 0;
+
+        /* The timer handler schedules the first probe */
+        if (conn->is_heartbeat) {
+            event_loop_set_timer(&conn->source, 0);
+        }
+    }
+
+    /* Hosts which do not know the field get a pair session */
+    if (!is_fan_out || options.max_targets < 1) {
+        options.max_targets = 1;
+    } else if (options.max_targets > max_targets) {
+        options.max_targets = (uint8_t)max_targets;
+    }
+
+    options.target_id = 0;
+
+    switch (header.type) {
+    case REQUEST_MAKE_SESSION: {
+        if (header.role != ROLE_HOST) {
+            send_empty_response(conn, RESPONSE_MAKE_SESSION_FAIL, 0);
+            close_connection(conn);
+            break;
+        }
+
+        conn->session = new_session(conn, &options, is_fan_out);
+
+        if (conn->session == NULL) {
+            send_empty_response(conn, RESPONSE_MAKE_SESSION_FAIL, 0);
+            close_connection(conn);
+            break;
+        }
+
+        conn->state = CONNECTION_STATE_HOST;
+        conn->in_limit = host_request_limit;
+
+        send_session_response(conn, RESPONSE_MAKE_SESSION_SUCCESS,
+                              conn->session->id, &options, options_size);
+        break;
+    }
+
+    case REQUEST_JOIN_SESSION: {
+        if (header.role != ROLE_TARGET) {
+            send_empty_response(conn, RESPONSE_JOIN_SESSION_FAIL,
+                                header.session_id);
+            close_connection(conn);
+            break;
+        }
+
+        conn->state = CONNECTION_STATE_TARGET;
+        conn->in_limit = target_request_limit;
+        conn->session = join_session(header.session_id, conn);
+
+        if (conn->session == NULL) {
+            send_empty_response(conn, RESPONSE_JOIN_SESSION_FAIL,
+                                header.session_id);
+            close_connection(conn);
+            break;
+        }
+
+        options.max_targets = (uint8_t)conn->session->max_targets;
+        options.transmission = (uint8_t)conn->session->transmission;
+        options.target_id = conn->target_id;
+
+        /* The timer handler starts watching the host of the session */
+        if (orphan_timeout > 0) {
+            event_loop_set_timer(&conn->source, 0);
+        }
+
+        send_session_response(conn, RESPONSE_JOIN_SESSION_SUCCESS,
+                              conn->session->id, &options, options_size);
+        break;
+    }
+    default:
+        close_connection(conn);
+        break;
+    }
+}
+
+/**
+ * @brief Start passing the body of a host DATA request through the pipe of the
+ * target. The header was already read to the input buffer.
+ * @param conn Connection of the host
+ * @return true if the body will be spliced, false if it must be read to the
+ * input buffer
+ */
+static bool_t begin_pass_through(struct connection *conn)
+{
+    struct decoded_request req;
+    struct session_info *session = conn->session;
+
+    decode_request(conn, 0, &req);
+
+    size_t req_size = req.header_size + req.header.body_size;
+
+    if (req.header.type != REQUEST_DATA || req.header.body_size == 0 ||
+        req_size >= host_request_limit ||
+        is_bad_request(ROLE_HOST, session->id, &req, req_size)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&session->lock);
+
+    /*
+     * Bodies for several targets or for targets which receive them converted
+     * are read and relayed from the input buffer
+     */
+    struct connection *target =
+        session->num_targets == 1 ? session->targets : NULL;
+
+    if (target != NULL && (target->compression != COMPRESSION_NONE ||
+                           target->delta != DELTA_NONE)) {
+        target = NULL;
+    }
+
+    if (target != NULL && target->pipe == NULL) {
+        target->pipe = relay_pipe_new(pass_through_pipe_size);
+    }
+
+    if (target != NULL && target->pipe != NULL &&
+        req.header.body_size <= target->pipe->capacity) {
+        conn->in_pipe = relay_pipe_ref(target->pipe);
+        conn->in_body_left = req.header.body_size;
+    }
+
+    pthread_mutex_unlock(&session->lock);
+
+    return conn->in_pipe != NULL;
+}
+
+/**
+ * @brief Send the header of a completely spliced body to the target, the body
+ * follows it directly from the pipe
+ * @param conn Connection of the host
+ */
+static void finish_pass_through(struct connection *conn)
+{
+    struct decoded_request req;
+    struct session_info *session = conn->session;
+
+    decode_request(conn, 0, &req);
+
+    struct response_header header = {.type = RESPONSE_DATA,
+                                     .session_id = session->id,
+                                     .body_size = req.header.body_size};
+    size_t req_size = req.header_size + req.header.body_size;
+
+    /* The whole body is in the pipe, so it is received now */
+    struct latency_mark mark = {.path = LATENCY_PATH_HOST_DATA,
+                                .start = latency_now()};
+
+    stats_add_request(REQUEST_DATA, req_size);
+    stats_add_session_request(session->id, ROLE_HOST, req_size);
+
+    pthread_mutex_lock(&session->lock);
+
+    observe_host_body(session, req.header.body_size);
+
+    /*
+     * A new target has a new pipe, the body is dropped if the target left.
+     * Targets which joined meanwhile get the bodies which follow.
+     */
+    for (struct connection *target = session->targets; target != NULL;
+         target = target->next_target) {
+        if (target->pipe == conn->in_pipe) {
+            uint8_t wire[PROTOCOL_MAX_HEADER_SIZE];
+            size_t wire_size =
+                protocol_encode_response(target->version, &header, wire);
+
+            connection_send_pipe(target, wire, wire_size, conn->in_pipe,
+                                 req.header.body_size, &mark);
+            throttle_producer(conn, target);
+        }
+    }
+
+    pthread_mutex_unlock(&session->lock);
+
+    relay_pipe_unref(conn->in_pipe);
+    conn->in_pipe = NULL;
+    conn->in_size = 0;
+}
+
+/**
+ * @brief Stop splicing the current body. Spliced bytes are read back from the
+ * pipe and the rest of the body is read to the input buffer.
+ * @param conn Connection of the host
+ * @return 0 for success or -1 for errors
+ */
+static int32_t abort_pass_through(struct connection *conn)
+{
+    struct decoded_request req;
+
+    decode_request(conn, 0, &req);
+
+    size_t body_size = req.header.body_size;
+    size_t spliced = body_size - conn->in_body_left;
+    ssize_t result = -1;
+
+    if (connection_reserve_input(conn, conn->in_size + body_size) == 0) {
+        result = relay_pipe_read(conn->in_pipe, conn->in_buffer + conn->in_size,
+                                 spliced);
+    }
+
+    relay_pipe_unref(conn->in_pipe);
+    conn->in_pipe = NULL;
+    conn->in_body_left = 0;
+
+    if (result != (ssize_t)spliced) {
+        return -1;
+    }
+
+    conn->in_size += spliced;
+
+    return 0;
+}
+
+/**
+ * @brief Splice available body bytes from the host socket to the pipe of the
+ * target. If the target is gone, the rest of the body is dropped.
+ * @param conn Connection of the host
+ * @return true if bytes were consumed, false if the host must wait for data,
+ * for the target or is leaving
+ */
+static bool_t pass_body(struct connection *conn)
+{
+    struct relay_pipe *pipe = conn->in_pipe;
+    ssize_t result;
+
+    if (pipe != NULL && atomic_load(&pipe->is_closed)) {
+        relay_pipe_unref(pipe);
+        conn->in_pipe = pipe = NULL;
+    }
+
+    if (pipe == NULL) {
+        size_t header_size = protocol_header_size(conn->version);
+        size_t room = conn->in_buffer_size - header_size;
+        result = connection_recv(conn, conn->in_buffer + header_size,
+                                 conn->in_body_left < room ? conn->in_body_left
+                                                           : room);
+    } else {
+        result = relay_pipe_fill(pipe, conn->source.fd, conn->in_body_left);
+    }
+
+    if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        int32_t available = 0;
+        ioctl(conn->source.fd, FIONREAD, &available);
+
+        /* Socket is empty, wait for the next event */
+        if (pipe == NULL || available == 0) {
+            return false;
+        }
+
+        /*
+         * The pipe is full. If it holds bodies queued to the target, wait
+         * until the target drains them. If it holds only this body, the body
+         * cannot be spliced as a whole and is copied instead.
+         */
+        struct decoded_request req;
+
+        decode_request(conn, 0, &req);
+
+        size_t spliced = req.header.body_size - conn->in_body_left;
+
+        size_t queued = atomic_load(&pipe->queued);
+
+        if (queued > spliced) {
+            relay_pipe_wait(pipe, &conn->source);
+
+            /* Retry if the target drained the pipe before the wait began */
+            return atomic_load(&pipe->queued) != queued;
+        }
+
+        if (abort_pass_through(conn) == -1) {
+            host_leave_session(conn);
+            return false;
+        }
+
+        return true;
+    }
+
+    if (result <= 0) {
+        host_leave_session(conn);
+        return false;
+    }
+
+    conn->in_body_left -= (size_t)result;
+
+    if (conn->in_body_left == 0) {
+        if (pipe != NULL) {
+            finish_pass_through(conn);
+        } else {
+            conn->in_size = 0;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Read host requests in pass-through mode. Only headers are read to
+ * user space, bodies of DATA requests are spliced to the target. Other
+ * requests are read to the input buffer request by request.
+ * @param conn Connection of the host
+ */
+static void read_pass_through(struct connection *conn)
+{
+    const size_t header_size = protocol_header_size(conn->version);
+
+    while (conn->state == CONNECTION_STATE_HOST &&
+           !atomic_load(&conn->is_read_paused)) {
+        if (conn->in_body_left > 0) {
+            if (!pass_body(conn)) {
+                break;
+            }
+            continue;
+        }
+
+        struct decoded_request req;
+        size_t expected = header_size;
+
+        if (conn->in_size >= header_size) {
+            if (!decode_request(conn, 0, &req)) {
+                host_leave_session(conn);
+                break;
+            }
+
+            expected += req.header.body_size;
+        }
+
+        if (expected >= host_request_limit) {
+            host_leave_session(conn);
+            break;
+        }
+
+        if (conn->in_size == expected && conn->in_size > header_size) {
+            host_routine(conn, &req, conn->in_size);
+            conn->in_offset = conn->in_size;
+
+            /* Bodies which are still queued to the target keep the buffer */
+            if (connection_compact_input(conn) == -1 &&
+                conn->state == CONNECTION_STATE_HOST) {
+                host_leave_session(conn);
+                break;
+            }
+
+            continue;
+        }
+
+        if (connection_reserve_input(conn, expected) == -1) {
+            host_leave_session(conn);
+            break;
+        }
+
+        ssize_t result = connection_recv(conn, conn->in_buffer + conn->in_size,
+                                         expected - conn->in_size);
+
+        if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            connection_release_input(conn);
+            break;
+        }
+
+        if (result <= 0) {
+            host_leave_session(conn);
+            break;
+        }
+
+        conn->recv_time = latency_now();
+        conn->in_size += (size_t)result;
+
+        if (conn->in_size != header_size) {
+            continue;
+        }
+
+        if (!decode_request(conn, 0, &req)) {
+            host_leave_session(conn);
+            break;
+        }
+
+        if (req.header.body_size == 0) {
+            host_routine(conn, &req, conn->in_size);
+            conn->in_size = 0;
+        } else {
+            begin_pass_through(conn);
+        }
+    }
+
+    if (conn->state == CONNECTION_STATE_HOST) {
+        push_targets(conn);
+    }
+}
+
+/**
+ * @brief Pass the received request to the routine of the current connection
+ * state
+ * @param conn Connection of the client
+ * @param req Received request
+ * @param req_size Size of the request frame
+ */
+static void process_request(struct connection *conn,
+                            const struct decoded_request *req, size_t req_size)
+{
+    switch (conn->state) {
+    case CONNECTION_STATE_HANDSHAKE:
+        if (req_size <= req->header_size + sizeof(struct session_options)) {
+            handle_session_request(conn, req);
+        } else {
+            close_connection(conn);
+        }
+        break;
+    case CONNECTION_STATE_HOST:
+        host_routine(conn, req, req_size);
+        break;
+    case CONNECTION_STATE_TARGET:
+        target_routine(conn, req, req_size);
+        break;
+    case CONNECTION_STATE_CLOSING:
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Leave the session of a connection which is closed by the client or
+ * whose stream cannot be framed anymore
+ * @param conn Connection of the client
+ */
+static void drop_connection(struct connection *conn)
+{
+    switch (conn->state) {
+    case CONNECTION_STATE_HANDSHAKE:
+        close_connection(conn);
+        break;
+    case CONNECTION_STATE_HOST:
+        host_leave_session(conn);
+        break;
+    case CONNECTION_STATE_TARGET:
+        target_leave_session(conn);
+        break;
+    case CONNECTION_STATE_CLOSING:
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Process every complete request in the input buffer. A request may
+ * arrive in several reads and one read may carry several requests, so the
+ * incomplete tail is moved to the beginning of the buffer and is completed by
+ * the next reads.
+ * @param conn Connection of the client
+ */
+static void process_requests(struct connection *conn)
+{
+    while (conn->state != CONNECTION_STATE_CLOSING) {
+        size_t available = conn->in_size - conn->in_offset;
+        size_t header_size = request_header_size(conn);
+
+        if (header_size == 0 || available < header_size) {
+            break;
+        }
+
+        struct decoded_request req;
+
+        if (!decode_request(conn, conn->in_offset, &req)) {
+            drop_connection(conn);
+            break;
+        }
+
+        /*
+         * The size of the buffer was chosen in such a way that the largest
+         * theoretically possible request would fit into it, so a larger
+         * length means the stream is broken.
+         */
+        if (req.header.body_size >= conn->in_limit - header_size) {
+            drop_connection(conn);
+            break;
+        }
+
+        size_t req_size = header_size + req.header.body_size;
+
+        if (available < req_size) {
+            break;
+        }
+
+        conn->in_offset += req_size;
+        process_request(conn, &req, req_size);
+    }
+
+    if (conn->state == CONNECTION_STATE_HOST) {
+        push_targets(conn);
+    }
+
+    /* Bodies which are still queued to targets keep the buffer */
+    if (connection_compact_input(conn) == -1) {
+        drop_connection(conn);
+    }
+}
+
+/**
+ * @brief Borrow an input buffer which has room for the next read and can hold
+ * the whole request whose beginning is already received
+ * @param conn Connection of the client
+ * @return 0 for success or -1 for errors
+ */
+static int32_t reserve_input(struct connection *conn)
+{
+    size_t header_size = request_header_size(conn);
+    size_t size = conn->in_size + 1;
+    struct decoded_request req;
+
+    if (header_size > 0 && conn->in_size - conn->in_offset >= header_size &&
+        decode_request(conn, conn->in_offset, &req)) {
+        size = conn->in_offset + header_size + req.header.body_size;
+    }
+
+    if (size < input_buffer_min_size) {
+        size = input_buffer_min_size;
+    }
+
+    return connection_reserve_input(conn, size);
+}
+
+/**
+ * @brief Append received data to the input buffer and process the requests
+ * completed by it
+ * @param conn Connection of the client
+ * @param result Result of the receive, same as recv(2)
+ */
+static void process_input(struct connection *conn, ssize_t result)
+{
+    if (result <= 0) {
+        drop_connection(conn);
+        return;
+    }
+
+    conn->recv_time = latency_now();
+    conn->in_size += (size_t)result;
+    process_requests(conn);
+}
+
+/**
+ * @brief Destroy the closing connection once its output is written
+ * @param conn Connection of the client
+ * @param is_hangup Set if the socket is already closed by the client
+ * @return true if the connection was destroyed, false if not
+ */
+static bool_t try_destroy_connection(struct connection *conn, bool_t is_hangup)
+{
+    if (conn->state != CONNECTION_STATE_CLOSING) {
+        return false;
+    }
+
+    if (!conn->is_broken && !is_hangup && !connection_is_flushed(conn)) {
+        return false;
+    }
+
+    destroy_connection(conn);
+
+    return true;
+}
+
+/**
+ * @brief Handler of client socket events, called by the owning event loop.
+ * @param source Connection of the client
+ * @param events Epoll events of the socket
+ */
+static void on_connection_event(struct event_loop_source *source,
+                                uint32_t events)
+{
+    struct connection *conn = (struct connection *)source;
+
+    /* Completed zero-copy sends wake the socket with EPOLLERR alone */
+    if (conn->is_zerocopy && (events & (EPOLLERR | EPOLLHUP)) == EPOLLERR) {
+        connection_reap_zerocopy(conn);
+        events &= ~(uint32_t)EPOLLERR;
+    }
+
+    if (events & EPOLLOUT) {
+        connection_flush(conn);
+    }
+
+    /*
+     * Read all available requests, the socket is edge-triggered. A paused
+     * connection is rearmed once its peer drains the queue.
+     */
+    while (conn->state != CONNECTION_STATE_CLOSING &&
+           !atomic_load(&conn->is_read_paused) &&
+           (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        if (is_pass_through && conn->state == CONNECTION_STATE_HOST) {
+            read_pass_through(conn);
+            break;
+        }
+
+        if (reserve_input(conn) == -1) {
+            drop_connection(conn);
+            break;
+        }
+
+        ssize_t result =
+            connection_recv(conn, conn->in_buffer + conn->in_size,
+                            conn->in_buffer_size - conn->in_size);
+
+        /* The buffer is returned to the pool until the next request */
+        if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            connection_release_input(conn);
+            break;
+        }
+
+        process_input(conn, result);
+    }
+
+    try_destroy_connection(conn, events & (EPOLLHUP | EPOLLERR));
+}
+
+/**
+ * @brief Handler of data received by io_uring, called by the owning loop.
+ * @param source Connection of the client
+ * @param result Result of the receive
+ * @return true if the loop must receive more data, false if not
+ */
+static bool_t on_connection_recv(struct event_loop_source *source,
+                                 ssize_t result)
+{
+    struct connection *conn = (struct connection *)source;
+
+    /* A short read means the socket is drained, like EAGAIN with epoll */
+    bool_t is_drained =
+        result < (ssize_t)(source->recv_size - source->recv_offset);
+
+    process_input(conn, result);
+
+    /*
+     * A receive is always in flight, so only a large buffer is returned to the
+     * pool and replaced with a small one
+     */
+    if (conn->state != CONNECTION_STATE_CLOSING) {
+        if (is_drained && conn->in_buffer_size > input_buffer_min_size) {
+            connection_release_input(conn);
+        }
+
+        if (reserve_input(conn) == -1) {
+            drop_connection(conn);
+        }
+    }
+
+    source->recv_offset = conn->in_size;
+
+    /* A paused connection is received from again once it is rearmed */
+    return !try_destroy_connection(conn, false) &&
+           conn->state != CONNECTION_STATE_CLOSING &&
+           !atomic_load(&conn->is_read_paused);
+}
+
+/**
+ * @brief Handler of sends completed by io_uring, called by the owning loop.
+ * @param source Connection of the client
+ * @param result Result of the send
+ */
+static void on_connection_send(struct event_loop_source *source,
+                               ssize_t result)
+{
+    struct connection *conn = (struct connection *)source;
+
+    connection_on_send(conn, result);
+    try_destroy_connection(conn, false);
+}
+
+/**
+ * @brief Time passed since an earlier moment
+ * @param since Moment by latency_now()
+ * @param now Current moment by latency_now()
+ * @return Milliseconds passed
+ */
+static uint64_t elapsed_ms(uint64_t since, uint64_t now)
+{
+    return now > since ? (now - since) / 1000000u : 0;
+}
+
+/**
+ * @brief Drop a connection whose client is considered gone
+ * @param conn Connection of the client
+ */
+static void expire_connection(struct connection *conn)
+{
+    drop_connection(conn);
+
+    /* A gone client does not read, so usually nothing is waited for */
+    try_destroy_connection(conn, false);
+}
+
+/**
+ * @brief Check the host of the session of a target
+ * @param conn Connection of the target
+ * @param now Current moment by latency_now()
+ * @return Milliseconds until the next check, 0 if the target is dropped
+ */
+static uint64_t check_orphan(struct connection *conn, uint64_t now)
+{
+    struct session_info *session = conn->session;
+
+    pthread_mutex_lock(&session->lock);
+    uint64_t host_left_time = session->host_left_time;
+    pthread_mutex_unlock(&session->lock);
+
+    /*
+     * The host leaves in its own loop, which cannot move the timer, so a
+     * hosted session is checked a few times per timeout
+     */
+    if (host_left_time == 0) {
+        uint64_t delay = orphan_timeout / orphan_checks_per_timeout;
+        return delay > 0 ? delay : 1;
+    }
+
+    uint64_t orphaned = elapsed_ms(host_left_time, now);
+
+    if (orphaned < orphan_timeout) {
+        return orphan_timeout - orphaned;
+    }
+
+    log_info("Session with id %i has no host for %" PRIu64 " ms, target "
+             "%i dropped",
+             session->id, orphaned, conn->source.fd);
+    stats_add(STATS_ORPHAN_EXPIRIES, 1);
+    expire_connection(conn);
+
+    return 0;
+}
+
+/**
+ * @brief Handler of the connection timer, called by the owning event loop.
+ * Drops clients which sent nothing for the idle timeout, probes idle clients
+ * which answer heartbeats halfway through it and drops targets left without
+ * host for the orphan timeout. Destroys closing connections whose output was
+ * not read for the idle timeout.
+ * @param source Connection of the client
+ */
+static void on_connection_timer(struct event_loop_source *source)
+{
+    struct connection *conn = (struct connection *)source;
+    uint64_t now = latency_now();
+    uint64_t delay = UINT64_MAX;
+
+    if (conn->state == CONNECTION_STATE_CLOSING) {
+        /* Only the timer set by close_connection is left */
+        if (idle_timeout > 0) {
+            log_info("Connection %i did not read its last responses",
+                     source->fd);
+            try_destroy_connection(conn, true);
+        }
+        return;
+    }
+
+    /* A paused client may have sent plenty, it is just not read */
+    if (atomic_load(&conn->is_read_paused)) {
+        conn->recv_time = now;
+    }
+
+    if (idle_timeout > 0) {
+        uint64_t idle = elapsed_ms(conn->recv_time, now);
+        uint64_t probe_after = idle_timeout / 2;
+
+        if (idle >= idle_timeout) {
+            log_info("Connection %i sent nothing for %" PRIu64 " ms, dropped",
+                     source->fd, idle);
+            stats_add(STATS_IDLE_TIMEOUTS, 1);
+            expire_connection(conn);
+            return;
+        }
+
+        delay = idle_timeout - idle;
+
+        /* One probe per idle period, any request answers it */
+        if (conn->is_heartbeat && idle < probe_after) {
+            delay = probe_after - idle;
+        } else if (conn->is_heartbeat && conn->probe_time <= conn->recv_time) {
+            send_empty_response(conn, RESPONSE_HEARTBEAT, conn->session->id);
+            conn->probe_time = now;
+        }
+    }
+
+    if (orphan_timeout > 0 && conn->state == CONNECTION_STATE_TARGET) {
+        uint64_t orphan_delay = check_orphan(conn, now);
+
+        if (orphan_delay == 0) {
+            return;
+        }
+
+        if (orphan_delay < delay) {
+            delay = orphan_delay;
+        }
+    }
+
+    if (delay != UINT64_MAX) {
+        event_loop_set_timer(source, delay);
+    }
+}
+
+/**
+ * @brief Hand over an accepted client to the event loops
+ * @param sockfd Descriptor of the client
+ */
+static void accept_client(int32_t sockfd)
+{
+    /* Several acceptors may race for the last free place */
+    if (atomic_fetch_add(&num_of_connections, 1) >= max_connections) {
+        atomic_fetch_sub(&num_of_connections, 1);
+        log_warning("Too many clients, connection %i rejected", sockfd);
+        stats_add(STATS_CONNECTIONS_REJECTED, 1);
+        close(sockfd);
+        return;
+    }
+
+    struct connection *conn = connection_new(sockfd);
+
+    if (conn == NULL) {
+        log_error("Unable to allocate connection %i", sockfd);
+        atomic_fetch_sub(&num_of_connections, 1);
+        close(sockfd);
+        return;
+    }
+
+    conn->source.handler = on_connection_event;
+    conn->source.on_recv = on_connection_recv;
+    conn->source.on_send = on_connection_send;
+    conn->source.on_timer = on_connection_timer;
+
+    /* A client which never sends anything is idle from the start */
+    conn->source.initial_timeout = idle_timeout;
+    conn->recv_time = latency_now();
+
+    stats_add(STATS_CONNECTIONS_ACCEPTED, 1);
+    stats_add(STATS_CONNECTIONS_ACTIVE, 1);
+
+    conn->in_limit = handshake_request_limit;
+
+    /* Handshake is processed by the loop which takes the connection */
+    if (reserve_input(conn) == -1 ||
+        event_loop_add(&conn->source) == -1) {
+        log_error("Unable to hand over client %i: %s", sockfd,
+                  strerror(errno));
+        destroy_connection(conn);
+    }
+}
+
+/**
+ * @brief Accept clients of a listening socket until the server stops
+ * @param sockfd Listening socket
+ */
+static void accept_clients(int32_t sockfd)
+{
+    /* io_uring needs blocking sockets, see connection_new() */
+    int32_t flags = SOCK_CLOEXEC;
+    if (event_loop_get_backend() == EVENT_LOOP_BACKEND_EPOLL) {
+        flags |= SOCK_NONBLOCK;
+    }
+
+    while (true) {
+        /* Accept call. Create a new socket for the incoming connection */
+        struct sockaddr_storage client_storage;
+        socklen_t addr_size = sizeof(struct sockaddr_storage);
+
+        int32_t new_sd = accept4(sockfd, (struct sockaddr *)&client_storage,
+                                 &addr_size, flags);
+
+        if (new_sd == -1) {
+            if (atomic_load(&is_stopping)) {
+                return;
+            }
+
+            if (errno != EINTR && errno != ECONNABORTED) {
+                log_error("Unable to accept: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        log_debug("Accept client");
+
+        accept_client(new_sd);
+    }
+}
+
+/**
+ * @brief Routine of an acceptor thread
+ * @param arg Listening socket
+ * @return NULL
+ */
+static void *acceptor_routine(void *arg)
+{
+    accept_clients((int32_t)(intptr_t)arg);
+    return NULL;
+}
+
+/**
+ * @brief Create a listening socket
+ * @param server_addr Address to bind
+ * @param backlog Max connection requests queued
+ * @param is_reuse_port Let other sockets listen on the same port, the kernel
+ * spreads incoming connections among them
+ * @return Socket or -1 for errors
+ */
+static int32_t open_listener(const struct sockaddr_in *server_addr,
+                             int32_t backlog, bool_t is_reuse_port)
+{
+    /*
+     * Create the server socket
+     * IP protocol family
+     * Sequenced, reliable, connection-based byte streams
+     * Auto-chosen protocol
+     */
+    int32_t sockfd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd == -1) {
+        log_error("Unable to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    int32_t one = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int32_t));
+
+    if (is_reuse_port &&
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one,
+                   sizeof(int32_t)) == -1) {
+        log_error("Unable to reuse port: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    /* Bind the address struct to the socket */
+    if (bind(sockfd, (const struct sockaddr *)server_addr,
+             sizeof(*server_addr)) == -1) {
+        log_error("Unable to bind: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    /* Listen on the socket, with max connection requests queued */
+    if (listen(sockfd, backlog) == -1) {
+        log_error("Unable to listen: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * @brief Check if the address is already bound by someone else. Sockets with
+ * SO_REUSEPORT of the same user bind the port without errors, so another
+ * server would silently get a share of the clients.
+ * @param server_addr Address to check
+ * @return true if the address is in use, false if not
+ */
+static bool_t is_address_in_use(const struct sockaddr_in *server_addr)
+{
+    int32_t sockfd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd == -1) {
+        return false;
+    }
+
+    /* Same options as listeners without SO_REUSEPORT */
+    int32_t one = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int32_t));
+
+    bool_t is_in_use = bind(sockfd, (const struct sockaddr *)server_addr,
+                            sizeof(*server_addr)) == -1 &&
+                       errno == EADDRINUSE;
+
+    close(sockfd);
+
+    return is_in_use;
+}
+
+/**
+ * @brief Close all listening sockets
+ */
+static void close_listeners(void)
+{
+    for (int32_t i = 0; i < num_of_listeners; i++) {
+        shutdown(listener_fds[i], SHUT_RDWR);
+        close(listener_fds[i]);
+    }
+
+    num_of_listeners = 0;
+}
+
+/**
+ * @brief Write percentiles of the relay and queueing latency to the log
+ */
+static void log_latency(void)
+{
+    static const char_t *path_names[LATENCY_NUM_PATHS] = {
+        [LATENCY_PATH_HOST_DATA] = "host data",
+        [LATENCY_PATH_HOST_EVENT] = "host events",
+        [LATENCY_PATH_TARGET_DATA] = "target data",
+        [LATENCY_PATH_CONTROL_QUEUE] = "control queue",
+        [LATENCY_PATH_BULK_QUEUE] = "bulk queue"};
+
+    for (int32_t path = 0; path < LATENCY_NUM_PATHS; path++) {
+        struct latency_histogram histogram;
+        latency_merge(path, &histogram);
+
+        if (histogram.total == 0) {
+            continue;
+        }
+
+        log_info("Latency of %s: %" PRIu64 " samples, p50 %.1f us, p99 %.1f "
+                 "us, p999 %.1f us, max %.1f us",
+                 path_names[path], histogram.total,
+                 latency_percentile(&histogram, 50) / 1000.0,
+                 latency_percentile(&histogram, 99) / 1000.0,
+                 latency_percentile(&histogram, 99.9) / 1000.0,
+                 histogram.max / 1000.0);
+    }
+}
+
+/**
+ * @brief Routine of the thread which writes the relay latency to the log each
+ * time the server gets SIGUSR1
+ * @param arg Set of signals to wait for
+ * @return NULL
+ */
+static void *latency_dump_routine(void *arg)
+{
+    const sigset_t *signals = arg;
+
+    while (true) {
+        int32_t signal_number;
+
+        if (sigwait(signals, &signal_number) == 0) {
+            log_latency();
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start the thread dumping the relay latency on SIGUSR1. The signal is
+ * blocked in the calling thread and in the threads it starts later, so only
+ * the dumping thread takes it.
+ */
+static void start_latency_dump(void)
+{
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, latency_dump_routine, &signals) != 0) {
+        log_warning("Unable to start the latency dump thread");
+        return;
+    }
+
+    pthread_detach(thread);
+}
+
+noreturn void server_start(const struct server_options *options)
+{
+    const char_t *addr = options->addr;
+    uint16_t port = options->port;
+    int32_t max_clients = options->max_clients;
+
+    log_info("Starting server: %s:%i", addr, port);
+    log_info("Max connections: %i", max_clients);
+
+    is_pass_through = options->is_pass_through;
+    is_compression = options->is_compression;
+    max_targets = options->max_targets;
+
+    if (is_compression) {
+        log_info("Compression of host data is offered to clients");
+    }
+
+    idle_timeout = (uint64_t)options->idle_timeout * 1000u;
+    orphan_timeout = (uint64_t)options->orphan_timeout * 1000u;
+
+    if (idle_timeout > 0) {
+        log_info("Idle timeout: %u s, heartbeats are probed after %u s",
+                 options->idle_timeout, options->idle_timeout / 2);
+    }
+
+    if (orphan_timeout > 0) {
+        log_info("Targets of sessions without host are dropped after %u s",
+                 options->orphan_timeout);
+    }
+
+    start_latency_dump();
+
+    /* Wider ids are limited by the session id field of headers */
+    uint32_t num_of_ids = 1;
+    for (int32_t i = 0; i < options->id_digits; i++) {
+        num_of_ids *= 10;
+
+        if (num_of_ids >= SESSION_ID_MAX_COUNT) {
+            num_of_ids = SESSION_ID_MAX_COUNT;
+            break;
+        }
+    }
+
+    if (session_id_init(num_of_ids) == -1) {
+        log_error("Unable to allocate session ids: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    log_info("Session ids: 0-%u", num_of_ids - 1);
+
+    session_init_table((uint16_t)max_clients);
+    max_connections = max_clients;
+
+    /*
+     * Configure settings of the server address struct
+     * Address family: Internet
+     * Port number, using htons function to use proper byte order
+     * IP address
+     */
+    struct sockaddr_in server_addr = {.sin_family = AF_INET,
+                                      .sin_port = htons(port),
+                                      .sin_addr.s_addr = inet_addr(addr)};
+
+    /* Set all bits of the padding field to 0 */
+    memset(server_addr.sin_zero, 0, sizeof(server_addr.sin_zero));
+
+    int32_t count = options->num_listeners < 1 ? 1 : options->num_listeners;
+    listener_fds = calloc((size_t)count, sizeof(int32_t));
+
+    if (count > 1 && is_address_in_use(&server_addr)) {
+        log_error("Port %i is in use, another server may listen on it",
+                  port);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int32_t i = 0; i < count; i++) {
+        int32_t sockfd = open_listener(&server_addr, max_clients, count > 1);
+
+        if (sockfd == -1) {
+            close_listeners();
+            exit(EXIT_FAILURE);
+        }
+
+        listener_fds[num_of_listeners++] = sockfd;
+    }
+
+    log_info("Listening sockets: %i", count);
+
+    /* Only a server which owns the port may replace the segment of the port */
+    if (stats_init(port, num_of_ids) == -1) {
+        log_warning("Unable to create the stats segment: %s", strerror(errno));
+    }
+
+    /* All client sockets are driven by a small fixed set of loop threads */
+    if (event_loop_start(options->num_workers, options->backend) == -1) {
+        close_listeners();
+        exit(EXIT_FAILURE);
+    }
+
+    /* Splicing needs non-blocking sockets, io_uring sockets are blocking */
+    if (is_pass_through &&
+        event_loop_get_backend() == EVENT_LOOP_BACKEND_URING) {
+        log_warning("Pass-through mode is not supported with io_uring");
+        is_pass_through = false;
+    }
+
+    if (is_pass_through) {
+        log_info("Pass-through mode: host DATA bodies are spliced");
+    }
+
+    /* Completions are read when epoll reports the error queue */
+    if (options->zerocopy_threshold > 0 &&
+        event_loop_get_backend() == EVENT_LOOP_BACKEND_URING) {
+        log_warning("Zero-copy sends are not supported with io_uring");
+    } else if (options->zerocopy_threshold > 0) {
+        connection_set_zerocopy_threshold(options->zerocopy_threshold);
+        log_info("Zero-copy sends: host bodies of at least %zu bytes",
+                 options->zerocopy_threshold);
+    }
+
+    /* The kernel spreads connections among sockets, one acceptor each */
+    for (int32_t i = 1; i < count; i++) {
+        pthread_t thread;
+        intptr_t sockfd = listener_fds[i];
+
+        /* Connections routed to a socket without acceptor would hang */
+        if (pthread_create(&thread, NULL, acceptor_routine,
+                           (void *)sockfd) != 0) {
+            log_error("Unable to start acceptor %i", i);
+            close_listeners();
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_detach(thread);
+    }
+
+    accept_clients(listener_fds[0]);
+
+    /* Wait for exit() called by the stopping thread */
+    while (true) {
+        pause();
+    }
+}
+
+/**
+ * @brief Write statistics of the buffer pool to the log
+ */
+static void log_buffer_pool_stats(void)
+{
+    struct buffer_pool_stats stats[BUFFER_POOL_NUM_CLASSES];
+    buffer_pool_get_stats(stats);
+
+    for (size_t i = 0; i < BUFFER_POOL_NUM_CLASSES; i++) {
+        if (stats[i].hits == 0 && stats[i].misses == 0) {
+            continue;
+        }
+
+        log_info("Buffer pool, %zu bytes: %" PRIu64 " hits, %" PRIu64
+                 " misses, %zu in use, %zu at most",
+                 stats[i].capacity, stats[i].hits, stats[i].misses,
+                 stats[i].in_use, stats[i].high_water);
     }
 }
 
 void server_stop(void)
 {
-    close_sockets();
-    close(server_sockfd);
-    shutdown(server_sockfd, SHUT_RDWR);
-    join_threads();
+    if (num_of_listeners > 0) {
+        atomic_store(&is_stopping, true);
+        log_buffer_pool_stats();
+        log_latency();
+        close_listeners();
+        stats_close();
+    }
+
+    event_loop_stop();
 }
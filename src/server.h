@@ -28,19 +28,50 @@
 #ifndef SERVER_H_
 #define SERVER_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdnoreturn.h>
 
+#include "event_loop.h"
 #include "global.h"
 
+/**
+ * @brief Settings of the remote server
+ */
+struct server_options {
+    /* Server IP address */
+    const char_t *addr;
+    /* Server will listen specified port */
+    uint16_t port;
+    /* Can serve simultaneously clients */
+    int32_t max_clients;
+    /* Mechanism used to drive client sockets */
+    enum event_loop_backend backend;
+    /* Splice bodies of host DATA requests to targets without copying */
+    bool_t is_pass_through;
+    /* Number of decimal digits of session ids */
+    int32_t id_digits;
+    /* Number of event loop threads, one per online CPU if less than 1 */
+    int32_t num_workers;
+    /* Number of SO_REUSEPORT listening sockets, each with an acceptor */
+    int32_t num_listeners;
+    /* Offer compression of host bodies to clients in the handshake */
+    bool_t is_compression;
+    /* Largest number of targets granted to a host which asks for several */
+    int32_t max_targets;
+    /* Smallest host body sent to targets with MSG_ZEROCOPY, 0 to copy all */
+    size_t zerocopy_threshold;
+    /* Seconds without input after which a client is dropped, 0 for never */
+    uint32_t idle_timeout;
+    /* Seconds targets may stay in a session without host, 0 for no limit */
+    uint32_t orphan_timeout;
+};
+
 /**
  * @brief Start remote server
- * @param addr Server IP address
- * @param port Server will listen specified port
- * @param max_clients Can serve simultaneously clients
+ * @param options Server settings
  */
-noreturn void server_start(const char_t *addr, uint16_t port,
-                           int32_t max_clients);
+noreturn void server_start(const struct server_options *options);
 
 /**
  * @brief Stop remote server.
@@ -26,160 +26,405 @@
 
 #include "session.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <string.h>
+#include <sys/types.h>
+
+#include "stats.h"
+
+/* Number of independently locked parts of the table, a power of two */
+#define NUM_SHARDS 64
+
+/* Smallest number of slots of a shard, a power of two */
+#define MIN_SHARD_SLOTS 8
+
+/* Number of slots moved to the new array by each operation during a resize */
+#define MIGRATE_STEP 16
+
+/**
+ * @brief Marks a slot of an array which is being migrated, the session was
+ * moved or removed. Probing continues over it.
+ */
+static struct session_info migrated_item;
 
 /**
- * @brief Internal struct witch represents hash table item
+ * @brief Internal open-addressing array of session pointers
  */
-struct key_value_pair {
-    struct session_info value;
-    int16_t key;
+struct slot_array {
+    struct session_info **slots;
+    /* Number of slots, a power of two */
+    size_t size;
+    /* Binary logarithm of the number of slots */
+    uint32_t bits;
 };
 
 /**
- * @brief Internal hash table array
+ * @brief Internal part of the table with its own lock. While the shard is
+ * resized, sessions are moved from the previous array to the current one a
+ * few slots per operation, so no operation pays for the whole resize.
  */
-static struct key_value_pair **hash_array;
+struct shard {
+    pthread_mutex_t lock;
+    struct slot_array current;
+    /* Array being migrated, its slots are NULL if no resize is in progress */
+    struct slot_array previous;
+    /* Next slot of the previous array to migrate */
+    size_t migrate_index;
+    /* Number of sessions in both arrays */
+    size_t count;
+};
 
 /**
- * @brief Placeholder for removed items
+ * @brief Shards of the table
  */
-static struct key_value_pair *dummy_item;
+static struct shard shards[NUM_SHARDS];
 
 /**
- * @brief Hash table internal array size.
+ * @brief Number of sessions in the table
  */
-static size_t hash_array_size;
+static atomic_size_t num_of_sessions;
 
 /**
- * @brief Generates a hash code for specified key.
- * Values are used to index a hash table.
+ * @brief Generates a hash code for specified key. Multiplicative hashing
+ * spreads close keys over the whole range.
  * @param key Specified key
  * @return Hash
  */
-static int16_t hash_code(int16_t key)
+static uint32_t hash_code(uint16_t key)
+{
+    return (uint32_t)key * 2654435769u;
+}
+
+/**
+ * @brief Get the shard which stores the key
+ * @param hash Hash of the key
+ * @return Shard
+ */
+static struct shard *get_shard(uint32_t hash)
 {
-    return key % (int16_t)hash_array_size;
+    /* Low bits select the shard, high bits select the slot */
+    return &shards[hash & (NUM_SHARDS - 1)];
+}
+
+/**
+ * @brief Get the first slot to probe for the key
+ * @param array Slot array
+ * @param hash Hash of the key
+ * @return Slot index
+ */
+static size_t home_index(const struct slot_array *array, uint32_t hash)
+{
+    return array->bits == 0 ? 0 : hash >> (32 - array->bits);
+}
+
+/**
+ * @brief Allocate an empty slot array
+ * @param array Array to initialize
+ * @param size Number of slots, a power of two
+ * @return 0 for success or -1 for errors
+ */
+static int32_t alloc_array(struct slot_array *array, size_t size)
+{
+    array->slots = calloc(size, sizeof(struct session_info *));
+
+    if (array->slots == NULL) {
+        return -1;
+    }
+
+    array->size = size;
+    array->bits = 0;
+
+    while (((size_t)1 << array->bits) < size) {
+        array->bits++;
+    }
+
+    return 0;
 }
 
 /**
- * @brief Search key_value_pair in hash table by key
+ * @brief Search session in a slot array by key
+ * @param array Slot array
  * @param key Specified key
- * @return Pointer to hash table item
+ * @param hash Hash of the key
+ * @return Index of the slot or -1 if the key is not found
  */
-static struct key_value_pair *find_item(int16_t key)
+static ssize_t find_slot(const struct slot_array *array, uint16_t key,
+                         uint32_t hash)
 {
-    /* Get the hash */
-    int hash_index = hash_code(key);
+    if (array->slots == NULL) {
+        return -1;
+    }
 
-    /* Move in array until an empty */
-    while (hash_array[hash_index] != NULL) {
-        if (hash_array[hash_index]->key == key)
-            return hash_array[hash_index];
+    size_t mask = array->size - 1;
 
-        /* Go to next cell */
-        ++hash_index;
+    /* Move in array until an empty */
+    for (size_t i = home_index(array, hash); array->slots[i] != NULL;
+         i = (i + 1) & mask) {
+        struct session_info *item = array->slots[i];
 
-        /* Wrap around the table */
-        hash_index %= hash_array_size;
+        if (item != &migrated_item && item->id == key) {
+            return (ssize_t)i;
+        }
     }
 
-    return NULL;
+    return -1;
 }
 
 /**
- * @brief Put new key_value_pair item to hash table
- * @param key Item key.
- * @param data Item Value.
+ * @brief Put session to the first empty slot of the probe sequence, the array
+ * must have an empty slot
+ * @param array Slot array
+ * @param session Session to store
  */
-static void insert_item(int16_t key, struct session_info data)
+static void insert_slot(struct slot_array *array, struct session_info *session)
 {
-    struct key_value_pair *item = malloc(sizeof(struct key_value_pair));
-    item->value = data;
-    item->key = key;
+    size_t mask = array->size - 1;
+    size_t i = home_index(array, hash_code(session->id));
 
-    /* Get the hash */
-    int hash_index = hash_code(key);
+    while (array->slots[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+
+    array->slots[i] = session;
+}
+
+/**
+ * @brief Remove session from the current array. Following sessions of the
+ * cluster are shifted back, so no placeholder is left behind and probing
+ * never slows down with the number of removed sessions.
+ * @param array Slot array
+ * @param index Slot of the session
+ */
+static void remove_slot(struct slot_array *array, size_t index)
+{
+    size_t mask = array->size - 1;
+    size_t hole = index;
 
-    /* Move in array until an empty or deleted cell */
-    while (hash_array[hash_index] != NULL &&
-           hash_array[hash_index] != dummy_item) {
-        /* Go to next cell */
-        ++hash_index;
+    for (size_t i = (index + 1) & mask; array->slots[i] != NULL;
+         i = (i + 1) & mask) {
+        size_t home = home_index(array, hash_code(array->slots[i]->id));
 
-        /* Wrap around the table */
-        hash_index %= hash_array_size;
+        /* The item may fill the hole if the hole lies between home and i */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            array->slots[hole] = array->slots[i];
+            hole = i;
+        }
     }
 
-    hash_array[hash_index] = item;
+    array->slots[hole] = NULL;
 }
 
 /**
- * @brief Remove key_value_pair from hash table
- * @param item Pointer to key_value_pair which must be removed from hash table
- * @return Pointer to same key_value_pair or
- * NULL if pair not exists in hash table
+ * @brief Move up to count slots of the previous array to the current one and
+ * free the previous array once it is migrated
+ * @param shard Shard
+ * @param count Number of slots to migrate
  */
-static struct key_value_pair *remove_item(struct key_value_pair *item)
+static void migrate(struct shard *shard, size_t count)
 {
-    int16_t key = item->key;
+    struct slot_array *previous = &shard->previous;
 
-    /* Get the hash */
-    int16_t hash_index = hash_code(key);
+    while (previous->slots != NULL && count > 0) {
+        struct session_info **slot = &previous->slots[shard->migrate_index];
 
-    /* Move in array until an empty */
-    while (hash_array[hash_index] != NULL) {
-        if (hash_array[hash_index]->key == key) {
-            struct key_value_pair *temp = hash_array[hash_index];
+        if (*slot != NULL && *slot != &migrated_item) {
+            insert_slot(&shard->current, *slot);
+            *slot = &migrated_item;
+        }
 
-            /* Assign a dummy item at deleted position */
-            hash_array[hash_index] = dummy_item;
-            return temp;
+        shard->migrate_index++;
+        count--;
+
+        if (shard->migrate_index == previous->size) {
+            free(previous->slots);
+            previous->slots = NULL;
         }
+    }
+}
 
-        /* Go to next cell */
-        ++hash_index;
+/**
+ * @brief Start moving the sessions of the shard to an array of another size.
+ * A resize which is still in progress is finished first.
+ * @param shard Shard
+ * @param size New number of slots
+ */
+static void start_resize(struct shard *shard, size_t size)
+{
+    migrate(shard, SIZE_MAX);
 
-        /* Wrap around the table */
-        hash_index %= hash_array_size;
+    struct slot_array array;
+
+    /* Without memory the shard keeps its array, it is still usable */
+    if (alloc_array(&array, size) == -1) {
+        return;
     }
 
-    return NULL;
+    shard->previous = shard->current;
+    shard->current = array;
+    shard->migrate_index = 0;
+}
+
+/**
+ * @brief Search session in both arrays of the shard
+ * @param shard Shard
+ * @param key Specified key
+ * @param hash Hash of the key
+ * @return Pointer to session or NULL
+ */
+static struct session_info *find_item(struct shard *shard, uint16_t key,
+                                      uint32_t hash)
+{
+    ssize_t index = find_slot(&shard->current, key, hash);
+
+    if (index != -1) {
+        return shard->current.slots[index];
+    }
+
+    index = find_slot(&shard->previous, key, hash);
+
+    return index == -1 ? NULL : shard->previous.slots[index];
 }
 
 bool_t session_is_exist(uint16_t id)
 {
-    return session_get(id) != NULL;
+    uint32_t hash = hash_code(id);
+    struct shard *shard = get_shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    bool_t result = find_item(shard, id, hash) != NULL;
+    pthread_mutex_unlock(&shard->lock);
+
+    return result;
 }
 
-struct session_info *session_get(uint16_t id)
+struct session_info *session_acquire(uint16_t id)
 {
-    struct key_value_pair *pair = find_item(id);
+    uint32_t hash = hash_code(id);
+    struct shard *shard = get_shard(hash);
 
-    if (pair == NULL) {
-        return NULL;
+    pthread_mutex_lock(&shard->lock);
+
+    struct session_info *session = find_item(shard, id, hash);
+
+    /* Locked before the shard is unlocked, so it cannot be removed */
+    if (session != NULL) {
+        pthread_mutex_lock(&session->lock);
     }
-    return &(pair->value);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return session;
 }
 
-void session_add(struct session_info session, uint16_t id)
+struct session_info *session_add(uint16_t id)
 {
-    insert_item(id, session);
+    uint32_t hash = hash_code(id);
+    struct shard *shard = get_shard(hash);
+    struct session_info *session = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+
+    migrate(shard, MIGRATE_STEP);
+
+    if (find_item(shard, id, hash) != NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        errno = EEXIST;
+        return NULL;
+    }
+
+    if ((shard->count + 1) * 4 > shard->current.size * 3) {
+        start_resize(shard, shard->current.size * 2);
+    }
+
+    /* At least one slot stays empty, so probing always stops */
+    if (shard->count + 1 < shard->current.size) {
+        session = calloc(1, sizeof(struct session_info));
+    } else {
+        errno = ENOMEM;
+    }
+
+    if (session != NULL) {
+        session->id = id;
+        pthread_mutex_init(&session->lock, NULL);
+
+        insert_slot(&shard->current, session);
+        shard->count++;
+        atomic_fetch_add(&num_of_sessions, 1);
+
+        stats_session_open(id);
+        stats_add(STATS_SESSIONS_CREATED, 1);
+        stats_add(STATS_SESSIONS_ACTIVE, 1);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return session;
 }
 
-void session_remove(uint16_t id)
+void session_remove(struct session_info *session)
 {
-    struct key_value_pair *pair = find_item(id);
-    free(remove_item(pair));
+    uint32_t hash = hash_code(session->id);
+    struct shard *shard = get_shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    migrate(shard, MIGRATE_STEP);
+
+    ssize_t index = find_slot(&shard->current, session->id, hash);
+
+    if (index != -1) {
+        remove_slot(&shard->current, (size_t)index);
+    } else {
+        /* Probing in the previous array continues over the placeholder */
+        index = find_slot(&shard->previous, session->id, hash);
+
+        if (index != -1) {
+            shard->previous.slots[index] = &migrated_item;
+        }
+    }
+
+    shard->count--;
+    atomic_fetch_sub(&num_of_sessions, 1);
+
+    stats_session_close(session->id);
+    stats_add(STATS_SESSIONS_ACTIVE, -1);
+
+    if (shard->current.size > MIN_SHARD_SLOTS &&
+        shard->count * 8 < shard->current.size) {
+        start_resize(shard, shard->current.size / 2);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    /* Wait for threads which acquired the session before it was removed */
+    pthread_mutex_lock(&session->lock);
+    pthread_mutex_unlock(&session->lock);
+
+    pthread_mutex_destroy(&session->lock);
+    free(session);
 }
 
 void session_init_table(uint16_t max_sessions)
 {
-    hash_array_size = max_sessions;
-    hash_array = calloc(hash_array_size, sizeof(struct key_value_pair *));
+    size_t size = MIN_SHARD_SLOTS;
+
+    /* Room for the expected sessions at three quarters load */
+    while (size * 3 < (size_t)max_sessions * 4 / NUM_SHARDS) {
+        size *= 2;
+    }
+
+    for (size_t i = 0; i < NUM_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        alloc_array(&shards[i].current, size);
+    }
 
-    dummy_item = malloc(sizeof(struct key_value_pair));
-    dummy_item->key = -1;
+    atomic_init(&num_of_sessions, 0);
+}
+
+size_t session_count(void)
+{
+    return atomic_load(&num_of_sessions);
 }
@@ -27,44 +27,84 @@
 #ifndef SESSION_H_
 #define SESSION_H_
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "global.h"
+#include "protocol.h"
+
+struct connection;
 
 /**
- * @brief Struct which contain state of pair communication session
+ * @brief Struct which contain state of communication session of a host with
+ * its targets
  */
 struct session_info {
     uint16_t id;
-    bool_t is_host_connected;
-    bool_t is_target_connected;
-    int32_t host_sockfd;
-    int32_t target_sockfd;
+    /* Protects connections of the session, since they run in different loops */
+    pthread_mutex_t lock;
+    /* Connection of the host, NULL if the host has left the session */
+    struct connection *host_connection;
+    /* When the host left, by latency_now(), 0 while it is connected */
+    uint64_t host_left_time;
+    /* Connected targets linked by next_target, NULL if there are none */
+    struct connection *targets;
+    uint16_t num_targets;
+    /* Number of targets allowed to join, granted to the host */
+    uint16_t max_targets;
+    /* Id given to the next target which joins */
+    uint16_t next_target_id;
+    /* Set if traffic of targets is sent to the host with their ids */
+    bool_t is_fan_out;
+    /* Transmission policy chosen by the host */
+    enum transmission_mode transmission;
+    /* Set while host bodies are coalesced, targets are corked meanwhile */
+    bool_t is_bulk;
+    /* Moving average of host body sizes, drives TRANSMISSION_AUTO */
+    size_t avg_body_size;
+    /* Set when both sides have left, the session is about to be removed */
+    bool_t is_closed;
+    /* Original and compressed sizes of compressed bodies relayed */
+    uint64_t raw_bytes;
+    uint64_t compressed_bytes;
+    /* CPU time spent compressing and decompressing bodies, in ns */
+    uint64_t codec_time;
+    /* Sizes of bodies replaced by deltas and of the deltas */
+    uint64_t delta_raw_bytes;
+    uint64_t delta_bytes;
 };
 
 /**
- * @brief Get session by specified id
+ * @brief Get session by specified id and lock it. The session cannot be
+ * removed while it is locked. Can be called from any thread.
  * @param id Id number of session
- * @return Pointer to requested session
+ * @return Pointer to requested session with its lock held or NULL if no
+ * session with the id exists
  */
-struct session_info *session_get(uint16_t id);
+extern struct session_info *session_acquire(uint16_t id);
 
 /**
- * @brief Add new session with specified id
- * @param session Session to store
+ * @brief Create a new session with specified id. Can be called from any
+ * thread.
  * @param id Id of session
+ * @return New session with no connections or NULL for errors, errno is set to
+ * EEXIST if the id is taken
  */
-extern void session_add(struct session_info session, uint16_t id);
+extern struct session_info *session_add(uint16_t id);
 
 /**
- * @brief Remove session by id. If session not found does nothing.
- * @param id Id of session
+ * @brief Remove the session and free it. The session must be closed, so that
+ * nobody attaches to it anymore, and must not be locked by the caller. Can be
+ * called from any thread.
+ * @param session Session to remove
  */
-extern void session_remove(uint16_t id);
+extern void session_remove(struct session_info *session);
 
 /**
- * @brief Initialize sessions table to store max_sessions
- * @param max_sessions Max number of sessions which server supports
+ * @brief Initialize sessions table
+ * @param max_sessions Expected number of sessions, the table grows and shrinks
+ * with the actual number
  */
 extern void session_init_table(uint16_t max_sessions);
 
@@ -75,4 +115,10 @@ extern void session_init_table(uint16_t max_sessions);
  */
 extern bool_t session_is_exist(uint16_t id);
 
+/**
+ * @brief Get the number of sessions in the table
+ * @return Number of sessions
+ */
+extern size_t session_count(void);
+
 #endif /* SESSION_H_ */
@@ -0,0 +1,190 @@
+/**
+ * @file session_id.c
+ * @brief This file contains definitions for the allocator of session
+ * identifiers.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "session_id.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "global.h"
+#include "log.h"
+
+/* Number of random words fetched from the kernel at once */
+#define RANDOM_POOL_SIZE 64
+
+/**
+ * @brief Free identifiers, the first num_of_free elements are free. An
+ * identifier is taken by swapping a random free element to the end of the
+ * free part.
+ */
+static uint16_t *free_ids;
+
+/**
+ * @brief Number of free identifiers
+ */
+static uint32_t num_of_free;
+
+/**
+ * @brief Protects free identifiers and random words
+ */
+static pthread_mutex_t id_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Random words from the kernel, used from the end
+ */
+static uint32_t random_pool[RANDOM_POOL_SIZE];
+
+/**
+ * @brief Number of unused random words
+ */
+static size_t random_left;
+
+/**
+ * @brief State of the fallback generator, used if the kernel cannot provide
+ * random words
+ */
+static uint32_t fallback_state;
+
+/**
+ * @brief Set once the fallback generator is used
+ */
+static bool_t is_fallback_used;
+
+/**
+ * @brief Get the next random word, the caller must hold the lock
+ * @return Random word
+ */
+static uint32_t next_random(void)
+{
+    if (random_left == 0) {
+        ssize_t result = getrandom(random_pool, sizeof(random_pool), 0);
+
+        if (result == (ssize_t)sizeof(random_pool)) {
+            random_left = RANDOM_POOL_SIZE;
+        }
+    }
+
+    if (random_left > 0) {
+        return random_pool[--random_left];
+    }
+
+    if (!is_fallback_used) {
+        log_warning("Unable to get random numbers, session ids become "
+                    "predictable: %s",
+                    strerror(errno));
+        is_fallback_used = true;
+    }
+
+    /* Xorshift, predictable, but keeps the server working */
+    fallback_state ^= fallback_state << 13;
+    fallback_state ^= fallback_state >> 17;
+    fallback_state ^= fallback_state << 5;
+
+    return fallback_state;
+}
+
+/**
+ * @brief Get a uniformly distributed random number, the caller must hold the
+ * lock
+ * @param bound Upper bound, must not be 0
+ * @return Number from 0 to bound - 1
+ */
+static uint32_t random_below(uint32_t bound)
+{
+    /* Words below the threshold would make small numbers more likely */
+    uint32_t threshold = -bound % bound;
+    uint32_t value;
+
+    do {
+        value = next_random();
+    } while (value < threshold);
+
+    return value % bound;
+}
+
+int32_t session_id_init(uint32_t count)
+{
+    if (count == 0 || count > SESSION_ID_MAX_COUNT) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint16_t *ids = malloc(count * sizeof(uint16_t));
+
+    if (ids == NULL) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        ids[i] = (uint16_t)i;
+    }
+
+    pthread_mutex_lock(&id_lock);
+
+    free(free_ids);
+    free_ids = ids;
+    num_of_free = count;
+    fallback_state = ((uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16)) | 1;
+
+    pthread_mutex_unlock(&id_lock);
+
+    return 0;
+}
+
+int32_t session_id_alloc(uint16_t *id)
+{
+    pthread_mutex_lock(&id_lock);
+
+    if (num_of_free == 0) {
+        pthread_mutex_unlock(&id_lock);
+        return -1;
+    }
+
+    uint32_t index = random_below(num_of_free);
+    uint32_t last = --num_of_free;
+
+    *id = free_ids[index];
+    free_ids[index] = free_ids[last];
+
+    pthread_mutex_unlock(&id_lock);
+
+    return 0;
+}
+
+void session_id_release(uint16_t id)
+{
+    pthread_mutex_lock(&id_lock);
+    free_ids[num_of_free++] = id;
+    pthread_mutex_unlock(&id_lock);
+}
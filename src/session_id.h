@@ -0,0 +1,66 @@
+/**
+ * @file session_id.h
+ * @brief This file contains declarations for the allocator of session
+ * identifiers.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef SESSION_ID_H_
+#define SESSION_ID_H_
+
+#include <stdint.h>
+
+#include "global.h"
+
+/*
+ * Largest number of identifiers, limited by the 16-bit session id field of
+ * headers of all versions
+ */
+#define SESSION_ID_MAX_COUNT 65536
+
+/* Largest useful number of decimal digits, 10^5 ids exceed the count */
+#define SESSION_ID_MAX_DIGITS 5
+
+/**
+ * @brief Initialize the allocator with identifiers from 0 to count - 1
+ * @param count Number of identifiers, at most SESSION_ID_MAX_COUNT
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t session_id_init(uint32_t count);
+
+/**
+ * @brief Take a free identifier chosen at random, so identifiers of sessions
+ * cannot be guessed. Takes constant time and can be called from any thread.
+ * @param id Set to the allocated identifier
+ * @return 0 for success or -1 if all identifiers are in use
+ */
+extern int32_t session_id_alloc(uint16_t *id);
+
+/**
+ * @brief Return an identifier taken by session_id_alloc. Takes constant time
+ * and can be called from any thread.
+ * @param id Identifier
+ */
+extern void session_id_release(uint16_t id);
+
+#endif /* SESSION_ID_H_ */
@@ -0,0 +1,73 @@
+/**
+ * @file shared_buffer.c
+ * @brief This file contains reference counted buffers which hold bodies sent
+ * to several connections.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "shared_buffer.h"
+
+#include <stdatomic.h>
+
+#include "buffer_pool.h"
+
+struct shared_buffer *shared_buffer_alloc(size_t size, size_t *capacity)
+{
+    size_t buffer_size;
+    struct shared_buffer *buffer =
+        buffer_pool_get(sizeof(struct shared_buffer) + size, &buffer_size);
+
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    atomic_init(&buffer->refs, 1);
+    buffer->size = buffer_size - sizeof(struct shared_buffer);
+
+    if (capacity != NULL) {
+        *capacity = buffer->size;
+    }
+
+    return buffer;
+}
+
+struct shared_buffer *shared_buffer_ref(struct shared_buffer *buffer)
+{
+    atomic_fetch_add(&buffer->refs, 1);
+
+    return buffer;
+}
+
+bool_t shared_buffer_is_shared(struct shared_buffer *buffer)
+{
+    return atomic_load(&buffer->refs) > 1;
+}
+
+void shared_buffer_unref(struct shared_buffer *buffer)
+{
+    if (buffer == NULL || atomic_fetch_sub(&buffer->refs, 1) != 1) {
+        return;
+    }
+
+    buffer_pool_put(buffer);
+}
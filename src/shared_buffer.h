@@ -0,0 +1,78 @@
+/**
+ * @file shared_buffer.h
+ * @brief This file contains declarations for reference counted buffers which
+ * hold bodies sent to several connections.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef SHARED_BUFFER_H_
+#define SHARED_BUFFER_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "global.h"
+
+/**
+ * @brief Reference counted buffer of bodies. Outbound queues of all receivers
+ * and zero-copy sends reference the same bytes, which are returned to the
+ * pool with the last reference.
+ */
+struct shared_buffer {
+    atomic_int refs;
+    /* Capacity of the data */
+    size_t size;
+    uint8_t data[];
+};
+
+/**
+ * @brief Borrow a shared buffer from the pool
+ * @param size Minimum capacity
+ * @param capacity Set to the actual capacity if not NULL
+ * @return New buffer with one reference or NULL for errors
+ */
+extern struct shared_buffer *shared_buffer_alloc(size_t size,
+                                                 size_t *capacity);
+
+/**
+ * @brief Take a reference to the buffer
+ * @param buffer Buffer
+ * @return Same buffer
+ */
+extern struct shared_buffer *shared_buffer_ref(struct shared_buffer *buffer);
+
+/**
+ * @brief Check whether anybody but the caller references the buffer
+ * @param buffer Buffer referenced by the caller
+ * @return true if the data must not be changed, false if not
+ */
+extern bool_t shared_buffer_is_shared(struct shared_buffer *buffer);
+
+/**
+ * @brief Drop a reference, the buffer is freed with the last one
+ * @param buffer Buffer, NULL is ignored
+ */
+extern void shared_buffer_unref(struct shared_buffer *buffer);
+
+#endif /* SHARED_BUFFER_H_ */
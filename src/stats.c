@@ -0,0 +1,223 @@
+/**
+ * @file stats.c
+ * @brief This file contains definitions of functions updating the live
+ * counters of the server in the shared memory segment.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "global.h"
+#include "protocol.h"
+
+/* Segment of the server, NULL until it is created */
+static struct stats_segment *segment;
+
+static char_t segment_name[64];
+
+/**
+ * @brief Check if the segment was created by a process which still runs
+ * @return true if the segment belongs to a running server, false if not
+ */
+static bool_t is_segment_in_use(void)
+{
+    int32_t fd = shm_open(segment_name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1) {
+        return false;
+    }
+
+    char_t magic[sizeof(STATS_SEGMENT_MAGIC)];
+    int64_t pid;
+    bool_t is_read =
+        pread(fd, magic, sizeof(magic),
+              offsetof(struct stats_segment, magic)) == sizeof(magic) &&
+        pread(fd, &pid, sizeof(pid), offsetof(struct stats_segment, pid)) ==
+            sizeof(pid);
+
+    close(fd);
+
+    if (!is_read || memcmp(magic, STATS_SEGMENT_MAGIC, sizeof(magic)) != 0) {
+        return false;
+    }
+
+    /* EPERM means the process exists but belongs to another user */
+    return pid != getpid() && (kill((pid_t)pid, 0) == 0 || errno == EPERM);
+}
+
+int32_t stats_init(uint16_t port, uint32_t num_sessions)
+{
+    snprintf(segment_name, sizeof(segment_name), STATS_SEGMENT_NAME_FORMAT,
+             port);
+
+    size_t size = sizeof(struct stats_segment) +
+                  num_sessions * sizeof(struct stats_session);
+
+    if (is_segment_in_use()) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    /* A segment left by a crashed server is replaced */
+    int32_t fd = shm_open(segment_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                          0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (ftruncate(fd, (off_t)size) == -1) {
+        int32_t error = errno;
+        close(fd);
+        shm_unlink(segment_name);
+        errno = error;
+        return -1;
+    }
+
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (memory == MAP_FAILED) {
+        int32_t error = errno;
+        shm_unlink(segment_name);
+        errno = error;
+        return -1;
+    }
+
+    /* The new segment is filled with zeros */
+    struct stats_segment *new_segment = memory;
+    new_segment->version = STATS_SEGMENT_VERSION;
+    new_segment->num_sessions = num_sessions;
+    new_segment->pid = getpid();
+    new_segment->start_time = time(NULL);
+
+    /* Readers check the magic last */
+    atomic_thread_fence(memory_order_release);
+    memcpy(new_segment->magic, STATS_SEGMENT_MAGIC,
+           sizeof(STATS_SEGMENT_MAGIC));
+
+    segment = new_segment;
+
+    return 0;
+}
+
+void stats_close(void)
+{
+    if (segment != NULL) {
+        shm_unlink(segment_name);
+    }
+}
+
+void stats_add(enum stats_counter counter, int64_t value)
+{
+    if (segment == NULL) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&segment->counters[counter], value,
+                              memory_order_relaxed);
+}
+
+void stats_session_open(uint16_t id)
+{
+    if (segment == NULL || id >= segment->num_sessions) {
+        return;
+    }
+
+    struct stats_session *session = &segment->sessions[id];
+
+    for (size_t i = 0; i < STATS_NUM_ROLES; i++) {
+        atomic_store_explicit(&session->requests[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&session->bytes[i], 0, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&session->raw_bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&session->compressed_bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&session->codec_time, 0, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&session->generation, 1, memory_order_release);
+}
+
+void stats_session_close(uint16_t id)
+{
+    if (segment == NULL || id >= segment->num_sessions) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&segment->sessions[id].generation, 1,
+                              memory_order_release);
+}
+
+void stats_add_request(enum request_type type, size_t size)
+{
+    if (segment == NULL || type >= STATS_NUM_REQUEST_TYPES) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&segment->requests[type], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&segment->request_bytes[type], size,
+                              memory_order_relaxed);
+}
+
+void stats_add_session_request(uint16_t id, enum role role, size_t size)
+{
+    if (segment == NULL || id >= segment->num_sessions ||
+        role >= STATS_NUM_ROLES) {
+        return;
+    }
+
+    struct stats_session *session = &segment->sessions[id];
+
+    atomic_fetch_add_explicit(&session->requests[role], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&session->bytes[role], size,
+                              memory_order_relaxed);
+}
+
+void stats_add_session_compression(uint16_t id, size_t raw_size,
+                                   size_t compressed_size, uint64_t time)
+{
+    if (segment == NULL || id >= segment->num_sessions) {
+        return;
+    }
+
+    struct stats_session *session = &segment->sessions[id];
+
+    atomic_fetch_add_explicit(&session->raw_bytes, raw_size,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&session->compressed_bytes, compressed_size,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&session->codec_time, time, memory_order_relaxed);
+}
@@ -0,0 +1,178 @@
+/**
+ * @file stats.h
+ * @brief This file contains declarations for the live counters of the server
+ * kept in a shared memory segment, which is read by baltmonitor-top.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "global.h"
+#include "protocol.h"
+
+/* Name of the segment of the server listening the port, see shm_open(3) */
+#define STATS_SEGMENT_NAME_FORMAT "/baltmonitor-remote.%u"
+
+#define STATS_SEGMENT_MAGIC "BMSTATS"
+#define STATS_SEGMENT_VERSION 4
+
+/* Number of request types, see enum request_type */
+#define STATS_NUM_REQUEST_TYPES (REQUEST_HEARTBEAT + 1)
+
+/* Number of client roles, see enum role */
+#define STATS_NUM_ROLES (ROLE_TARGET + 1)
+
+/**
+ * @brief Counters of the server
+ */
+enum stats_counter {
+    STATS_CONNECTIONS_ACCEPTED,
+    STATS_CONNECTIONS_REJECTED,
+    STATS_CONNECTIONS_ACTIVE,
+    STATS_SESSIONS_CREATED,
+    STATS_SESSIONS_ACTIVE,
+    STATS_BAD_REQUESTS,
+    STATS_SEND_ERRORS,
+    /* Sends of bodies with MSG_ZEROCOPY */
+    STATS_ZEROCOPY_SENDS,
+    /* Zero-copy sends completed without copying */
+    STATS_ZEROCOPY_COMPLETED,
+    /* Zero-copy sends which the kernel copied anyway or refused */
+    STATS_ZEROCOPY_COPIED,
+    /* Connections dropped after no input for the idle timeout */
+    STATS_IDLE_TIMEOUTS,
+    /* Targets dropped because their session had no host for too long */
+    STATS_ORPHAN_EXPIRIES,
+    STATS_NUM_COUNTERS
+};
+
+/**
+ * @brief Counters of the session with the id equal to the index of the slot
+ */
+struct stats_session {
+    /* Incremented when a session opens and closes, odd while it is open */
+    atomic_uint_least32_t generation;
+    /* Requests and their bytes by the role of the sender */
+    atomic_uint_least64_t requests[STATS_NUM_ROLES];
+    atomic_uint_least64_t bytes[STATS_NUM_ROLES];
+    /* Original and compressed sizes of compressed bodies relayed */
+    atomic_uint_least64_t raw_bytes;
+    atomic_uint_least64_t compressed_bytes;
+    /* CPU time the server spent compressing and decompressing, in ns */
+    atomic_uint_least64_t codec_time;
+};
+
+/**
+ * @brief Layout of the shared memory segment. The server only updates the
+ * counters with relaxed atomics, readers get a consistent value of each
+ * counter but not a snapshot of all of them.
+ */
+struct stats_segment {
+    char_t magic[8];
+    uint32_t version;
+    /* Number of session slots, one per possible session id */
+    uint32_t num_sessions;
+    int64_t pid;
+    /* Realtime clock when the server started, in seconds */
+    int64_t start_time;
+    _Alignas(64) atomic_int_least64_t counters[STATS_NUM_COUNTERS];
+    /* Requests and their bytes by type, including handshakes */
+    _Alignas(64) atomic_uint_least64_t requests[STATS_NUM_REQUEST_TYPES];
+    atomic_uint_least64_t request_bytes[STATS_NUM_REQUEST_TYPES];
+    _Alignas(64) struct stats_session sessions[];
+};
+
+/**
+ * @brief Create the segment. Counters are not kept until it is created. A
+ * segment left by a server which is gone is replaced, the segment of a
+ * running server is never touched.
+ * @param port Port of the server, names the segment
+ * @param num_sessions Number of session ids
+ * @return 0 for success or -1 for errors, errno is EADDRINUSE if a running
+ * server owns the segment
+ */
+extern int32_t stats_init(uint16_t port, uint32_t num_sessions);
+
+/**
+ * @brief Remove the name of the segment, the counters stay mapped until the
+ * server exits
+ */
+extern void stats_close(void);
+
+/**
+ * @brief Add a value to a counter of the server. Can be called from any
+ * thread.
+ * @param counter Counter
+ * @param value Value, negative to decrease the counter
+ */
+extern void stats_add(enum stats_counter counter, int64_t value);
+
+/**
+ * @brief Reset the counters of a new session. Can be called from any thread.
+ * @param id Session id
+ */
+extern void stats_session_open(uint16_t id);
+
+/**
+ * @brief Mark the counters of a session as unused. Can be called from any
+ * thread.
+ * @param id Session id
+ */
+extern void stats_session_close(uint16_t id);
+
+/**
+ * @brief Count a request received by the server. Can be called from any
+ * thread.
+ * @param type Type of the request
+ * @param size Size of the request including the header
+ */
+extern void stats_add_request(enum request_type type, size_t size);
+
+/**
+ * @brief Count a request received within an open session. Can be called from
+ * any thread.
+ * @param id Session id
+ * @param role Role of the sender
+ * @param size Size of the request including the header
+ */
+extern void stats_add_session_request(uint16_t id, enum role role,
+                                      size_t size);
+
+/**
+ * @brief Count a compressed body relayed within an open session. Can be
+ * called from any thread.
+ * @param id Session id
+ * @param raw_size Original size of the body
+ * @param compressed_size Compressed size of the body
+ * @param time CPU time spent by the server on the codec, in ns
+ */
+extern void stats_add_session_compression(uint16_t id, size_t raw_size,
+                                          size_t compressed_size,
+                                          uint64_t time);
+
+#endif /* STATS_H_ */
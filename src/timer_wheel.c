@@ -0,0 +1,192 @@
+/**
+ * @file timer_wheel.c
+ * @brief This file contains the implementation of the hierarchical timer wheel.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "timer_wheel.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "global.h"
+
+#define SLOT_MASK (TIMER_WHEEL_NUM_SLOTS - 1)
+
+/* Ticks covered by all levels */
+#define WHEEL_SPAN (1ULL << (TIMER_WHEEL_LEVEL_BITS * TIMER_WHEEL_NUM_LEVELS))
+
+/**
+ * @brief Put a timer into the slot of its expiry tick, on the lowest level
+ * whose slots still separate it from the current tick
+ * @param wheel Wheel
+ * @param timer Timer which expires not earlier than the next tick
+ */
+static void link_timer(struct timer_wheel *wheel, struct timer *timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+    uint64_t expires = timer->expires;
+    int32_t level = 0;
+
+    while (level < TIMER_WHEEL_NUM_LEVELS - 1 &&
+           delta >= 1ULL << (TIMER_WHEEL_LEVEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    /* Too far timers wait in the farthest slot and are put back from it */
+    if (delta >= WHEEL_SPAN) {
+        expires = wheel->now + WHEEL_SPAN - 1;
+    }
+
+    struct timer **slot =
+        &wheel->slots[level][(expires >> (TIMER_WHEEL_LEVEL_BITS * level)) &
+                             SLOT_MASK];
+
+    timer->next = *slot;
+    timer->prev = slot;
+
+    if (*slot != NULL) {
+        (*slot)->prev = &timer->next;
+    }
+
+    *slot = timer;
+}
+
+/**
+ * @brief Unlink a pending timer from its list
+ * @param wheel Wheel
+ * @param timer Pending timer
+ */
+static void unlink_timer(struct timer_wheel *wheel, struct timer *timer)
+{
+    *timer->prev = timer->next;
+
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+
+    timer->next = NULL;
+    timer->prev = NULL;
+    wheel->count--;
+}
+
+/**
+ * @brief Move timers of a slot to lower levels
+ * @param wheel Wheel
+ * @param level Level of the slot
+ * @param index Index of the slot
+ */
+static void cascade(struct timer_wheel *wheel, int32_t level, uint64_t index)
+{
+    struct timer *timer = wheel->slots[level][index];
+
+    wheel->slots[level][index] = NULL;
+
+    while (timer != NULL) {
+        struct timer *next = timer->next;
+        link_timer(wheel, timer);
+        timer = next;
+    }
+}
+
+/**
+ * @brief Expire the timers of the next tick
+ * @param wheel Wheel
+ */
+static void expire_tick(struct timer_wheel *wheel)
+{
+    uint64_t tick = wheel->now;
+
+    /* A slot of the next level is entered each time the level wraps */
+    for (int32_t level = 1; level < TIMER_WHEEL_NUM_LEVELS; level++) {
+        if (((tick >> (TIMER_WHEEL_LEVEL_BITS * (level - 1))) & SLOT_MASK) !=
+            0) {
+            break;
+        }
+
+        cascade(wheel, level,
+                (tick >> (TIMER_WHEEL_LEVEL_BITS * level)) & SLOT_MASK);
+    }
+
+    /*
+     * The list is moved out of the wheel, so timers added by callbacks land
+     * in later ticks, and cancelled ones are unlinked from this list
+     */
+    struct timer *expired = wheel->slots[0][tick & SLOT_MASK];
+
+    wheel->slots[0][tick & SLOT_MASK] = NULL;
+    wheel->now = tick + 1;
+
+    if (expired != NULL) {
+        expired->prev = &expired;
+    }
+
+    while (expired != NULL) {
+        struct timer *timer = expired;
+
+        unlink_timer(wheel, timer);
+        timer->callback(timer);
+    }
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(struct timer_wheel));
+    wheel->now = now;
+}
+
+void timer_wheel_add(struct timer_wheel *wheel, struct timer *timer,
+                     uint64_t expires)
+{
+    timer_wheel_cancel(wheel, timer);
+
+    timer->expires = expires < wheel->now ? wheel->now : expires;
+    link_timer(wheel, timer);
+    wheel->count++;
+}
+
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+    if (timer->prev != NULL) {
+        unlink_timer(wheel, timer);
+    }
+}
+
+bool_t timer_is_pending(const struct timer *timer)
+{
+    return timer->prev != NULL;
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now)
+{
+    while (wheel->now <= now) {
+        /* An empty wheel skips the idle ticks at once */
+        if (wheel->count == 0) {
+            wheel->now = now + 1;
+            return;
+        }
+
+        expire_tick(wheel);
+    }
+}
@@ -0,0 +1,111 @@
+/**
+ * @file timer_wheel.h
+ * @brief This file contains declarations for the hierarchical timer wheel
+ * used by the event loops.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "global.h"
+
+/* Each level has 2^TIMER_WHEEL_LEVEL_BITS slots */
+#define TIMER_WHEEL_LEVEL_BITS 6
+
+/* Number of levels, timers further than 2^24 ticks wait in the last one */
+#define TIMER_WHEEL_NUM_LEVELS 4
+
+#define TIMER_WHEEL_NUM_SLOTS (1u << TIMER_WHEEL_LEVEL_BITS)
+
+/**
+ * @brief Timer linked into a slot of a wheel. Structures which need a timer
+ * embed it, it must be zeroed before the first use.
+ */
+struct timer {
+    struct timer *next;
+    /* Link which points to the timer, NULL while the timer is not pending */
+    struct timer **prev;
+    /* Tick at which the timer expires */
+    uint64_t expires;
+    /* Called by timer_wheel_advance once the timer expired */
+    void (*callback)(struct timer *timer);
+};
+
+/**
+ * @brief Wheel of timers. Level 0 has a slot per tick, a slot of each next
+ * level spans all slots of the previous one. Timers are moved to a lower
+ * level once the wheel reaches their slot, so each timer is moved at most
+ * once per level.
+ */
+struct timer_wheel {
+    /* Next tick to expire */
+    uint64_t now;
+    /* Number of pending timers */
+    size_t count;
+    struct timer *slots[TIMER_WHEEL_NUM_LEVELS][TIMER_WHEEL_NUM_SLOTS];
+};
+
+/**
+ * @brief Initialize an empty wheel
+ * @param wheel Wheel
+ * @param now Current tick
+ */
+extern void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+
+/**
+ * @brief Schedule a timer, a pending timer is moved. Timers which expire
+ * before the next tick of the wheel expire at that tick. O(1).
+ * @param wheel Wheel
+ * @param timer Timer with the callback set
+ * @param expires Tick at which the timer expires
+ */
+extern void timer_wheel_add(struct timer_wheel *wheel, struct timer *timer,
+                            uint64_t expires);
+
+/**
+ * @brief Cancel a timer, a timer which is not pending is ignored. O(1).
+ * @param wheel Wheel which has the timer
+ * @param timer Timer
+ */
+extern void timer_wheel_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+/**
+ * @brief Check if a timer waits in a wheel
+ * @param timer Timer
+ * @return true if the timer is pending, false if not
+ */
+extern bool_t timer_is_pending(const struct timer *timer);
+
+/**
+ * @brief Expire all timers up to the tick. Callbacks may add and cancel any
+ * timers of the wheel. O(1) per tick passed and per expired timer.
+ * @param wheel Wheel
+ * @param now Current tick
+ */
+extern void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now);
+
+#endif /* TIMER_WHEEL_H_ */
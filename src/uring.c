@@ -0,0 +1,280 @@
+/**
+ * @file uring.c
+ * @brief This file contains definitions of the minimal io_uring wrapper.
+ * Only the subset needed by the event loops is implemented, so the server
+ * does not depend on liburing.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "global.h"
+
+/**
+ * @brief Load a ring index written by the kernel
+ */
+static uint32_t load_acquire(const uint32_t *ptr)
+{
+    return atomic_load_explicit((_Atomic uint32_t *)ptr, memory_order_acquire);
+}
+
+/**
+ * @brief Publish a ring index to the kernel
+ */
+static void store_release(uint32_t *ptr, uint32_t value)
+{
+    atomic_store_explicit((_Atomic uint32_t *)ptr, value, memory_order_release);
+}
+
+/**
+ * @brief Map submission and completion rings
+ * @param ring Ring with valid descriptor
+ * @param params Parameters returned by io_uring_setup
+ * @return 0 for success or -1 for errors
+ */
+static int32_t map_rings(struct uring *ring, const struct io_uring_params *p)
+{
+    ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size =
+        p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring =
+        mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        return -1;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring =
+            mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        return -1;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    ring->sq_head = (uint32_t *)(sq + p->sq_off.head);
+    ring->sq_tail = (uint32_t *)(sq + p->sq_off.tail);
+    ring->sq_mask = *(uint32_t *)(sq + p->sq_off.ring_mask);
+    ring->sq_entries = *(uint32_t *)(sq + p->sq_off.ring_entries);
+    ring->sq_array = (uint32_t *)(sq + p->sq_off.array);
+
+    uint8_t *cq = ring->cq_ring;
+    ring->cq_head = (uint32_t *)(cq + p->cq_off.head);
+    ring->cq_tail = (uint32_t *)(cq + p->cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(cq + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+    return 0;
+}
+
+int32_t uring_init(struct uring *ring, uint32_t entries, uint32_t cq_entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(struct uring));
+
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+
+    ring->fd = (int32_t)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+
+    ring->features = params.features;
+
+    if (map_rings(ring, &params) == -1) {
+        close(ring->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/**
+ * @brief Pass prepared entries to the kernel and optionally wait
+ * @param ring Ring
+ * @param wait_nr Minimum number of completions to wait for
+ * @return 0 for success or -1 for errors
+ */
+static int32_t enter(struct uring *ring, uint32_t wait_nr)
+{
+    uint32_t tail = *ring->sq_tail;
+
+    for (uint32_t i = 0; i < ring->sq_pending; i++) {
+        uint32_t index = (tail + i) & ring->sq_mask;
+        ring->sq_array[index] = index;
+    }
+
+    store_release(ring->sq_tail, tail + ring->sq_pending);
+
+    uint32_t to_submit = ring->sq_pending;
+    uint32_t flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    ring->sq_pending = 0;
+
+    while (true) {
+        long result = syscall(__NR_io_uring_enter, ring->fd, to_submit,
+                              wait_nr, flags, NULL, 0);
+
+        if (result >= 0) {
+            return 0;
+        }
+
+        if (errno != EINTR) {
+            return -1;
+        }
+
+        /* Entries were consumed before the wait was interrupted */
+        to_submit = 0;
+    }
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    uint32_t head = load_acquire(ring->sq_head);
+    uint32_t tail = *ring->sq_tail + ring->sq_pending;
+
+    if (tail - head >= ring->sq_entries) {
+        if (enter(ring, 0) == -1) {
+            return NULL;
+        }
+
+        head = load_acquire(ring->sq_head);
+        tail = *ring->sq_tail;
+
+        if (tail - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_pending++;
+
+    return sqe;
+}
+
+int32_t uring_submit_and_wait(struct uring *ring, uint32_t wait_nr)
+{
+    return enter(ring, wait_nr);
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    uint32_t head = *ring->cq_head;
+
+    if (head == load_acquire(ring->cq_tail)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+    store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+int32_t uring_register(struct uring *ring, uint32_t opcode, const void *arg,
+                       uint32_t nr_args)
+{
+    long result;
+
+    do {
+        result = syscall(__NR_io_uring_register, ring->fd, opcode, arg,
+                         nr_args);
+    } while (result == -1 && errno == EINTR);
+
+    return result < 0 ? -1 : 0;
+}
+
+bool_t uring_supports(struct uring *ring, const uint8_t *ops, size_t count)
+{
+    size_t probe_size =
+        sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    bool_t result = true;
+
+    if (uring_register(ring, IORING_REGISTER_PROBE, probe, 256) == -1) {
+        free(probe);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i] > probe->last_op ||
+            !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            result = false;
+            break;
+        }
+    }
+
+    free(probe);
+
+    return result;
+}
@@ -0,0 +1,132 @@
+/**
+ * @file uring.h
+ * @brief This file contains declarations of a minimal io_uring wrapper used
+ * by the event loops.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "global.h"
+
+/**
+ * @brief Submission and completion rings shared with the kernel
+ */
+struct uring {
+    int32_t fd;
+    uint32_t features;
+
+    /* Submission queue */
+    void *sq_ring;
+    size_t sq_ring_size;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* Number of prepared entries not yet passed to the kernel */
+    uint32_t sq_pending;
+
+    /* Completion queue */
+    void *cq_ring;
+    size_t cq_ring_size;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+/**
+ * @brief Create rings and map them into the process
+ * @param ring Ring to initialize
+ * @param entries Number of submission queue entries
+ * @param cq_entries Number of completion queue entries
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t uring_init(struct uring *ring, uint32_t entries,
+                          uint32_t cq_entries);
+
+/**
+ * @brief Unmap rings and close the ring descriptor
+ * @param ring Ring to destroy
+ */
+extern void uring_destroy(struct uring *ring);
+
+/**
+ * @brief Get a free submission queue entry. If the queue is full, the pending
+ * entries are submitted first.
+ * @param ring Ring
+ * @return Zeroed entry or NULL for errors
+ */
+extern struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/**
+ * @brief Submit pending entries and wait for completions
+ * @param ring Ring
+ * @param wait_nr Minimum number of completions to wait for
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t uring_submit_and_wait(struct uring *ring, uint32_t wait_nr);
+
+/**
+ * @brief Get the next completion without waiting
+ * @param ring Ring
+ * @return Completion or NULL if there are none
+ */
+extern struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+/**
+ * @brief Mark the completion returned by uring_peek_cqe as consumed
+ * @param ring Ring
+ */
+extern void uring_cqe_seen(struct uring *ring);
+
+/**
+ * @brief Register resources of the ring, see io_uring_register(2)
+ * @param ring Ring
+ * @param opcode Registration opcode
+ * @param arg Opcode argument
+ * @param nr_args Number of arguments
+ * @return 0 for success or -1 for errors
+ */
+extern int32_t uring_register(struct uring *ring, uint32_t opcode,
+                              const void *arg, uint32_t nr_args);
+
+/**
+ * @brief Check that the kernel supports all specified operations
+ * @param ring Ring
+ * @param ops Operations
+ * @param count Number of operations
+ * @return true if all operations are supported, false if not
+ */
+extern bool_t uring_supports(struct uring *ring, const uint8_t *ops,
+                             size_t count);
+
+#endif /* URING_H_ */
@@ -0,0 +1,289 @@
+/**
+ * @file logdecode.c
+ * @brief This file contains the decoder turning binary logs of the server
+ * into the text format of its log files.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "global.h"
+#include "log.h"
+#include "log_binary.h"
+
+/* Size of a decoded message, longer messages are truncated */
+#define MESSAGE_SIZE 4096
+
+/* Length of a formatted timestamp with the terminating null */
+#define TIMESTAMP_SIZE 20
+
+/**
+ * @brief Format strings and clocks of the run which wrote the records
+ */
+struct decoder {
+    char_t **formats;
+    uint32_t num_formats;
+    char_t program[256];
+    /* Realtime clock minus monotonic clock of the run, ns */
+    int64_t clock_offset;
+    bool_t has_clock;
+};
+
+static const char_t *level_names[] = {[LOG_LEVEL_ERROR] = "ERROR",
+                                      [LOG_LEVEL_WARNING] = "WARNING",
+                                      [LOG_LEVEL_INFO] = "INFO",
+                                      [LOG_LEVEL_DEBUG] = "DEBUG"};
+
+/**
+ * @brief Forget format strings of the previous run
+ */
+static void reset_formats(struct decoder *decoder)
+{
+    for (uint32_t i = 0; i < decoder->num_formats; i++) {
+        free(decoder->formats[i]);
+    }
+
+    free(decoder->formats);
+    decoder->formats = NULL;
+    decoder->num_formats = 0;
+}
+
+/**
+ * @brief Process a clock record
+ * @return 0 for success or -1 for malformed records
+ */
+static int32_t on_clock(struct decoder *decoder, const uint8_t *payload,
+                        size_t size)
+{
+    int64_t clocks[2];
+
+    if (size < sizeof(clocks)) {
+        return -1;
+    }
+
+    memcpy(clocks, payload, sizeof(clocks));
+    decoder->clock_offset = clocks[0] - clocks[1];
+    decoder->has_clock = true;
+
+    size_t length = size - sizeof(clocks);
+    if (length >= sizeof(decoder->program)) {
+        length = sizeof(decoder->program) - 1;
+    }
+
+    memcpy(decoder->program, payload + sizeof(clocks), length);
+    decoder->program[length] = '\0';
+
+    reset_formats(decoder);
+
+    return 0;
+}
+
+/**
+ * @brief Process a format record
+ * @return 0 for success or -1 for malformed records or errors
+ */
+static int32_t on_format(struct decoder *decoder, const uint8_t *payload,
+                         size_t size)
+{
+    uint32_t id;
+
+    if (size < sizeof(id)) {
+        return -1;
+    }
+
+    memcpy(&id, payload, sizeof(id));
+
+    /* Ids are assigned in order */
+    if (id != decoder->num_formats) {
+        return -1;
+    }
+
+    size_t length = size - sizeof(id);
+    char_t *format = malloc(length + 1);
+    if (format == NULL) {
+        return -1;
+    }
+
+    memcpy(format, payload + sizeof(id), length);
+    format[length] = '\0';
+
+    /* The old array stays valid if it cannot grow */
+    char_t **formats =
+        realloc(decoder->formats, (id + 1) * sizeof(*decoder->formats));
+    if (formats == NULL) {
+        free(format);
+        return -1;
+    }
+
+    decoder->formats = formats;
+    decoder->formats[id] = format;
+    decoder->num_formats++;
+
+    return 0;
+}
+
+/**
+ * @brief Process a message record
+ * @return 0 for success or -1 for malformed records
+ */
+static int32_t on_message(struct decoder *decoder, uint8_t level,
+                          const uint8_t *payload, size_t size)
+{
+    uint32_t id;
+    uint64_t time_ns;
+
+    if (!decoder->has_clock || size < sizeof(id) + sizeof(time_ns) ||
+        level > LOG_LEVEL_DEBUG) {
+        return -1;
+    }
+
+    memcpy(&id, payload, sizeof(id));
+    memcpy(&time_ns, payload + sizeof(id), sizeof(time_ns));
+
+    if (id >= decoder->num_formats) {
+        return -1;
+    }
+
+    const uint8_t *args = payload + sizeof(id) + sizeof(time_ns);
+    size_t args_size = size - sizeof(id) - sizeof(time_ns);
+
+    char_t message[MESSAGE_SIZE];
+    int32_t result = log_binary_format(decoder->formats[id], args, args_size,
+                                       message, sizeof(message));
+
+    time_t seconds =
+        (time_t)(((int64_t)time_ns + decoder->clock_offset) / 1000000000);
+    struct tm current_tm;
+    localtime_r(&seconds, &current_tm);
+
+    char_t timestamp[TIMESTAMP_SIZE];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &current_tm);
+
+    printf("%s: %s [%s] %s%s\n", decoder->program, timestamp,
+           level_names[level], message, result == -1 ? " <truncated>" : "");
+
+    return 0;
+}
+
+/**
+ * @brief Decode a binary log
+ * @param file Binary log
+ * @return 0 for success or -1 for errors
+ */
+static int32_t decode(FILE *file)
+{
+    char_t magic[LOG_BINARY_MAGIC_SIZE];
+
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, LOG_BINARY_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "Not a binary log\n");
+        return -1;
+    }
+
+    struct decoder decoder = {0};
+    static uint8_t payload[UINT16_MAX];
+    int32_t result = 0;
+    uint64_t offset = sizeof(magic);
+
+    while (true) {
+        struct log_binary_header header;
+        size_t count = fread(&header, 1, sizeof(header), file);
+
+        if (count == 0) {
+            break;
+        }
+
+        if (count != sizeof(header) ||
+            fread(payload, 1, header.size, file) != header.size) {
+            fprintf(stderr, "Truncated record at offset %" PRIu64 "\n", offset);
+            result = -1;
+            break;
+        }
+
+        switch (header.type) {
+        case LOG_BINARY_RECORD_CLOCK:
+            result = on_clock(&decoder, payload, header.size);
+            break;
+        case LOG_BINARY_RECORD_FORMAT:
+            result = on_format(&decoder, payload, header.size);
+            break;
+        case LOG_BINARY_RECORD_MESSAGE:
+            result = on_message(&decoder, header.level, payload, header.size);
+            break;
+        default:
+            result = -1;
+            break;
+        }
+
+        if (result == -1) {
+            fprintf(stderr, "Malformed record at offset %" PRIu64 "\n", offset);
+            break;
+        }
+
+        offset += sizeof(header) + header.size;
+    }
+
+    reset_formats(&decoder);
+
+    return result;
+}
+
+int32_t main(int32_t argc, char_t *argv[])
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "-h") == 0)) {
+        printf("Usage:\n"
+               "  %s [FILE_NAME]\n"
+               "\n"
+               "Write messages of the binary log FILE_NAME, or of the standard\n"
+               "input, to the standard output in the text format.\n",
+               PROGRAM_NAME);
+        return argc == 2 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    FILE *file = stdin;
+
+    if (argc == 2) {
+        file = fopen(argv[1], "rb");
+
+        if (file == NULL) {
+            fprintf(stderr, "Unable to open %s: %s\n", argv[1],
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    int32_t result = decode(file);
+
+    if (file != stdin) {
+        fclose(file);
+    }
+
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,400 @@
+/**
+ * @file top.c
+ * @brief This file contains the viewer showing the live counters of a running
+ * server and their rates.
+ *
+ * @author Vladimir Klukvin <vladimir.klukvin@yandex.com>
+ * @copyright Copyright (c) 2021 Balt-System Ltd. <info@bsystem.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "global.h"
+#include "protocol.h"
+#include "stats.h"
+
+/* Number of busiest sessions shown */
+#define TOP_SESSIONS 10
+
+/**
+ * @brief Values of the counters of one session at the previous refresh
+ */
+struct session_sample {
+    uint32_t generation;
+    uint64_t requests[STATS_NUM_ROLES];
+    uint64_t bytes[STATS_NUM_ROLES];
+    uint64_t codec_time;
+};
+
+/**
+ * @brief Values of the counters at the previous refresh
+ */
+struct sample {
+    int64_t counters[STATS_NUM_COUNTERS];
+    uint64_t requests[STATS_NUM_REQUEST_TYPES];
+    uint64_t request_bytes[STATS_NUM_REQUEST_TYPES];
+    struct session_sample *sessions;
+};
+
+/**
+ * @brief Rate of a session since the previous refresh
+ */
+struct session_rate {
+    uint32_t id;
+    double requests[STATS_NUM_ROLES];
+    double bytes[STATS_NUM_ROLES];
+    /* Original size of compressed bodies by their compressed size */
+    double ratio;
+    /* Share of one CPU spent on the codec, in percent */
+    double codec_load;
+};
+
+static const char_t *request_names[STATS_NUM_REQUEST_TYPES] = {
+    [REQUEST_MAKE_SESSION] = "MAKE_SESSION",
+    [REQUEST_JOIN_SESSION] = "JOIN_SESSION",
+    [REQUEST_CLOSE_SESSION] = "CLOSE_SESSION",
+    [REQUEST_RAISE_EVENT] = "RAISE_EVENT",
+    [REQUEST_DATA] = "DATA",
+    [REQUEST_DATA_COMPRESSED] = "DATA_COMPRESSED",
+    [REQUEST_HEARTBEAT] = "HEARTBEAT"};
+
+/**
+ * @brief Map the segment of the server
+ * @param port Port of the server
+ * @param size Set to the size of the mapping
+ * @return Segment or NULL for errors
+ */
+static const struct stats_segment *map_segment(uint16_t port, size_t *size)
+{
+    char_t name[64];
+    snprintf(name, sizeof(name), STATS_SEGMENT_NAME_FORMAT, port);
+
+    int32_t fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+        (size_t)st.st_size < sizeof(struct stats_segment)) {
+        fprintf(stderr, "Stats segment %s is not ready\n", name);
+        close(fd);
+        return NULL;
+    }
+
+    void *memory = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Unable to map %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    const struct stats_segment *segment = memory;
+    size_t expected = sizeof(struct stats_segment) +
+                      segment->num_sessions * sizeof(struct stats_session);
+
+    if (memcmp(segment->magic, STATS_SEGMENT_MAGIC,
+               sizeof(STATS_SEGMENT_MAGIC)) != 0 ||
+        segment->version != STATS_SEGMENT_VERSION ||
+        expected > (size_t)st.st_size) {
+        fprintf(stderr, "Stats segment %s has unknown format\n", name);
+        munmap(memory, (size_t)st.st_size);
+        return NULL;
+    }
+
+    *size = (size_t)st.st_size;
+
+    return segment;
+}
+
+/**
+ * @brief Read a counter of the segment
+ */
+static uint64_t load(const atomic_uint_least64_t *counter)
+{
+    return atomic_load_explicit((atomic_uint_least64_t *)counter,
+                                memory_order_relaxed);
+}
+
+/**
+ * @brief Compare sessions by their total byte rate, busiest first
+ */
+static int compare_rates(const void *left, const void *right)
+{
+    const struct session_rate *a = left;
+    const struct session_rate *b = right;
+    double total_a = a->bytes[ROLE_HOST] + a->bytes[ROLE_TARGET];
+    double total_b = b->bytes[ROLE_HOST] + b->bytes[ROLE_TARGET];
+
+    return (total_a < total_b) - (total_a > total_b);
+}
+
+/**
+ * @brief Read the counters of the sessions, print the busiest ones and
+ * remember the values for the next refresh
+ */
+static void show_sessions(const struct stats_segment *segment,
+                          struct sample *sample, double interval)
+{
+    struct session_rate top[TOP_SESSIONS + 1];
+    size_t num_top = 0;
+    size_t num_open = 0;
+
+    for (uint32_t id = 0; id < segment->num_sessions; id++) {
+        const struct stats_session *session = &segment->sessions[id];
+        struct session_sample *previous = &sample->sessions[id];
+        uint32_t generation = atomic_load_explicit(
+            (atomic_uint_least32_t *)&session->generation,
+            memory_order_acquire);
+
+        if ((generation & 1) == 0) {
+            previous->generation = generation;
+            continue;
+        }
+
+        /* The session was reopened since the previous refresh */
+        if (generation != previous->generation) {
+            memset(previous, 0, sizeof(*previous));
+            previous->generation = generation;
+        }
+
+        struct session_rate rate = {.id = id};
+
+        for (size_t role = 0; role < STATS_NUM_ROLES; role++) {
+            uint64_t requests = load(&session->requests[role]);
+            uint64_t bytes = load(&session->bytes[role]);
+
+            rate.requests[role] =
+                (double)(requests - previous->requests[role]) / interval;
+            rate.bytes[role] = (double)(bytes - previous->bytes[role]) /
+                               interval;
+
+            previous->requests[role] = requests;
+            previous->bytes[role] = bytes;
+        }
+
+        uint64_t raw_bytes = load(&session->raw_bytes);
+        uint64_t compressed_bytes = load(&session->compressed_bytes);
+        uint64_t codec_time = load(&session->codec_time);
+
+        rate.ratio = compressed_bytes > 0
+                         ? (double)raw_bytes / (double)compressed_bytes
+                         : 0;
+        rate.codec_load = (double)(codec_time - previous->codec_time) /
+                          interval / 1e7;
+        previous->codec_time = codec_time;
+
+        num_open++;
+
+        /* Insertion into the short sorted list of the busiest sessions */
+        top[num_top] = rate;
+        if (num_top < TOP_SESSIONS) {
+            num_top++;
+        }
+        qsort(top, num_top, sizeof(*top), compare_rates);
+    }
+
+    printf("\nBusiest of %zu open sessions:\n", num_open);
+    printf("%6s %14s %14s %14s %14s %7s %7s\n", "ID", "Host req/s",
+           "Host KiB/s", "Target req/s", "Target KiB/s", "Ratio", "Codec%");
+
+    for (size_t i = 0; i < num_top; i++) {
+        printf("%6" PRIu32 " %14.1f %14.1f %14.1f %14.1f %7.2f %7.1f\n",
+               top[i].id, top[i].requests[ROLE_HOST],
+               top[i].bytes[ROLE_HOST] / 1024, top[i].requests[ROLE_TARGET],
+               top[i].bytes[ROLE_TARGET] / 1024, top[i].ratio,
+               top[i].codec_load);
+    }
+}
+
+/**
+ * @brief Print the counters of the segment and their rates
+ */
+static void show(const struct stats_segment *segment, struct sample *sample,
+                 double interval, bool_t is_tty)
+{
+    int64_t counters[STATS_NUM_COUNTERS];
+    double rates[STATS_NUM_COUNTERS];
+
+    for (size_t i = 0; i < STATS_NUM_COUNTERS; i++) {
+        counters[i] = atomic_load_explicit(
+            (atomic_int_least64_t *)&segment->counters[i],
+            memory_order_relaxed);
+        rates[i] = (double)(counters[i] - sample->counters[i]) / interval;
+        sample->counters[i] = counters[i];
+    }
+
+    if (is_tty) {
+        /* Move the cursor home and clear the screen */
+        printf("\033[H\033[2J");
+    }
+
+    time_t uptime = time(NULL) - (time_t)segment->start_time;
+
+    printf("baltmonitor-remote, pid %" PRId64 ", up %02lld:%02lld:%02lld\n\n",
+           segment->pid, (long long)uptime / 3600,
+           (long long)uptime / 60 % 60, (long long)uptime % 60);
+    printf("Connections: %" PRId64 " active, %" PRId64
+           " accepted (%.1f/s), %" PRId64 " rejected (%.1f/s)\n",
+           counters[STATS_CONNECTIONS_ACTIVE],
+           counters[STATS_CONNECTIONS_ACCEPTED],
+           rates[STATS_CONNECTIONS_ACCEPTED],
+           counters[STATS_CONNECTIONS_REJECTED],
+           rates[STATS_CONNECTIONS_REJECTED]);
+    printf("Sessions:    %" PRId64 " active, %" PRId64 " created (%.1f/s)\n",
+           counters[STATS_SESSIONS_ACTIVE], counters[STATS_SESSIONS_CREATED],
+           rates[STATS_SESSIONS_CREATED]);
+    printf("Errors:      %" PRId64 " bad requests (%.1f/s), %" PRId64
+           " send errors (%.1f/s)\n",
+           counters[STATS_BAD_REQUESTS], rates[STATS_BAD_REQUESTS],
+           counters[STATS_SEND_ERRORS], rates[STATS_SEND_ERRORS]);
+    printf("Zero-copy:   %" PRId64 " sends (%.1f/s), %" PRId64
+           " without copy, %" PRId64 " copied by the kernel\n",
+           counters[STATS_ZEROCOPY_SENDS], rates[STATS_ZEROCOPY_SENDS],
+           counters[STATS_ZEROCOPY_COMPLETED], counters[STATS_ZEROCOPY_COPIED]);
+    printf("Timeouts:    %" PRId64 " idle connections (%.1f/s), %" PRId64
+           " orphaned targets (%.1f/s)\n",
+           counters[STATS_IDLE_TIMEOUTS], rates[STATS_IDLE_TIMEOUTS],
+           counters[STATS_ORPHAN_EXPIRIES], rates[STATS_ORPHAN_EXPIRIES]);
+
+    printf("\n%-16s %14s %12s %14s %12s\n", "Request", "Count", "Rate/s",
+           "Bytes", "KiB/s");
+
+    for (size_t i = 0; i < STATS_NUM_REQUEST_TYPES; i++) {
+        uint64_t requests = load(&segment->requests[i]);
+        uint64_t bytes = load(&segment->request_bytes[i]);
+
+        printf("%-16s %14" PRIu64 " %12.1f %14" PRIu64 " %12.1f\n",
+               request_names[i], requests,
+               (double)(requests - sample->requests[i]) / interval, bytes,
+               (double)(bytes - sample->request_bytes[i]) / interval / 1024);
+
+        sample->requests[i] = requests;
+        sample->request_bytes[i] = bytes;
+    }
+
+    show_sessions(segment, sample, interval);
+
+    fflush(stdout);
+}
+
+/**
+ * @brief Print usage of the viewer
+ */
+static void usage(void)
+{
+    printf("Usage:\n"
+           "  %s [-p PORT_NUM] [-i SECONDS] [-n COUNT] | [-h]\n"
+           "\n"
+           "Options:\n"
+           "  -p, --port=PORT_NUM      show the server listening PORT_NUM,\n"
+           "                           default: 65000\n"
+           "  -i, --interval=SECONDS   refresh every SECONDS, default: 1\n"
+           "  -n, --count=COUNT        exit after COUNT refreshes\n"
+           "  -h, --help               give this help list\n"
+           "\n"
+           "Rates of the first refresh are averages since the server started.\n",
+           PROGRAM_NAME);
+}
+
+int32_t main(int32_t argc, char_t *argv[])
+{
+    int32_t port = 65000;
+    double interval = 1;
+    int64_t count = -1;
+
+    static struct option long_options[] = {
+        {"port", required_argument, NULL, 'p'},
+        {"interval", required_argument, NULL, 'i'},
+        {"count", required_argument, NULL, 'n'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, false, NULL, '\0'}};
+
+    while (true) {
+        int c = getopt_long(argc, argv, "p:i:n:h", long_options, NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'i':
+            interval = atof(optarg);
+            if (interval <= 0) {
+                printf("Invalid interval: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            count = atoll(optarg);
+            break;
+        case 'h':
+        default: /* '?' */
+            usage();
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    size_t size;
+    const struct stats_segment *segment = map_segment((uint16_t)port, &size);
+
+    if (segment == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct sample sample = {0};
+    sample.sessions = calloc(segment->num_sessions, sizeof(*sample.sessions));
+
+    bool_t is_tty = isatty(STDOUT_FILENO);
+    double elapsed = (double)(time(NULL) - (time_t)segment->start_time);
+
+    show(segment, &sample, elapsed > 0 ? elapsed : 1, is_tty);
+
+    struct timespec delay = {.tv_sec = (time_t)interval,
+                             .tv_nsec = (long)((interval - (time_t)interval) *
+                                               1e9)};
+
+    for (int64_t i = 1; count < 0 || i < count; i++) {
+        nanosleep(&delay, NULL);
+        show(segment, &sample, interval, is_tty);
+    }
+
+    free(sample.sessions);
+    munmap((void *)segment, size);
+
+    return EXIT_SUCCESS;
+}